@@ -0,0 +1,61 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The CHECK macros of base/logging.h that speedy uses, for builds outside a
+// tree that has it.  A failed CHECK prints the condition, the file and line and
+// anything streamed into it, e.g.
+//   CHECK(!path.empty()) << "Compute() did not keep the path";
+// and aborts.  CHECKs are evaluated in every build, as they are there.
+
+#ifndef SPEEDY_COMPAT_BASE_LOGGING_H_
+#define SPEEDY_COMPAT_BASE_LOGGING_H_
+
+#include <cstdlib>
+#include <iostream>
+
+namespace speedy_compat {
+
+class CheckFailure {
+ public:
+  CheckFailure(const char* file, int line, const char* condition) {
+    std::cerr << file << ":" << line << "] Check failed: " << condition << " ";
+  }
+  CheckFailure(const CheckFailure&) = delete;
+  CheckFailure& operator=(const CheckFailure&) = delete;
+  [[noreturn]] ~CheckFailure() {
+    std::cerr << std::endl;
+    std::abort();
+  }
+
+  template <typename T>
+  CheckFailure& operator<<(const T& value) {
+    std::cerr << value;
+    return *this;
+  }
+};
+
+}  // namespace speedy_compat
+
+#define CHECK(condition)                                                  \
+  while (!(condition))                                                    \
+  ::speedy_compat::CheckFailure(__FILE__, __LINE__, #condition)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+#define CHECK_NE(a, b) CHECK((a) != (b))
+#define CHECK_LT(a, b) CHECK((a) < (b))
+#define CHECK_LE(a, b) CHECK((a) <= (b))
+#define CHECK_GT(a, b) CHECK((a) > (b))
+#define CHECK_GE(a, b) CHECK((a) >= (b))
+
+#endif  // SPEEDY_COMPAT_BASE_LOGGING_H_
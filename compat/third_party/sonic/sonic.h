@@ -0,0 +1,22 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sonic, checked out in sonic/ next to speedy.
+
+#ifndef SPEEDY_COMPAT_THIRD_PARTY_SONIC_SONIC_H_
+#define SPEEDY_COMPAT_THIRD_PARTY_SONIC_SONIC_H_
+
+#include "../../../sonic/sonic.h"  // IWYU pragma: export
+
+#endif  // SPEEDY_COMPAT_THIRD_PARTY_SONIC_SONIC_H_
@@ -15,13 +15,124 @@
 #include "third_party/speedy/dynamic_time_warping.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <utility>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DTW_HAVE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define DTW_HAVE_NEON
+#endif
+
 #include "base/logging.h"
 #include "third_party/absl/synchronization/mutex.h"
 
+namespace {
+
+// The sums of |a-b|, (a-b)^2 or a*b (with the squares of a and b) over the
+// points, as 4 partial sums when SIMD is available.
+enum class SumKind { kAbsoluteDifference, kSquaredDifference, kProducts };
+
+#ifdef DTW_HAVE_SSE2
+float HorizontalSum(__m128 x) {
+  __m128 high = _mm_movehl_ps(x, x);
+  __m128 sums = _mm_add_ps(x, high);
+  return _mm_cvtss_f32(_mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1)));
+}
+#endif
+
+// Returns the sum of kind, and for kProducts also the sums of a*a and b*b.
+template <SumKind kind>
+float Sum(const float* a, const float* b, std::size_t dimension,
+          float* a_squares = nullptr, float* b_squares = nullptr) {
+  std::size_t i = 0;
+  float sum = 0.0f, a_sum = 0.0f, b_sum = 0.0f;
+#if defined(DTW_HAVE_SSE2)
+  __m128 sums = _mm_setzero_ps();
+  __m128 a_sums = _mm_setzero_ps();
+  __m128 b_sums = _mm_setzero_ps();
+  const __m128 sign_mask = _mm_set1_ps(-0.0f);
+  for (; i + 4 <= dimension; i += 4) {
+    const __m128 x = _mm_loadu_ps(a + i);
+    const __m128 y = _mm_loadu_ps(b + i);
+    if (kind == SumKind::kAbsoluteDifference) {
+      sums = _mm_add_ps(sums, _mm_andnot_ps(sign_mask, _mm_sub_ps(x, y)));
+    } else if (kind == SumKind::kSquaredDifference) {
+      const __m128 difference = _mm_sub_ps(x, y);
+      sums = _mm_add_ps(sums, _mm_mul_ps(difference, difference));
+    } else {
+      sums = _mm_add_ps(sums, _mm_mul_ps(x, y));
+      a_sums = _mm_add_ps(a_sums, _mm_mul_ps(x, x));
+      b_sums = _mm_add_ps(b_sums, _mm_mul_ps(y, y));
+    }
+  }
+  sum = HorizontalSum(sums);
+  a_sum = HorizontalSum(a_sums);
+  b_sum = HorizontalSum(b_sums);
+#elif defined(DTW_HAVE_NEON)
+  float32x4_t sums = vdupq_n_f32(0.0f);
+  float32x4_t a_sums = vdupq_n_f32(0.0f);
+  float32x4_t b_sums = vdupq_n_f32(0.0f);
+  for (; i + 4 <= dimension; i += 4) {
+    const float32x4_t x = vld1q_f32(a + i);
+    const float32x4_t y = vld1q_f32(b + i);
+    if (kind == SumKind::kAbsoluteDifference) {
+      sums = vaddq_f32(sums, vabdq_f32(x, y));
+    } else if (kind == SumKind::kSquaredDifference) {
+      const float32x4_t difference = vsubq_f32(x, y);
+      sums = vmlaq_f32(sums, difference, difference);
+    } else {
+      sums = vmlaq_f32(sums, x, y);
+      a_sums = vmlaq_f32(a_sums, x, x);
+      b_sums = vmlaq_f32(b_sums, y, y);
+    }
+  }
+  sum = vaddvq_f32(sums);
+  a_sum = vaddvq_f32(a_sums);
+  b_sum = vaddvq_f32(b_sums);
+#endif
+  for (; i < dimension; ++i) {
+    if (kind == SumKind::kAbsoluteDifference) {
+      sum += std::fabs(a[i] - b[i]);
+    } else if (kind == SumKind::kSquaredDifference) {
+      sum += (a[i] - b[i]) * (a[i] - b[i]);
+    } else {
+      sum += a[i] * b[i];
+      a_sum += a[i] * a[i];
+      b_sum += b[i] * b[i];
+    }
+  }
+  if (a_squares) *a_squares = a_sum;
+  if (b_squares) *b_squares = b_sum;
+  return sum;
+}
+
+}  // namespace
+
+float DtwL1Distance::operator()(const float* a, const float* b,
+                                std::size_t dimension) const {
+  return Sum<SumKind::kAbsoluteDifference>(a, b, dimension);
+}
+
+float DtwL2Distance::operator()(const float* a, const float* b,
+                                std::size_t dimension) const {
+  return std::sqrt(Sum<SumKind::kSquaredDifference>(a, b, dimension));
+}
+
+float DtwCosineDistance::operator()(const float* a, const float* b,
+                                    std::size_t dimension) const {
+  float a_squares, b_squares;
+  const float products =
+      Sum<SumKind::kProducts>(a, b, dimension, &a_squares, &b_squares);
+  if (a_squares <= 0.0f || b_squares <= 0.0f) return 1.0f;
+  return 1.0f - products / std::sqrt(a_squares * b_squares);
+}
+
 DynamicTimeWarping::DynamicTimeWarping(
     std::size_t dimension,
     std::function<float(const std::vector<float>&, const std::vector<float>&)>
@@ -63,24 +174,113 @@ void DynamicTimeWarping::ComputeCostMatrix(
   }
 }
 
-int DynamicTimeWarping::ArgMin(float a, float b, float c) const {
-  /* Do the test this way, with strict inequality so that default path is along
-   * the diagonal.
-   */
-  if (a < b && a < c) return -1;
-  if (c < a && c < b) return 1;
-  return 0;
+constexpr std::size_t DynamicTimeWarping::kMinStripWidth;
+
+std::size_t DynamicTimeWarping::StripCount(std::size_t width,
+                                           int thread_count) {
+  std::size_t strip_count = thread_count;
+  if (thread_count <= 0) {
+    strip_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::max<std::size_t>(
+      1, std::min(strip_count, width / kMinStripWidth));
+}
+
+DynamicTimeWarping::Workspace* DynamicTimeWarping::ThreadWorkspace() {
+  static thread_local Workspace workspace;
+  return &workspace;
+}
+
+void DynamicTimeWarping::PrepareBand(std::size_t height, std::size_t width,
+                                     int band_radius, bool keep_path,
+                                     Workspace* workspace) {
+  CHECK_GT(height, 0);
+  CHECK_GT(width, 0);
+  std::vector<std::size_t>& band_start = workspace->band_start_;
+  std::vector<std::size_t>& band_end = workspace->band_end_;
+  band_start.resize(height);
+  band_end.resize(height);
+  if (band_radius < 0 || height == 1) {
+    std::fill(band_start.begin(), band_start.end(), 0);
+    std::fill(band_end.begin(), band_end.end(), width);
+  } else {
+    // Row i is centered on column i * (width - 1) / (height - 1), rounded
+    // down for the start and up for the end.
+    const std::size_t radius = band_radius;
+    for (std::size_t i = 0; i < height; ++i) {
+      const std::size_t scaled = i * (width - 1);
+      const std::size_t low = scaled / (height - 1);
+      const std::size_t high = (scaled + height - 2) / (height - 1);
+      band_start[i] = low > radius ? low - radius : 0;
+      band_end[i] = std::min(high + radius + 1, width);
+    }
+  }
+  FinishBand(keep_path, workspace);
+}
+
+void DynamicTimeWarping::PrepareWindow(std::size_t height, std::size_t width,
+                                       const std::vector<int>& coarse_path1,
+                                       const std::vector<int>& coarse_path2,
+                                       int radius, Workspace* workspace) {
+  std::vector<std::size_t>& band_start = workspace->band_start_;
+  std::vector<std::size_t>& band_end = workspace->band_end_;
+  band_start.assign(height, width);
+  band_end.assign(height, 0);
+  // Coarse point i covers the points 2i and 2i + 1.
+  for (std::size_t k = 0; k < coarse_path1.size(); ++k) {
+    const long first_row = 2L * (coarse_path1[k] - radius);
+    const long last_row = 2L * (coarse_path1[k] + radius) + 1;
+    const long start = std::max(2L * (coarse_path2[k] - radius), 0L);
+    const long end = std::min(2L * (coarse_path2[k] + radius) + 2,
+                              static_cast<long>(width));
+    for (long i = std::max(first_row, 0L);
+         i <= std::min(last_row, static_cast<long>(height) - 1); ++i) {
+      band_start[i] = std::min<std::size_t>(band_start[i], start);
+      band_end[i] = std::max<std::size_t>(band_end[i], end);
+    }
+  }
+  FinishBand(true, workspace);
+}
+
+void DynamicTimeWarping::FinishBand(bool keep_path, Workspace* workspace) {
+  std::vector<std::size_t>& band_start = workspace->band_start_;
+  std::vector<std::size_t>& band_end = workspace->band_end_;
+  const std::size_t height = band_start.size();
+  // The rolling rows rely on the starts and ends never decreasing, and a
+  // steep band can leave a gap between rows, so extend each row up to the
+  // start of the next one.
+  for (std::size_t i = height - 1; i > 0; --i) {
+    band_start[i - 1] = std::min(band_start[i - 1], band_start[i]);
+  }
+  for (std::size_t i = 1; i < height; ++i) {
+    band_end[i] = std::max(band_end[i], band_end[i - 1]);
+  }
+  for (std::size_t i = 0; i + 1 < height; ++i) {
+    band_end[i] = std::max(band_end[i], band_start[i + 1]);
+  }
+  workspace->direction_offset_.resize(height);
+  std::size_t cells = 0;
+  for (std::size_t i = 0; i < height; ++i) {
+    workspace->direction_offset_[i] = cells;
+    cells += band_end[i] - band_start[i];
+  }
+  if (keep_path) {
+    workspace->best_directions_.resize(cells);
+  } else {
+    workspace->best_directions_.clear();
+  }
 }
 
 float DynamicTimeWarping::ComputeFromCostMatrix(int height, int width) const {
-  best_directions_.resize(height * width);
+  PrepareBand(height, width, -1, true, &workspace_);
+  std::vector<std::int8_t>& best_directions = workspace_.best_directions_;
   for (int j = 1; j < width; ++j) {
     cost_matrix_[j] += cost_matrix_[j - 1];
-    best_directions_[j] = 1;
+    best_directions[j] = 1;
   }
   for (int i = 1; i < height; ++i) {
     cost_matrix_[i * width] += cost_matrix_[(i - 1) * width];
-    best_directions_[i * width] = -1;
+    best_directions[i * width] = -1;
   }
   for (int i = 1; i < height; ++i) {
     for (int j = 1; j < width; ++j) {
@@ -88,7 +288,7 @@ float DynamicTimeWarping::ComputeFromCostMatrix(int height, int width) const {
           std::min(std::min(cost_matrix_[(i - 1) * width + j],
                             cost_matrix_[i * width + j - 1]),
                    cost_matrix_[(i - 1) * width + j - 1]);
-      best_directions_[i * width + j] =
+      best_directions[i * width + j] =
           ArgMin(cost_matrix_[(i - 1) * width + j],
                  cost_matrix_[(i - 1) * width + j - 1],
                  cost_matrix_[i * width + j - 1]);
@@ -102,14 +302,52 @@ void DynamicTimeWarping::BestPathSequence(
     const std::vector<std::vector<float>>& sequence1,
     const std::vector<std::vector<float>>& sequence2, std::vector<int>* path1,
     std::vector<int>* path2) const {
+  BestPathSequence(sequence1.size(), sequence2.size(), path1, path2);
+}
+
+void DynamicTimeWarping::HalveSequence(const float* sequence,
+                                       std::size_t length,
+                                       std::vector<float>* halved) const {
+  halved->resize((length + 1) / 2 * dimension_);
+  float* point = halved->data();
+  for (std::size_t i = 0; i < length; i += 2, point += dimension_) {
+    const float* first = sequence + i * dimension_;
+    if (i + 1 == length) {
+      std::copy(first, first + dimension_, point);
+      break;
+    }
+    const float* second = first + dimension_;
+    for (std::size_t k = 0; k < dimension_; ++k) {
+      point[k] = 0.5f * (first[k] + second[k]);
+    }
+  }
+}
+
+void DynamicTimeWarping::BestPathSequence(std::size_t length1,
+                                          std::size_t length2,
+                                          std::vector<int>* path1,
+                                          std::vector<int>* path2) const {
   CHECK_NE(nullptr, path1);
   CHECK_NE(nullptr, path2);
-  const auto height = sequence1.size();
-  const auto width = sequence2.size();
-
   absl::MutexLock lock(&mutex_);
+  TracePath(length1, length2, workspace_, path1, path2);
+}
+
+void DynamicTimeWarping::TracePath(std::size_t length1, std::size_t length2,
+                                   const Workspace& workspace,
+                                   std::vector<int>* path1,
+                                   std::vector<int>* path2) {
+  const int height = length1;
+  const int width = length2;
+  const std::size_t path_start = path1->size();
+  const std::vector<std::size_t>& band_start = workspace.band_start_;
+  const std::vector<std::size_t>& direction_offset =
+      workspace.direction_offset_;
+  const std::vector<std::int8_t>& best_directions = workspace.best_directions_;
+  CHECK_EQ(band_start.size(), length1);
+  CHECK(!best_directions.empty()) << "Compute() did not keep the path";
   for (int i = height - 1, j = width - 1; i >= 0 && j >= 0;) {
-    switch (best_directions_[i * width + j]) {
+    switch (best_directions[direction_offset[i] + j - band_start[i]]) {
       case -1:
         path1->push_back(i--);
         path2->push_back(j);
@@ -126,8 +364,8 @@ void DynamicTimeWarping::BestPathSequence(
         assert(false);
     }
   }
-  std::reverse(std::begin(*path1), std::end(*path1));
-  std::reverse(std::begin(*path2), std::end(*path2));
+  std::reverse(path1->begin() + path_start, path1->end());
+  std::reverse(path2->begin() + path_start, path2->end());
 }
 
 void DynamicTimeWarping::DisplayDebugInformation(
@@ -136,17 +374,34 @@ void DynamicTimeWarping::DisplayDebugInformation(
   const auto height = sequence1.size();
   const auto width = sequence2.size();
   absl::MutexLock lock(&mutex_);
-  std::cout << "Cost matrix:" << std::endl;
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      std::cout << std::setw(3) << cost_matrix_[i * width + j] << " ";
+  if (cost_matrix_.size() == height * width) {
+    std::cout << "Cost matrix:" << std::endl;
+    for (std::size_t i = 0; i < height; ++i) {
+      for (std::size_t j = 0; j < width; ++j) {
+        std::cout << std::setw(3) << cost_matrix_[i * width + j] << " ";
+      }
+      std::cout << std::endl;
     }
-    std::cout << std::endl;
   }
+  const Workspace& workspace = workspace_;
+  if (workspace.band_start_.size() != height ||
+      workspace.best_directions_.empty()) {
+    return;
+  }
+  // Cells outside the band are left blank.
   std::cout << "Directions matrix:" << std::endl;
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      std::cout << std::setw(3) << best_directions_[i * width + j] << " ";
+  for (std::size_t i = 0; i < height; ++i) {
+    const std::size_t start = workspace.band_start_[i];
+    for (std::size_t j = 0; j < width; ++j) {
+      if (j < start || j >= workspace.band_end_[i]) {
+        std::cout << std::setw(3) << "" << " ";
+      } else {
+        std::cout << std::setw(3)
+                  << static_cast<int>(
+                         workspace.best_directions_
+                             [workspace.direction_offset_[i] + j - start])
+                  << " ";
+      }
     }
     std::cout << std::endl;
   }
@@ -16,15 +16,44 @@
 #define THIRD_PARTY_SPEEDY_DYNAMIC_TIME_WARPING_H_
 
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
 #include <vector>
 
+#include "base/logging.h"
 #include "third_party/absl/synchronization/mutex.h"
 
+// Distances between two points of `dimension` contiguous floats, for the flat
+// Compute() overload below.  These are compile-time functors, so the distance
+// is called directly, and they use SIMD (SSE2 or NEON) where available.
+struct DtwL1Distance {
+  float operator()(const float* a, const float* b,
+                   std::size_t dimension) const;
+};
+
+// The Euclidean distance.
+struct DtwL2Distance {
+  float operator()(const float* a, const float* b,
+                   std::size_t dimension) const;
+};
+
+// 1 - cos(angle between a and b), which is 1 if either of them is all 0.
+struct DtwCosineDistance {
+  float operator()(const float* a, const float* b,
+                   std::size_t dimension) const;
+};
+
 // A class that implements dynamic time warping for n-dimensional time series
 // comparison.
-// This class is thread-safe.
+// This class is thread-safe.  Compute() and BestPathSequence() share the state
+// of the instance, behind a mutex, while Align(), AlignMultiscale() and
+// AlignBatch() keep none, so they run in parallel on one instance.
 class DynamicTimeWarping {
  public:
   // This algorithm aims at comparing two time series / sequences.
@@ -69,6 +98,93 @@ class DynamicTimeWarping {
                 const std::vector<std::vector<float>>& sequence2) const
       ABSL_LOCKS_EXCLUDED(mutex_);
 
+  // Options for the flat Compute() and Align() below.
+  struct Options {
+    // If not negative, only the cells within `band_radius` columns of the
+    // diagonal from (0, 0) to (length1-1, length2-1) are considered (a
+    // Sakoe-Chiba band), so the time and the directions memory scale with
+    // length1 * (2 * band_radius + length2 / length1).  The band is widened
+    // where needed to keep it connected.  A path that leaves the band is not
+    // found, so the cost can be higher than the unconstrained one.
+    int band_radius = -1;
+    // Whether to keep the directions for BestPathSequence(), one byte per
+    // cell in the band.  Without them only the cost is computed, in
+    // O(length2) memory.
+    bool keep_path = true;
+    // The number of threads to compute one alignment on (one per hardware
+    // thread if 0).  The columns are split into a strip per thread, at least
+    // kMinStripWidth wide, and each strip follows one row behind the strip on
+    // its left, so a band narrower than the matrix gains less.  The results
+    // are the same for any number of threads.
+    int thread_count = 1;
+  };
+
+  // The narrowest strip of columns that gets its own thread.
+  static constexpr std::size_t kMinStripWidth = 256;
+
+  // The buffers for one alignment, which are kept between alignments so that
+  // nothing is allocated once they are big enough.  A workspace can only be
+  // used by one alignment at a time.
+  class Workspace {
+   public:
+    Workspace() = default;
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+   private:
+    friend class DynamicTimeWarping;
+
+    // The ArgMin() of each cell in the band, row by row.  Row i holds columns
+    // band_start_[i] to band_end_[i] - 1, from direction_offset_[i] on.
+    std::vector<std::int8_t> best_directions_;
+    std::vector<std::size_t> band_start_;
+    std::vector<std::size_t> band_end_;
+    std::vector<std::size_t> direction_offset_;
+    // For each strip of columns, the previous and current rows of costs of
+    // its columns, each with a cell before them for the column on its left.
+    std::vector<float> cost_rows_;
+    // The costs of the last column of each strip but the last, for the strip
+    // on its right, row by row.
+    std::vector<float> strip_edges_;
+  };
+
+  // The cost of an alignment and, if it was kept, its path, as from Compute()
+  // and BestPathSequence().
+  struct Result {
+    float cost = 0.0f;
+    std::vector<int> path1;
+    std::vector<int> path2;
+  };
+
+  // Two sequences to align with AlignBatch(), as for the flat Compute().
+  struct SequencePair {
+    const float* sequence1 = nullptr;
+    std::size_t length1 = 0;
+    const float* sequence2 = nullptr;
+    std::size_t length2 = 0;
+  };
+
+  // Like Compute(), for sequences stored as contiguous, row-major spans of
+  // `length1` and `length2` (both at least 1) points of `dimension` floats,
+  // compared with `distance` instead of the constructor's distance.  It is
+  // called as distance(point1, point2, dimension), e.g. with DtwL2Distance().
+  // Each distance is added into two rolling rows of costs as it is computed,
+  // in a single pass, and the buffers are kept between calls, so nothing is
+  // allocated once they are big enough.  With the default options the results
+  // are the same as Compute() with the same distance.
+  template <typename Distance>
+  float Compute(const float* sequence1, std::size_t length1,
+                const float* sequence2, std::size_t length2,
+                Distance distance) const ABSL_LOCKS_EXCLUDED(mutex_) {
+    return Compute(sequence1, length1, sequence2, length2, distance,
+                   Options());
+  }
+  template <typename Distance>
+  float Compute(const float* sequence1, std::size_t length1,
+                const float* sequence2, std::size_t length2,
+                Distance distance, const Options& options) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
   // Returns the best path found via dynamic-time warping. Must first call the
   // function Compute() before calling this function, with the original
   // sequences used for Compute. The best matching path is returned in the two
@@ -78,9 +194,59 @@ class DynamicTimeWarping {
   void BestPathSequence(const std::vector<std::vector<float>>& sequence1,
                         const std::vector<std::vector<float>>& sequence2,
                         std::vector<int>* path1, std::vector<int>* path2) const;
+  // The same, after the flat Compute() of sequences of these lengths, which
+  // must have kept the path.
+  void BestPathSequence(std::size_t length1, std::size_t length2,
+                        std::vector<int>* path1, std::vector<int>* path2) const;
+
+  // Aligns the sequences like the flat Compute() followed by
+  // BestPathSequence(), in time and memory linear in the lengths, with the
+  // multiscale approximation of FastDTW (Salvador and Chan, 2007).  The
+  // sequences are halved, by averaging pairs of points, until one is shorter
+  // than `radius` + 2 points.  That pair is aligned exactly, and each finer
+  // level is only searched within `radius` coarse points of the path found at
+  // the level below.  Appends the path to `path1` and `path2`, as in
+  // BestPathSequence(), and returns the cost found in the last window.  That
+  // is never below the cost from Compute(), is the same when the optimal path
+  // stays within the windows, and is usually within 1% of it for a `radius`
+  // of 10 or more.
+  template <typename Distance>
+  float ComputeMultiscale(const float* sequence1, std::size_t length1,
+                          const float* sequence2, std::size_t length2,
+                          Distance distance, int radius,
+                          std::vector<int>* path1,
+                          std::vector<int>* path2) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Like the flat Compute() followed (if options.keep_path) by
+  // BestPathSequence(), but without using any state of this instance, so any
+  // number of threads can align at once.  The alignment uses `workspace`, or
+  // if it is null a workspace kept for each thread.
+  template <typename Distance>
+  Result Align(const float* sequence1, std::size_t length1,
+               const float* sequence2, std::size_t length2, Distance distance,
+               const Options& options, Workspace* workspace = nullptr) const;
+
+  // Likewise for ComputeMultiscale().
+  template <typename Distance>
+  Result AlignMultiscale(const float* sequence1, std::size_t length1,
+                         const float* sequence2, std::size_t length2,
+                         Distance distance, int radius,
+                         Workspace* workspace = nullptr) const;
+
+  // Aligns each of `pairs` with Align() on `thread_count` threads (one per
+  // hardware thread if 0), including the calling one, and returns the results
+  // in the same order.  Each pair is aligned on one thread, whatever
+  // options.thread_count is.  `distance` is called from all the threads at
+  // once.
+  template <typename Distance>
+  std::vector<Result> AlignBatch(const std::vector<SequencePair>& pairs,
+                                 Distance distance, const Options& options,
+                                 int thread_count = 0) const;
 
   // This function shows the internal state of the DTW code, and is useful for
-  // verifying the expected test results.
+  // verifying the expected test results.  The cost matrix is only kept by the
+  // vector Compute().
   void DisplayDebugInformation(
       const std::vector<std::vector<float>>& sequence1,
       const std::vector<std::vector<float>>& sequence2) const;
@@ -102,18 +268,358 @@ class DynamicTimeWarping {
   float ComputeFromCostMatrix(int height, int width) const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // Returns the workspace of the calling thread.
+  static Workspace* ThreadWorkspace();
+
+  // Sets a band of `band_radius` columns around the diagonal, as in Options,
+  // and prepares it as in FinishBand().  A negative `band_radius` gives full
+  // rows, which ComputeFromCostMatrix() also uses.
+  // Dies with a fatal error if either length is 0.
+  static void PrepareBand(std::size_t height, std::size_t width,
+                          int band_radius, bool keep_path,
+                          Workspace* workspace);
+
+  // Sets the band for the multiscale alignment to the cells within `radius`
+  // points of the path `coarse_path1`, `coarse_path2` of the sequences
+  // halved, and prepares it as in FinishBand().
+  static void PrepareWindow(std::size_t height, std::size_t width,
+                            const std::vector<int>& coarse_path1,
+                            const std::vector<int>& coarse_path2, int radius,
+                            Workspace* workspace);
+
+  // Makes the band starts and ends of the rows never decrease, with no gaps
+  // between rows, and sizes the directions for the band (if `keep_path`).
+  static void FinishBand(bool keep_path, Workspace* workspace);
+
+  // Computes the cost of the cells in the band and returns that of the last
+  // one, as the flat Compute(), on up to `thread_count` threads.
+  template <typename Distance>
+  float ComputeInBand(const float* sequence1, std::size_t length1,
+                      const float* sequence2, std::size_t length2,
+                      Distance distance, bool keep_path, int thread_count,
+                      Workspace* workspace) const;
+
+  // The columns [first_column, end_column) of the band, for ComputeStrip().
+  // The costs of the column before them come from `left_edge` (null for the
+  // first strip), as the strip on the left reports them in `left_progress`,
+  // and those of the last column go to `right_edge` (null for the last
+  // strip), as reported in `progress` (if not null).
+  struct Strip {
+    std::size_t first_column = 0;
+    std::size_t end_column = 0;
+    float* cost_rows = nullptr;
+    const float* left_edge = nullptr;
+    float* right_edge = nullptr;
+    const std::atomic<std::size_t>* left_progress = nullptr;
+    std::atomic<std::size_t>* progress = nullptr;
+  };
+
+  // Returns how many strips to split `width` columns into for `thread_count`
+  // threads.
+  static std::size_t StripCount(std::size_t width, int thread_count);
+
+  // Computes the cells of the band in the columns of `strip`, row by row, and
+  // returns the cost of the last row in the last column.
+  template <typename Distance>
+  float ComputeStrip(const float* sequence1, std::size_t length1,
+                     const float* sequence2, Distance distance,
+                     bool keep_path, const Strip& strip,
+                     Workspace* workspace) const;
+
+  // Aligns the sequences as ComputeMultiscale(), in `workspace`.
+  template <typename Distance>
+  float ComputeMultiscaleInWorkspace(const float* sequence1,
+                                     std::size_t length1,
+                                     const float* sequence2,
+                                     std::size_t length2, Distance distance,
+                                     int radius, std::vector<int>* path1,
+                                     std::vector<int>* path2,
+                                     Workspace* workspace) const;
+
+  // Appends the path through the kept directions, as BestPathSequence().
+  static void TracePath(std::size_t length1, std::size_t length2,
+                        const Workspace& workspace, std::vector<int>* path1,
+                        std::vector<int>* path2);
+
+  // Sets `halved` to the (length + 1) / 2 averages of pairs of points of
+  // `sequence`, where an odd last point is copied.
+  void HalveSequence(const float* sequence, std::size_t length,
+                     std::vector<float>* halved) const;
+
   mutable absl::Mutex mutex_;
   const std::size_t dimension_;
   const std::function<float(const std::vector<float>&,
                             const std::vector<float>&)>
       distance_;
   mutable std::vector<float> cost_matrix_ ABSL_GUARDED_BY(mutex_);
-  mutable std::vector<int> best_directions_ ABSL_GUARDED_BY(mutex_);
+  // The buffers of Compute() and BestPathSequence().
+  mutable Workspace workspace_ ABSL_GUARDED_BY(mutex_);
 
   // Distance helper function.  Returns an indication of which values is
   // smallest. -1 if a is smallest, 0 if the middle is smallest, +1 if c is
   // smallest.
-  int ArgMin(float a, float b, float c) const;
+  static int ArgMin(float a, float b, float c) {
+    // Do the test this way, with strict inequality so that default path is
+    // along the diagonal.
+    if (a < b && a < c) return -1;
+    if (c < a && c < b) return 1;
+    return 0;
+  }
 };
 
+template <typename Distance>
+float DynamicTimeWarping::Compute(const float* sequence1, std::size_t length1,
+                                  const float* sequence2, std::size_t length2,
+                                  Distance distance,
+                                  const Options& options) const {
+  absl::MutexLock lock(&mutex_);
+  PrepareBand(length1, length2, options.band_radius, options.keep_path,
+              &workspace_);
+  return ComputeInBand(sequence1, length1, sequence2, length2, distance,
+                       options.keep_path, options.thread_count, &workspace_);
+}
+
+template <typename Distance>
+float DynamicTimeWarping::ComputeMultiscale(
+    const float* sequence1, std::size_t length1, const float* sequence2,
+    std::size_t length2, Distance distance, int radius,
+    std::vector<int>* path1, std::vector<int>* path2) const {
+  absl::MutexLock lock(&mutex_);
+  return ComputeMultiscaleInWorkspace(sequence1, length1, sequence2, length2,
+                                      distance, radius, path1, path2,
+                                      &workspace_);
+}
+
+template <typename Distance>
+DynamicTimeWarping::Result DynamicTimeWarping::Align(
+    const float* sequence1, std::size_t length1, const float* sequence2,
+    std::size_t length2, Distance distance, const Options& options,
+    Workspace* workspace) const {
+  if (workspace == nullptr) workspace = ThreadWorkspace();
+  Result result;
+  PrepareBand(length1, length2, options.band_radius, options.keep_path,
+              workspace);
+  result.cost =
+      ComputeInBand(sequence1, length1, sequence2, length2, distance,
+                    options.keep_path, options.thread_count, workspace);
+  if (options.keep_path) {
+    TracePath(length1, length2, *workspace, &result.path1, &result.path2);
+  }
+  return result;
+}
+
+template <typename Distance>
+DynamicTimeWarping::Result DynamicTimeWarping::AlignMultiscale(
+    const float* sequence1, std::size_t length1, const float* sequence2,
+    std::size_t length2, Distance distance, int radius,
+    Workspace* workspace) const {
+  if (workspace == nullptr) workspace = ThreadWorkspace();
+  Result result;
+  result.cost = ComputeMultiscaleInWorkspace(
+      sequence1, length1, sequence2, length2, distance, radius, &result.path1,
+      &result.path2, workspace);
+  return result;
+}
+
+template <typename Distance>
+std::vector<DynamicTimeWarping::Result> DynamicTimeWarping::AlignBatch(
+    const std::vector<SequencePair>& pairs, Distance distance,
+    const Options& options, int thread_count) const {
+  if (thread_count <= 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  thread_count =
+      static_cast<int>(std::min<std::size_t>(thread_count, pairs.size()));
+  std::vector<Result> results(pairs.size());
+  Options pair_options = options;
+  pair_options.thread_count = 1;
+  // Each thread takes the next pair until there are none left, so a few long
+  // pairs don't hold up the rest.
+  std::atomic<std::size_t> next_pair(0);
+  auto align_pairs = [&]() {
+    Workspace workspace;
+    for (std::size_t k = next_pair++; k < pairs.size(); k = next_pair++) {
+      const SequencePair& pair = pairs[k];
+      results[k] = Align(pair.sequence1, pair.length1, pair.sequence2,
+                         pair.length2, distance, pair_options, &workspace);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < thread_count; ++t) threads.emplace_back(align_pairs);
+  align_pairs();
+  for (std::thread& thread : threads) thread.join();
+  return results;
+}
+
+template <typename Distance>
+float DynamicTimeWarping::ComputeMultiscaleInWorkspace(
+    const float* sequence1, std::size_t length1, const float* sequence2,
+    std::size_t length2, Distance distance, int radius,
+    std::vector<int>* path1, std::vector<int>* path2,
+    Workspace* workspace) const {
+  CHECK_NE(nullptr, path1);
+  CHECK_NE(nullptr, path2);
+  CHECK_GE(radius, 0);
+  CHECK_GT(length1, 0);
+  CHECK_GT(length2, 0);
+  // Level 0 is the input, and each level after it is half the one before.
+  std::vector<const float*> sequences1 = {sequence1};
+  std::vector<const float*> sequences2 = {sequence2};
+  std::vector<std::size_t> lengths1 = {length1};
+  std::vector<std::size_t> lengths2 = {length2};
+  std::vector<std::vector<float>> halved1, halved2;
+  const std::size_t shortest = radius + 2;
+  while (lengths1.back() >= shortest && lengths2.back() >= shortest) {
+    halved1.emplace_back();
+    halved2.emplace_back();
+    HalveSequence(sequences1.back(), lengths1.back(), &halved1.back());
+    HalveSequence(sequences2.back(), lengths2.back(), &halved2.back());
+    sequences1.push_back(halved1.back().data());
+    sequences2.push_back(halved2.back().data());
+    lengths1.push_back((lengths1.back() + 1) / 2);
+    lengths2.push_back((lengths2.back() + 1) / 2);
+  }
+
+  std::size_t level = sequences1.size() - 1;
+  PrepareBand(lengths1[level], lengths2[level], -1, true, workspace);
+  float cost = ComputeInBand(sequences1[level], lengths1[level],
+                             sequences2[level], lengths2[level], distance,
+                             true, 1, workspace);
+  std::vector<int> coarse_path1, coarse_path2;
+  TracePath(lengths1[level], lengths2[level], *workspace, &coarse_path1,
+            &coarse_path2);
+  while (level-- > 0) {
+    PrepareWindow(lengths1[level], lengths2[level], coarse_path1, coarse_path2,
+                  radius, workspace);
+    cost = ComputeInBand(sequences1[level], lengths1[level], sequences2[level],
+                         lengths2[level], distance, true, 1, workspace);
+    coarse_path1.clear();
+    coarse_path2.clear();
+    TracePath(lengths1[level], lengths2[level], *workspace, &coarse_path1,
+              &coarse_path2);
+  }
+  path1->insert(path1->end(), coarse_path1.begin(), coarse_path1.end());
+  path2->insert(path2->end(), coarse_path2.begin(), coarse_path2.end());
+  return cost;
+}
+
+template <typename Distance>
+float DynamicTimeWarping::ComputeInBand(const float* sequence1,
+                                        std::size_t length1,
+                                        const float* sequence2,
+                                        std::size_t length2, Distance distance,
+                                        bool keep_path, int thread_count,
+                                        Workspace* workspace) const {
+  const std::size_t strip_count = StripCount(length2, thread_count);
+  const std::size_t strip_width = (length2 + strip_count - 1) / strip_count;
+  const std::size_t rows_size = 2 * (strip_width + 1);
+  workspace->cost_rows_.assign(strip_count * rows_size,
+                               std::numeric_limits<float>::infinity());
+  workspace->strip_edges_.resize((strip_count - 1) * length1);
+  Strip strip;
+  strip.end_column = length2;
+  strip.cost_rows = workspace->cost_rows_.data();
+  if (strip_count == 1) {
+    return ComputeStrip(sequence1, length1, sequence2, distance, keep_path,
+                        strip, workspace);
+  }
+
+  // In the strips on the right, each row waits for the same row on the left.
+  std::unique_ptr<std::atomic<std::size_t>[]> progress(
+      new std::atomic<std::size_t>[strip_count]);
+  std::vector<Strip> strips(strip_count);
+  for (std::size_t k = 0; k < strip_count; ++k) {
+    progress[k].store(0, std::memory_order_relaxed);
+    strips[k].first_column = k * strip_width;
+    strips[k].end_column = std::min(length2, (k + 1) * strip_width);
+    strips[k].cost_rows = workspace->cost_rows_.data() + k * rows_size;
+    if (k > 0) {
+      strips[k].left_edge = workspace->strip_edges_.data() + (k - 1) * length1;
+      strips[k].left_progress = &progress[k - 1];
+    }
+    if (k + 1 < strip_count) {
+      strips[k].right_edge = workspace->strip_edges_.data() + k * length1;
+      strips[k].progress = &progress[k];
+    }
+  }
+  float cost = 0.0f;
+  std::vector<std::thread> threads;
+  for (std::size_t k = 1; k < strip_count; ++k) {
+    threads.emplace_back([&, k]() {
+      const float strip_cost = ComputeStrip(sequence1, length1, sequence2,
+                                            distance, keep_path, strips[k],
+                                            workspace);
+      if (k + 1 == strip_count) cost = strip_cost;
+    });
+  }
+  ComputeStrip(sequence1, length1, sequence2, distance, keep_path, strips[0],
+               workspace);
+  for (std::thread& thread : threads) thread.join();
+  return cost;
+}
+
+template <typename Distance>
+float DynamicTimeWarping::ComputeStrip(const float* sequence1,
+                                       std::size_t length1,
+                                       const float* sequence2,
+                                       Distance distance, bool keep_path,
+                                       const Strip& strip,
+                                       Workspace* workspace) const {
+  const float kInfinity = std::numeric_limits<float>::infinity();
+  const std::size_t first_column = strip.first_column;
+  const std::size_t end_column = strip.end_column;
+  const std::size_t* band_start = workspace->band_start_.data();
+  const std::size_t* band_end = workspace->band_end_.data();
+  // Both rows are indexed by column, from first_column - 1 on.
+  float* previous_row = strip.cost_rows + 1 - first_column;
+  float* row = previous_row + (end_column - first_column + 1);
+  auto clip = [first_column, end_column](std::size_t column) {
+    return std::min(std::max(column, first_column), end_column);
+  };
+
+  // Every cell adds its distance to the cheapest of its three neighbours, as
+  // in ComputeFromCostMatrix(), where the cells outside the matrix or the band
+  // cost infinity.  The 0 diagonally before the first cell makes it just its
+  // distance, with the direction 0.
+  if (first_column == 0) previous_row[-1] = 0.0f;
+  std::size_t left_rows = 0;
+  for (std::size_t i = 0; i < length1; ++i) {
+    while (strip.left_progress && left_rows <= i) {
+      left_rows = strip.left_progress->load(std::memory_order_acquire);
+      if (left_rows <= i) std::this_thread::yield();
+    }
+    const float* point1 = sequence1 + i * dimension_;
+    const std::size_t start = clip(band_start[i]);
+    const std::size_t end = clip(band_end[i]);
+    const float edge = strip.left_edge ? strip.left_edge[i] : kInfinity;
+    std::int8_t* row_directions =
+        keep_path ? workspace->best_directions_.data() +
+                        workspace->direction_offset_[i] - band_start[i]
+                  : nullptr;
+    float left = start == first_column ? edge : kInfinity;
+    for (std::size_t j = start; j < end; ++j) {
+      const float up = previous_row[j];
+      const float diagonal = previous_row[j - 1];
+      const float cost =
+          distance(point1, sequence2 + j * dimension_, dimension_) +
+          std::min(std::min(up, left), diagonal);
+      if (row_directions) row_directions[j] = ArgMin(up, diagonal, left);
+      row[j] = left = cost;
+    }
+    // The next row may look at the cells on either side of this one's band,
+    // which still hold the costs of two rows back.
+    const std::size_t next_end = i + 1 < length1 ? clip(band_end[i + 1]) : end;
+    if (start > first_column) row[start - 1] = kInfinity;
+    row[first_column - 1] = edge;
+    std::fill(row + end, row + std::max(end, next_end), kInfinity);
+    if (strip.right_edge) {
+      strip.right_edge[i] =
+          start < end && end == end_column ? row[end - 1] : kInfinity;
+      strip.progress->store(i + 1, std::memory_order_release);
+    }
+    std::swap(previous_row, row);
+  }
+  return previous_row[end_column - 1];
+}
+
 #endif  // THIRD_PARTY_SPEEDY_DYNAMIC_TIME_WARPING_H_
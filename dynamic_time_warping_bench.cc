@@ -0,0 +1,373 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for DynamicTimeWarping, aligning speech-feature-like
+// sequences (kDimension values per 10ms frame) with a warped copy of
+// themselves.  Each result is printed on its own line as a JSON object, e.g.
+//   {"benchmark": "Compute/cost_only", "length1": 1000, "length2": 1300,
+//    "dimension": 15, "cells": 1300000, "ns_per_cell": 2.1,
+//    "realtime_factor": 3663.0, "allocations": 0}
+// where the cells are those of the full cost matrix, the realtime factor is
+// the seconds of sequence1 (at 100 frames a second) aligned per second, and
+// the allocations are the malloc, calloc and realloc calls in the timed run
+// (or -1 if not counted.)  Each benchmark is run once untimed, so the
+// workspaces are big enough, and then --repetitions times, and the fastest run
+// is reported.  ComputeMultiscale/accuracy instead reports, for each radius,
+// the relative error of its cost against the exact Compute() and how many
+// points of sequence2 its path strays from the exact path, e.g.
+//   {"benchmark": "ComputeMultiscale/accuracy", "input": "warped",
+//    "length1": 1000, "length2": 1300, "dimension": 15, "radius": 10,
+//    "cost_error": 0.000000, "mean_path_deviation": 0.000,
+//    "max_path_deviation": 0}
+//
+//   make bench
+//   ./dynamic_time_warping_bench --filter Multiscale
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "third_party/speedy/dynamic_time_warping.h"
+
+namespace {
+
+constexpr std::size_t kDimension = 15;   // As speedy's kFeatureValueCount.
+constexpr double kFrameRate = 100.0;     // Frames per second.
+
+int repetitions = 3;
+std::string filter;  // Only run the benchmarks with this in their name.
+std::FILE* results = stdout;
+
+}  // namespace
+
+// Allocations are counted by linking with -Wl,--wrap=malloc (and calloc and
+// realloc), as the bench target of the Makefile does.
+#ifdef SPEEDY_BENCH_COUNT_ALLOCATIONS
+namespace {
+std::atomic<long> allocation_count(0);
+}  // namespace
+
+extern "C" {
+void* __real_malloc(std::size_t size);
+void* __real_calloc(std::size_t count, std::size_t size);
+void* __real_realloc(void* pointer, std::size_t size);
+
+void* __wrap_malloc(std::size_t size) {
+  allocation_count++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(std::size_t count, std::size_t size) {
+  allocation_count++;
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, std::size_t size) {
+  allocation_count++;
+  return __real_realloc(pointer, size);
+}
+}
+
+// The C++ library's operator new calls its own malloc, so count it here.
+void* operator new(std::size_t size) {
+  void* pointer = std::malloc(size);
+  if (pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+namespace {
+long Allocations() { return allocation_count.load(); }
+}  // namespace
+#else
+namespace {
+long Allocations() { return -1; }
+}  // namespace
+#endif
+
+namespace {
+
+// A random walk of `length` points, smooth enough that a warped copy of it
+// aligns like two renditions of the same speech.
+std::vector<float> MakeSequence(std::size_t length, std::uint32_t seed) {
+  std::vector<float> sequence(length * kDimension);
+  std::vector<float> point(kDimension, 0.0f);
+  std::uint32_t random_state = seed;
+  for (std::size_t i = 0; i < length; ++i) {
+    for (std::size_t d = 0; d < kDimension; ++d) {
+      random_state = random_state * 1664525u + 1013904223u;
+      point[d] = 0.9f * point[d] +
+                 ((random_state >> 8) / 8388608.0f - 1.0f);
+      sequence[i * kDimension + d] = point[d];
+    }
+  }
+  return sequence;
+}
+
+// `sequence` resampled to `length` points along a sinusoidal time warp, plus a
+// little noise.
+std::vector<float> WarpSequence(const std::vector<float>& sequence,
+                                std::size_t length) {
+  const std::size_t original_length = sequence.size() / kDimension;
+  std::vector<float> warped(length * kDimension);
+  std::uint32_t random_state = 54321;
+  for (std::size_t i = 0; i < length; ++i) {
+    const double x = static_cast<double>(i) / length;
+    const double t = x + 0.05 * std::sin(2.0 * M_PI * 3.0 * x);
+    const std::size_t source = std::min(
+        original_length - 1,
+        static_cast<std::size_t>(std::max(0.0, t) * original_length));
+    for (std::size_t d = 0; d < kDimension; ++d) {
+      random_state = random_state * 1664525u + 1013904223u;
+      warped[i * kDimension + d] =
+          sequence[source * kDimension + d] +
+          0.1f * ((random_state >> 8) / 8388608.0f - 1.0f);
+    }
+  }
+  return warped;
+}
+
+// The same sequence as one vector per point, for the vector Compute().
+std::vector<std::vector<float>> ToPoints(const std::vector<float>& sequence) {
+  std::vector<std::vector<float>> points(sequence.size() / kDimension);
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    points[i].assign(sequence.begin() + i * kDimension,
+                     sequence.begin() + (i + 1) * kDimension);
+  }
+  return points;
+}
+
+float VectorL2Distance(const std::vector<float>& a,
+                       const std::vector<float>& b) {
+  return DtwL2Distance()(a.data(), b.data(), a.size());
+}
+
+// Runs `run` once untimed and then `repetitions` times, and prints the fastest
+// run (unless `name` doesn't match the filter.)  `length1` frames of the first
+// sequence, against `length2`, are aligned `count` times in each run.
+void RunBenchmark(const std::string& name, std::size_t length1,
+                  std::size_t length2, std::size_t count,
+                  const std::function<void()>& run) {
+  if (!filter.empty() && name.find(filter) == std::string::npos) return;
+  run();
+  double best_seconds = 0.0;
+  long best_allocations = -1;
+  for (int repetition = 0; repetition < repetitions; ++repetition) {
+    const long allocations_before = Allocations();
+    const auto start = std::chrono::steady_clock::now();
+    run();
+    const auto end = std::chrono::steady_clock::now();
+    const long run_allocations = Allocations() - allocations_before;
+    const double run_seconds =
+        std::chrono::duration<double>(end - start).count();
+    if (repetition == 0 || run_seconds < best_seconds) {
+      best_seconds = run_seconds;
+      best_allocations = allocations_before < 0 ? -1 : run_allocations;
+    }
+  }
+  const double cells = static_cast<double>(length1) * length2 * count;
+  std::fprintf(results,
+               "{\"benchmark\": \"%s\", \"length1\": %zu, \"length2\": %zu, "
+               "\"dimension\": %zu, \"cells\": %.0f, \"ns_per_cell\": %.2f, "
+               "\"realtime_factor\": %.1f, \"allocations\": %ld}\n",
+               name.c_str(), length1, length2, kDimension, cells,
+               1e9 * best_seconds / cells,
+               length1 * count / kFrameRate / best_seconds, best_allocations);
+  std::fflush(results);
+}
+
+void BenchmarkLength(std::size_t length) {
+  const std::size_t length2 = length + length * 3 / 10;
+  const std::vector<float> sequence1 = MakeSequence(length, 12345);
+  const std::vector<float> sequence2 = WarpSequence(sequence1, length2);
+  const float* data1 = sequence1.data();
+  const float* data2 = sequence2.data();
+  DynamicTimeWarping dtw(kDimension, VectorL2Distance);
+  volatile float sink = 0.0f;
+
+  if (length <= 1000) {
+    const std::vector<std::vector<float>> points1 = ToPoints(sequence1);
+    const std::vector<std::vector<float>> points2 = ToPoints(sequence2);
+    RunBenchmark("Compute/vector", length, length2, 1,
+                 [&]() { sink = dtw.Compute(points1, points2); });
+  }
+  RunBenchmark("Compute", length, length2, 1, [&]() {
+    sink = dtw.Compute(data1, length, data2, length2, DtwL2Distance());
+  });
+  RunBenchmark("Compute+BestPathSequence", length, length2, 1, [&]() {
+    std::vector<int> path1, path2;
+    sink = dtw.Compute(data1, length, data2, length2, DtwL2Distance());
+    dtw.BestPathSequence(length, length2, &path1, &path2);
+  });
+  DynamicTimeWarping::Options cost_only;
+  cost_only.keep_path = false;
+  RunBenchmark("Compute/cost_only", length, length2, 1, [&]() {
+    sink = dtw.Compute(data1, length, data2, length2, DtwL2Distance(),
+                       cost_only);
+  });
+  DynamicTimeWarping::Options banded;
+  banded.band_radius = 32;
+  RunBenchmark("Compute/band_radius=32", length, length2, 1, [&]() {
+    sink = dtw.Compute(data1, length, data2, length2, DtwL2Distance(),
+                       banded);
+  });
+  RunBenchmark("ComputeMultiscale/radius=10", length, length2, 1, [&]() {
+    std::vector<int> path1, path2;
+    sink = dtw.ComputeMultiscale(data1, length, data2, length2,
+                                 DtwL2Distance(), 10, &path1, &path2);
+  });
+  const int thread_count =
+      std::max(2, static_cast<int>(std::thread::hardware_concurrency()));
+  DynamicTimeWarping::Options threaded;
+  threaded.thread_count = thread_count;
+  RunBenchmark("Align/threads=" + std::to_string(thread_count), length,
+               length2, 1, [&]() {
+                 sink = dtw.Align(data1, length, data2, length2,
+                                  DtwL2Distance(), threaded)
+                            .cost;
+               });
+
+  // Many short alignments, as when matching words.
+  const std::vector<DynamicTimeWarping::SequencePair> pairs(
+      64, {data1, std::min<std::size_t>(length, 100), data2,
+           std::min<std::size_t>(length2, 130)});
+  RunBenchmark("AlignBatch", pairs[0].length1, pairs[0].length2, pairs.size(),
+               [&]() {
+                 sink = dtw.AlignBatch(pairs, DtwL2Distance(),
+                                       DynamicTimeWarping::Options())
+                            .back()
+                            .cost;
+               });
+}
+
+// How far each point of `path` is from the rows of sequence2 that `exact`
+// matches with the same point of sequence1: the mean and the largest distance,
+// in points of sequence2.
+void PathDeviation(const DynamicTimeWarping::Result& exact,
+                   const DynamicTimeWarping::Result& path,
+                   std::size_t length1, double* mean, int* max) {
+  std::vector<int> first(length1, -1), last(length1, -1);
+  for (std::size_t k = 0; k < exact.path1.size(); ++k) {
+    const int i = exact.path1[k];
+    if (first[i] < 0) first[i] = exact.path2[k];
+    last[i] = exact.path2[k];
+  }
+  double total = 0.0;
+  *max = 0;
+  for (std::size_t k = 0; k < path.path1.size(); ++k) {
+    const int i = path.path1[k], j = path.path2[k];
+    const int deviation = j < first[i] ? first[i] - j
+                          : j > last[i] ? j - last[i] : 0;
+    total += deviation;
+    *max = std::max(*max, deviation);
+  }
+  *mean = path.path1.empty() ? 0.0 : total / path.path1.size();
+}
+
+// ComputeMultiscale() against the exact alignment, for each radius: the
+// relative error of the cost, and how far its path strays from the exact one.
+// "warped" pairs a sequence with a warped copy of itself, and "unrelated"
+// pairs two independent sequences, the worst case for the projected windows.
+void BenchmarkAccuracy(std::size_t length) {
+  const std::string name = "ComputeMultiscale/accuracy";
+  if (!filter.empty() && name.find(filter) == std::string::npos) return;
+  const std::size_t length2 = length + length * 3 / 10;
+  const std::vector<float> sequence1 = MakeSequence(length, 12345);
+  const std::vector<float> warped = WarpSequence(sequence1, length2);
+  const std::vector<float> unrelated = MakeSequence(length2, 777);
+  DynamicTimeWarping dtw(kDimension, VectorL2Distance);
+  for (const auto& input : {std::make_pair("warped", &warped),
+                            std::make_pair("unrelated", &unrelated)}) {
+    const float* data2 = input.second->data();
+    const DynamicTimeWarping::Result exact =
+        dtw.Align(sequence1.data(), length, data2, length2, DtwL2Distance(),
+                  DynamicTimeWarping::Options());
+    for (int radius : {1, 2, 5, 10, 20, 40}) {
+      const DynamicTimeWarping::Result multiscale = dtw.AlignMultiscale(
+          sequence1.data(), length, data2, length2, DtwL2Distance(), radius);
+      double mean_deviation;
+      int max_deviation;
+      PathDeviation(exact, multiscale, length, &mean_deviation,
+                    &max_deviation);
+      std::fprintf(results,
+                   "{\"benchmark\": \"%s\", \"input\": \"%s\", "
+                   "\"length1\": %zu, \"length2\": %zu, \"dimension\": %zu, "
+                   "\"radius\": %d, \"cost_error\": %.6f, "
+                   "\"mean_path_deviation\": %.3f, "
+                   "\"max_path_deviation\": %d}\n",
+                   name.c_str(), input.first, length, length2, kDimension,
+                   radius, (multiscale.cost - exact.cost) / exact.cost,
+                   mean_deviation, max_deviation);
+    }
+  }
+  std::fflush(results);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  static const char* usage =
+      "Usage: %s [--repetitions 3] [--filter name] [--output results.json]\n";
+  while (true) {
+    static struct option long_options[] = {
+        {"repetitions", required_argument, nullptr, 'r'},
+        {"filter", required_argument, nullptr, 'f'},
+        {"output", required_argument, nullptr, 'o'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    int option_index = 0;
+    const int c =
+        getopt_long(argc, argv, "r:f:o:h", long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+      case 'r':
+        repetitions = std::max(1, std::atoi(optarg));
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'o':
+        results = std::fopen(optarg, "w");
+        if (results == nullptr) {
+          std::fprintf(stderr, "Can't open %s\n", optarg);
+          return -1;
+        }
+        break;
+      default:
+        std::fprintf(stderr, usage, argv[0]);
+        return -1;
+    }
+  }
+  for (std::size_t length : {250, 1000, 4000}) BenchmarkLength(length);
+  BenchmarkAccuracy(1000);
+  if (results != stdout) std::fclose(results);
+  return 0;
+}
@@ -15,6 +15,8 @@
 #ifndef THIRD_PARTY_SPEEDY_SONIC_sonic2LIB_H_
 #define THIRD_PARTY_SPEEDY_SONIC_sonic2LIB_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -75,12 +77,20 @@ void sonicDestroyStream(sonicStream mySonicStream);
 /******************************************************************************
  * NOTE: One sample corresponds to the values from *all* channels. Thus a stereo
  * signal with N samples has 2*N short values.
+ *
+ * The write functions return 0 on failure, and otherwise the number of samples
+ * taken (or 1 if sampleCount is 0.)  This is all of them, unless an analysis
+ * thread is used (see sonicSetNonlinearAnalysisThread.)
  ******************************************************************************/
 int sonicWriteShortToStream(sonicStream mySonicStream, short* inBuffer,
                              int sampleCount);
 int sonicReadShortFromStream(sonicStream mySonicStream, short* outBuffer,
                               int bufferSize);
-/* Samples in floating-point format are assumed to be in the range (-1,1) */
+/* Samples in floating-point format are assumed to be in the range (-1,1).  The
+ * first write to a stream picks the format it buffers: after a float write the
+ * samples are analyzed and sent to libsonic as floats, and after a short write
+ * any later floats are converted to shorts, saturating at full scale.
+ */
 int sonicWriteFloatToStream(sonicStream mySonicStream, float* inBuffer,
                              int sampleCount);
 int sonicReadFloatFromStream(sonicStream mySonicStream, float* outBuffer,
@@ -103,6 +113,133 @@ void sonicEnableNonlinearSpeedup(sonicStream mySonicStream,
                                  float nonlinearFactor,
                                  float normalizationTime);
 
+/* Run the speedy analysis at a fixed sample rate (e.g.
+ * kSpeedyDefaultAnalysisRate), no matter the input sample rate. This makes the
+ * analysis cost independent of the input rate.  Must be called before any data
+ * is written to the stream.  An analysisRate of 0 analyzes at the input sample
+ * rate (the default).  Returns 0 on failure.
+ */
+int sonicSetNonlinearAnalysisRate(sonicStream mySonicStream, int analysisRate);
+
+/* Compute speedy's spectrogram with this FFT backend, one of the
+ * kSpeedyFFT* values (see speedyCreateStreamWithFFT() in speedy/speedy.h.)
+ * Like sonicSetNonlinearAnalysisRate, this must be called before any data is
+ * written.  Returns 0 on failure, or if the backend is not compiled in.
+ */
+int sonicSetNonlinearFFT(sonicStream mySonicStream, int fftBackend);
+
+/* Set the spans of speedy's energy hysteresis, and how many frames it looks
+ * ahead before a tension is ready (see speedySetHysteresis() in
+ * speedy/speedy.h.)  The input is held back for about the lookahead (see
+ * sonicGetNonlinearLatency), kTemporalHysteresisFuture frames of 10ms by
+ * default.  Each frame less lookahead cuts this by 10ms, but the tension is
+ * then approximate.
+ * Must be called before any data is written.  Returns 0 on failure.
+ */
+int sonicSetNonlinearHysteresis(sonicStream mySonicStream, int futureFrames,
+                                int pastFrames, int lookaheadFrames);
+
+/* Speedy analyzes a mono mix of the channels, by default their average.
+ * Instead, weights (numChannels values) gives each channel's share of the mix,
+ * e.g. {0, 0, 1, 0, 0, 0} to analyze only the center (dialog) channel of 5.1
+ * audio.  The weights should add up to 1 to keep the average's level.  NULL
+ * goes back to the average.  Must be called before any data is written.
+ * Returns 0 on failure.
+ */
+int sonicSetNonlinearChannelWeights(sonicStream mySonicStream,
+                                    const float* weights);
+
+/* Render from a precomputed tension track (see speedy/speedy_track.h), made
+ * from the tension callback of an earlier run on the same audio, instead of
+ * running the speedy analysis.  The speeds are computed from the tensions for
+ * the current speed, so one track can be rendered many times at different
+ * speeds for just the cost of the time-scale modification.  The track must
+ * have the stream's sample rate, stay valid while the stream uses it, and be
+ * set before any data is written.  The normalized spectrogram and spectrogram
+ * callbacks are not called, and the features callback only if the track has
+ * features.  Returns 0 on failure.
+ */
+struct speedyTrackStruct;
+int sonicSetNonlinearTensionTrack(sonicStream mySonicStream,
+                                  struct speedyTrackStruct* track);
+
+/* Only time-scale and output the input samples from startSample up to (but not
+ * including) endSample, or to the end if endSample is -1.  The samples outside
+ * this range are only used as context for the speedy analysis, e.g. when a
+ * long input is processed in pieces.  This is done in whole buffers, so the
+ * range should be a multiple of getSonicBufferSize().  Only applies when the
+ * non-linear speedup is enabled.
+ */
+void sonicSetNonlinearOutputRange(sonicStream mySonicStream, int startSample,
+                                  int endSample);
+
+/* Run the speedy analysis on a second thread, so it overlaps with the
+ * time-scale modification done in the calling thread.  The output is the same
+ * as without the thread, but it can lag further behind the input, until the
+ * next write, read or flush.  Must be called before any data is written to the
+ * stream, and the stream must still only be used from one thread at a time.
+ * Note: the tension, features and spectrogram callbacks are then called from
+ * the analysis thread (the speed callback is still called from the writing
+ * thread), and the settings and callbacks must not be changed after the first
+ * write.  When the analysis falls behind, so the buffers (see
+ * sonicSetNonlinearLatencyBudget) are full, a write takes only the samples
+ * that fit and returns their count.  It only waits for the analysis when it
+ * can't take any.  Returns 0 on failure.
+ */
+int sonicSetNonlinearAnalysisThread(sonicStream mySonicStream, int useThread);
+
+/* The non-linear speedup holds back the input frames (of getSonicBufferSize()
+ * samples) that speedy needs to look ahead, the hysteresis lookahead (see
+ * sonicSetNonlinearHysteresis) and a couple more, in a fixed set of buffers.
+ * With an analysis thread there are also buffers for the frames queued for it,
+ * and budgetFrames more buffers let it fall further behind before writes take
+ * less than they were given.  Without an analysis thread the extra buffers
+ * are not needed.  Must be called before any data is written to the stream.
+ * Returns 0 on failure.
+ */
+int sonicSetNonlinearLatencyBudget(sonicStream mySonicStream,
+                                   int budgetFrames);
+
+/* Return how many samples the next write will take without waiting for the
+ * analysis thread.  Without an analysis thread this is INT_MAX (everything).
+ */
+int sonicFreeSpace(sonicStream mySonicStream);
+
+/* Return the input frames (of getSonicBufferSize() samples) now held back for
+ * the speedy analysis, counting the one being filled.  These have been
+ * written but not yet sent to the original libsonic, which adds its own
+ * latency.
+ */
+int sonicGetNonlinearLatency(sonicStream mySonicStream);
+
+/* Totals for a stream since it was created, e.g. to attribute its CPU time.
+ * Like speedy's (see speedyGetStats() in speedy/speedy.h), the counts are
+ * always kept, but solaNanoseconds only when the library is compiled with
+ * -DSPEEDY_STATS, and sonicGetNonlinearStats() returns whether it is.
+ */
+typedef struct sonicNonlinearStatsStruct {
+  int64_t solaNanoseconds;      /* In the original libsonic's writes, flushes */
+  int64_t buffersToSola;        /* Sent to the original libsonic */
+  int bufferCount;              /* In the ring, 0 until the first write */
+  int heldBuffers;              /* Now, as from sonicGetNonlinearLatency() */
+  int maxHeldBuffers;
+  /* By this shim, including the speedy stream, but not the original
+   * libsonic.
+   */
+  int64_t bytesAllocated;
+} sonicNonlinearStats;
+int sonicGetNonlinearStats(sonicStream mySonicStream,
+                           sonicNonlinearStats* stats);
+
+/* Get the speedy analysis totals (see speedyGetStats()), which start over if
+ * sonicSetNonlinearAnalysisRate() replaces the speedy stream.  With an
+ * analysis thread, this first waits for it to analyze the frames it has.
+ * Returns whether the times are kept.
+ */
+struct speedyStatsStruct;
+int sonicGetNonlinearSpeedyStats(sonicStream mySonicStream,
+                                 struct speedyStatsStruct* stats);
+
 /* Return the size of the internal buffers.  This is needed for the callback
  * functions, which return time in buffer counts.
  */
@@ -13,11 +13,43 @@
 // limitations under the License.
 
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SONIC_HAVE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SONIC_HAVE_NEON
+#endif
 #include "sonic.h"
 #include "speedy/speedy.h"
+#include "speedy/speedy_track.h"
+
+/* With SPEEDY_STATS, the time in the original libsonic is added to
+ * solaNanoseconds (see sonicGetNonlinearStats.)  Otherwise these are empty.
+ */
+#ifdef  SPEEDY_STATS
+#include <time.h>
+
+static int64_t sonicNanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+#define SONIC_STATS_START(start) int64_t start = sonicNanoseconds()
+#define SONIC_STATS_ADD(connector, start) \
+  ((connector)->solaNanoseconds += sonicNanoseconds() - (start))
+#else
+#define SONIC_STATS_START(start)
+#define SONIC_STATS_ADD(connector, start)
+#endif  /* SPEEDY_STATS */
 
 /*
  * Replace original libSonic with this shim to allow non-linear speedups of
@@ -52,11 +84,22 @@
  *
  * To manage all of this, this library keeps buffers of size 1/frameRate. The
  * speedy analysis code wants 50% overlap, so when ready the buffer we pass to
- * speedy has size 1.5/frameRate.
+ * speedy has size 1.5/frameRate.  As each buffer is written, its channels are
+ * mixed down once (see sonicSetNonlinearChannelWeights) into the mono ring,
+ * which has a mono buffer for each buffer.  The start of the ring is repeated
+ * after its end, so the samples of each frame for speedy are contiguous and
+ * are analyzed where they are.
+ *
+ * The ring of buffers has a fixed size, set when the first data is written:
+ * the frames speedy needs to look ahead (minBufferCount), room for the frames
+ * queued for an analysis thread, and any latency budget the user adds (see
+ * sonicSetNonlinearLatencyBudget.)  Without an analysis thread it never
+ * fills, since each frame is analyzed as soon as it is written.  With one, a
+ * write that finds the ring full returns the samples it took so far (see
+ * sonicFreeSpace.)
  *
  * TODO(malcolmslaney)
- *   1) Put some functionality in for sonicFreeSpace
- *   2) Remove debug prints
+ *   1) Remove debug prints
  */
 struct speedyConnectionStruct {
   speedyStream mySpeedyStream;
@@ -67,10 +110,28 @@ struct speedyConnectionStruct {
   float sampleRate;
   int channelCount;             /* Number of channels >= 1 */
   int bufferCount;
+  int minBufferCount;           /* Buffers speedy looks ahead, and two more */
   int bufferSize;               /* Number of multi-channel samples per buffer */
+  int latencyBudget;            /* Extra buffers in the ring, set by user */
+  int analysisRate;             /* Set by user, 0 for the input rate */
+  int fftBackend;               /* Set by user, one of the kSpeedyFFT* */
+  int hysteresisFuture;         /* Set by user, see speedySetHysteresis */
+  int hysteresisPast;
+  int hysteresisLookahead;
+  /* The buffers hold floats if the first write to the stream was floats, and
+   * then floatBufferList is used, otherwise they hold shorts in bufferList.
+   * bufferBlock is the one allocation holding the lists, tensionList, the
+   * mono ring and the buffers themselves.
+   */
+  int floatBuffers;
+  void* bufferBlock;
+  size_t bufferBlockSize;
   short** bufferList;
+  float** floatBufferList;
   float* tensionList;
-  short* speedyInputBuffer;     /* To accumuate buffers to send to Speedy */
+  float* monoRing;              /* bufferCount mono buffers, then monoMirror */
+  int monoMirror;               /* Samples repeated from the start */
+  float* channelWeights;        /* Set by user, or NULL for the average */
   int readBufferFrameIndex;     /* Frame time, always increasing. */
   int speedyBufferFrameIndex;   /* Frame time, always increasing. */
   int writeBufferFrameIndex;    /* Frame time, always increasing. */
@@ -80,14 +141,66 @@ struct speedyConnectionStruct {
   void (*returnFeatures)(sonicStream, int, float*);
   void (*returnSpectrogram)(sonicStream, int, float*);
   void (*returnNormalizedSpectrogram)(sonicStream, int, float*);
+  int outputStart;              /* First input sample to output */
+  int outputEnd;                /* End of the output samples, or -1 for all */
+  speedyTrack tensionTrack;     /* Precomputed tensions, or NULL to analyze */
+  int useAnalysisThread;        /* Set by user, see below */
+  struct sonicAnalysisThreadStruct* analysisThread;
+  /* For sonicGetNonlinearStats. */
+  int64_t solaNanoseconds;
+  int64_t buffersToSola;
+  int maxHeldBuffers;
+  int64_t speedyBytesAllocated;   /* By mySpeedyStream */
 };
 typedef struct speedyConnectionStruct* speedyConnection;
 
+/* With sonicSetNonlinearAnalysisThread(), the speedy analysis runs on its own
+ * thread.  Frames for speedy and the tensions it returns are passed through
+ * these rings (see sonicAnalysisThreadMain.)
+ */
+#define kAnalysisQueueSize 8    /* Frames, must be a power of 2 */
+
+struct sonicAnalysisThreadStruct {
+  sonicStream mySonicStream;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t frameReady;    /* Signaled for the analysis thread */
+  pthread_cond_t resultRoom;    /* Signaled for the analysis thread */
+  pthread_cond_t writerWake;    /* Signaled for the writer */
+  atomic_int analysisWaiting;
+  atomic_int writerWaiting;
+  atomic_int stop;
+  /* Frames queued for analysis.  frameWrite is only changed by the writer and
+   * frameRead by the analysis thread, and both always increase.  Frame f is in
+   * slot f%kAnalysisQueueSize, and its samples stay in the mono ring until its
+   * tension has been applied.
+   */
+  atomic_uint frameWrite;
+  atomic_uint frameRead;
+  int frameTimes[kAnalysisQueueSize];
+  const float* frameInputs[kAnalysisQueueSize];
+  /* Tensions computed by the analysis thread, in the same way. */
+  atomic_uint resultWrite;
+  atomic_uint resultRead;
+  int resultTimes[kAnalysisQueueSize];
+  float resultTensions[kAnalysisQueueSize];
+};
+typedef struct sonicAnalysisThreadStruct* sonicAnalysisThread;
+
+static int sonicStartAnalysisThread(sonicStream mySonicStream);
+static void sonicStopAnalysisThread(speedyConnection mySpeedyConnector);
+static void sonicWaitForAnalysis(sonicStream mySonicStream,
+                                 int (*done)(speedyConnection));
+static int sonicWriteBufferFree(speedyConnection mySpeedyConnector);
+static int sonicAnalysisIdle(speedyConnection mySpeedyConnector);
+static void sonicPollAnalysis(sonicStream mySonicStream);
+
 /* Note: Speedy's tension calculation at frame k depends on kTemporalHysteresis
  * frames in the *future*. For this reason, this shim needs to buffer a number
  * of frames so that speedy can see these frames in the future, and then
  * calculate the tension now.  This bufferList has to have enough room for all
- * of these future frames.
+ * of these future frames.  That is kMinBufferSize with the default hysteresis,
+ * and sonicSetNonlinearHysteresis sizes it for a shorter lookahead.
  */
 #define kMinBufferSize (2+kTemporalHysteresisFuture)
 
@@ -112,8 +225,13 @@ sonicStream sonicCreateStream(int sampleRate, int numChannels){
     return NULL;
   }
   mySpeedyConnector->mySpeedyStream = mySpeedyStream;
+  speedyStats mySpeedyStats;
+  speedyGetStats(mySpeedyStream, &mySpeedyStats);
+  mySpeedyConnector->speedyBytesAllocated = mySpeedyStats.bytes_allocated;
   mySpeedyConnector->globalSpeed = 1.0;
   mySpeedyConnector->sampleRate = sampleRate;
+  mySpeedyConnector->analysisRate = 0;
+  mySpeedyConnector->fftBackend = kSpeedyFFTDefault;
   mySpeedyConnector->channelCount = numChannels;
   mySpeedyConnector->speedyNonlinearFactor = 0.0;    /* Off by default */
   /* How fast to normalize the speed (after non-linear speedup) to keep the
@@ -129,6 +247,17 @@ sonicStream sonicCreateStream(int sampleRate, int numChannels){
   mySpeedyConnector->speedyBufferFrameIndex = 0;
   mySpeedyConnector->writeBufferFrameIndex = 0;
   mySpeedyConnector->writeBufferFrameLocation = 0;
+  mySpeedyConnector->latencyBudget = 0;
+  mySpeedyConnector->minBufferCount = kMinBufferSize;
+  mySpeedyConnector->hysteresisFuture = kTemporalHysteresisFuture;
+  mySpeedyConnector->hysteresisPast = kTemporalHysteresisPast;
+  mySpeedyConnector->hysteresisLookahead = kTemporalHysteresisFuture;
+  mySpeedyConnector->outputStart = 0;
+  mySpeedyConnector->outputEnd = -1;
+  mySpeedyConnector->tensionTrack = NULL;
+  mySpeedyConnector->channelWeights = NULL;
+  mySpeedyConnector->useAnalysisThread = 0;
+  mySpeedyConnector->analysisThread = NULL;
 
   return mySonicStream;
 }
@@ -142,26 +271,18 @@ void sonicDestroyStream(sonicStream mySonicStream) {
   assert(mySonicStream);
   speedyConnection mySpeedyConnector =
       (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector) {
+    sonicStopAnalysisThread(mySpeedyConnector);
+  }
   sonicIntDestroyStream(mySonicStream);
   if (mySpeedyConnector) {
     if (mySpeedyConnector->mySpeedyStream) {
       speedyDestroyStream(mySpeedyConnector->mySpeedyStream);
     }
-    if (mySpeedyConnector->bufferCount > 0 && mySpeedyConnector->bufferList) {
-      int i;
-      for (i=0; i<mySpeedyConnector->bufferCount; i++) {
-        if (mySpeedyConnector->bufferList[i]) {
-          free(mySpeedyConnector->bufferList[i]);
-        }
-      }
-      free(mySpeedyConnector->bufferList);
-    }
-    if (mySpeedyConnector->speedyInputBuffer) {
-      free(mySpeedyConnector->speedyInputBuffer);
-    }
-    if (mySpeedyConnector->tensionList) {
-      free(mySpeedyConnector->tensionList);
+    if (mySpeedyConnector->bufferBlock) {
+      free(mySpeedyConnector->bufferBlock);
     }
+    free(mySpeedyConnector->channelWeights);
     free(mySpeedyConnector);
   }
 }
@@ -183,194 +304,1065 @@ void sonicSetSpeed(sonicStream mySonicStream, float rate) {
 }
 
 
-int sonicAllocateBuffers(sonicStream mySonicStream, int sampleCount){
-  /* TODO(malcolmslaney): Need to check if we have already allocated this space,
-   * and if we need to increase the buffer size.
-   */
+/* Allocate the ring of buffers (see above), for floats or shorts.  The size
+ * doesn't depend on how much is written at a time.
+ */
+int sonicAllocateBuffers(sonicStream mySonicStream, int floatBuffers){
   assert(mySonicStream);
   speedyConnection mySpeedyConnector =
       (speedyConnection)sonicIntGetUserData(mySonicStream);
   speedyStream mySpeedyStream = mySpeedyConnector->mySpeedyStream;
+  assert(!mySpeedyConnector->bufferBlock);
 
   mySpeedyConnector->bufferSize = speedyInputFrameStep(mySpeedyStream);
-  int bufferCount = sampleCount / mySpeedyConnector->bufferSize + 1;
-  if (bufferCount < kMinBufferSize) {
-      bufferCount = kMinBufferSize;
+  /* With an analysis thread, leave room for the frames and tensions queued
+   * between the threads.
+   */
+  int bufferCount = mySpeedyConnector->minBufferCount +
+                    mySpeedyConnector->latencyBudget;
+  if (mySpeedyConnector->useAnalysisThread) {
+    bufferCount += 2*kAnalysisQueueSize;
   }
   mySpeedyConnector->bufferCount = bufferCount;
   printf("Allocating %d buffers for sonic data.\n", bufferCount);
-  short **bufferList =  (short**) calloc(mySpeedyConnector->bufferCount,
-                                         sizeof(short*));
-  mySpeedyConnector->bufferList = bufferList;
-  if (!bufferList) {
+  int speedyBufferSize = speedyInputFrameSize(mySpeedyStream);
+  printf("speedyBufferSize is %d, sonicBufferSize is %d.\n", speedyBufferSize,
+         mySpeedyConnector->bufferSize); fflush(stdout);
+
+  /* Allocate everything in one block: the buffer pointers, the tensions, the
+   * mono ring, and then the samples of all the buffers.  A frame for speedy
+   * that starts in the last buffer runs speedyBufferSize-bufferSize samples
+   * past the end of the ring, into the mirror.
+   */
+  size_t bufferValues = (size_t)mySpeedyConnector->bufferSize*
+                        mySpeedyConnector->channelCount;
+  size_t monoValues = (size_t)mySpeedyConnector->bufferSize*bufferCount;
+  mySpeedyConnector->monoMirror = speedyBufferSize -
+                                  mySpeedyConnector->bufferSize;
+  assert(mySpeedyConnector->monoMirror >= 0);
+  assert((size_t)mySpeedyConnector->monoMirror <= monoValues);
+  size_t valueSize = floatBuffers ? sizeof(float) : sizeof(short);
+  size_t blockSize = sizeof(void*)*bufferCount + sizeof(float)*bufferCount +
+                     sizeof(float)*(monoValues + mySpeedyConnector->monoMirror) +
+                     valueSize*bufferValues*bufferCount;
+  char* block = (char *)calloc(1, blockSize);
+  if (!block) {
     return 0;
   }
+  mySpeedyConnector->bufferBlock = block;
+  mySpeedyConnector->bufferBlockSize = blockSize;
+  mySpeedyConnector->floatBuffers = floatBuffers;
+  mySpeedyConnector->tensionList = (float*)(block +
+                                            sizeof(void*)*bufferCount);
+  mySpeedyConnector->monoRing = mySpeedyConnector->tensionList + bufferCount;
+  void* samples = mySpeedyConnector->monoRing + monoValues +
+                  mySpeedyConnector->monoMirror;
   int i;
-  for (i=0; i<bufferCount; i++) {
-    bufferList[i] = (short *)calloc(mySpeedyConnector->bufferSize,
-                                    sizeof(short)*
-                                    mySpeedyConnector->channelCount);
-    if (!bufferList[i]) {
-      return 0;
+  if (floatBuffers) {
+    float** floatBufferList = (float**)block;
+    float* floatSamples = (float*)samples;
+    for (i=0; i<bufferCount; i++) {
+      floatBufferList[i] = floatSamples + bufferValues*i;
     }
+    mySpeedyConnector->floatBufferList = floatBufferList;
+  } else {
+    short** bufferList = (short**)block;
+    short* shortSamples = (short*)samples;
+    for (i=0; i<bufferCount; i++) {
+      bufferList[i] = shortSamples + bufferValues*i;
+    }
+    mySpeedyConnector->bufferList = bufferList;
+  }
+  if (mySpeedyConnector->useAnalysisThread &&
+      !mySpeedyConnector->tensionTrack) {
+    sonicStartAnalysisThread(mySonicStream);
   }
+  return 1;
+}
 
-  int speedyBufferSize = speedyInputFrameSize(mySpeedyStream);
-  printf("speedyBufferSize is %d, sonicBufferSize is %d.\n", speedyBufferSize,
-         mySpeedyConnector->bufferSize); fflush(stdout);
-  mySpeedyConnector->speedyInputBuffer = (short *)calloc(speedyBufferSize,
-                                                         sizeof(short));
-  if (!mySpeedyConnector->speedyInputBuffer) {
+/* Convert a float sample in (-1,1) to a short, saturating values beyond full
+ * scale instead of letting them wrap around.
+ */
+static short sonicFloatToShort(float value) {
+  double scaled = value * 32768.0;
+  if (scaled >= 32767.0) {
+    return 32767;
+  }
+  if (scaled <= -32768.0) {
+    return -32768;
+  }
+  return (short)scaled;
+}
+
+#if defined(SONIC_HAVE_SSE2) || defined(SONIC_HAVE_NEON)
+/* The average of the channels of stereo and 5.1 samples is computed 4 samples
+ * at a time.  Each sample's channels are added in the same order as the
+ * scalar code, so the results are the same.
+ */
+#define SONIC_HAVE_SIMD
+#ifdef SONIC_HAVE_SSE2
+typedef __m128 sonicVector;
+#define sonicVectorZero() _mm_setzero_ps()
+#define sonicVectorSplat(x) _mm_set1_ps(x)
+#define sonicVectorAdd(a, b) _mm_add_ps(a, b)
+#define sonicVectorMul(a, b) _mm_mul_ps(a, b)
+#define sonicVectorDiv(a, b) _mm_div_ps(a, b)
+#define sonicVectorTruncate(a) _mm_cvtepi32_ps(_mm_cvttps_epi32(a))
+#define sonicVectorLoad(p) _mm_loadu_ps(p)
+#define sonicVectorStore(p, a) _mm_storeu_ps(p, a)
+/* {a0,a2,b0,b2}, {a1,a3,b1,b3}, {a0,a1,b2,b3} and {a2,a3,b0,b1} */
+#define sonicVectorEvens(a, b) _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0))
+#define sonicVectorOdds(a, b) _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1))
+#define sonicVectorLowHigh(a, b) _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,2,1,0))
+#define sonicVectorHighLow(a, b) _mm_shuffle_ps(a, b, _MM_SHUFFLE(1,0,3,2))
+
+/* Load 8 shorts as two vectors of floats. */
+static void sonicVectorLoadShorts(const short* p, sonicVector* rows) {
+  __m128i values = _mm_loadu_si128((const __m128i*)p);
+  rows[0] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(values, values),
+                                           16));
+  rows[1] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(values, values),
+                                           16));
+}
+#else
+typedef float32x4_t sonicVector;
+#define sonicVectorZero() vdupq_n_f32(0.0f)
+#define sonicVectorSplat(x) vdupq_n_f32(x)
+#define sonicVectorAdd(a, b) vaddq_f32(a, b)
+#define sonicVectorMul(a, b) vmulq_f32(a, b)
+#define sonicVectorDiv(a, b) vdivq_f32(a, b)
+#define sonicVectorTruncate(a) vcvtq_f32_s32(vcvtq_s32_f32(a))
+#define sonicVectorLoad(p) vld1q_f32(p)
+#define sonicVectorStore(p, a) vst1q_f32(p, a)
+#define sonicVectorEvens(a, b) vuzp1q_f32(a, b)
+#define sonicVectorOdds(a, b) vuzp2q_f32(a, b)
+#define sonicVectorLowHigh(a, b) vcombine_f32(vget_low_f32(a), vget_high_f32(b))
+#define sonicVectorHighLow(a, b) vcombine_f32(vget_high_f32(a), vget_low_f32(b))
+
+static void sonicVectorLoadShorts(const short* p, sonicVector* rows) {
+  int16x8_t values = vld1q_s16(p);
+  rows[0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(values)));
+  rows[1] = vcvtq_f32_s32(vmovl_s16(vget_high_s16(values)));
+}
+#endif
+
+/* The average of the channels of 4 samples, given as channelCount (2 or 6)
+ * rows of 4 interleaved values.
+ */
+static sonicVector sonicAverageRows(const sonicVector* rows,
+                                    int channelCount) {
+  sonicVector channels[6];
+  if (channelCount == 2) {
+    channels[0] = sonicVectorEvens(rows[0], rows[1]);
+    channels[1] = sonicVectorOdds(rows[0], rows[1]);
+  } else {
+    /* Rows 0-2 hold samples 0 and 1, and rows 3-5 samples 2 and 3. */
+    sonicVector first = sonicVectorLowHigh(rows[0], rows[1]);
+    sonicVector second = sonicVectorLowHigh(rows[3], rows[4]);
+    channels[0] = sonicVectorEvens(first, second);
+    channels[1] = sonicVectorOdds(first, second);
+    first = sonicVectorHighLow(rows[0], rows[2]);
+    second = sonicVectorHighLow(rows[3], rows[5]);
+    channels[2] = sonicVectorEvens(first, second);
+    channels[3] = sonicVectorOdds(first, second);
+    first = sonicVectorLowHigh(rows[1], rows[2]);
+    second = sonicVectorLowHigh(rows[4], rows[5]);
+    channels[4] = sonicVectorEvens(first, second);
+    channels[5] = sonicVectorOdds(first, second);
+  }
+  sonicVector sum = sonicVectorZero();
+  int k;
+  for (k = 0; k<channelCount; k++) {
+    sum = sonicVectorAdd(sum, channels[k]);
+  }
+  return sonicVectorDiv(sum, sonicVectorSplat((float)channelCount));
+}
+#endif  /* SONIC_HAVE_SSE2 || SONIC_HAVE_NEON */
+
+/* Mix down sampleCount interleaved float samples to mono: the average of the
+ * channels, or their weighted sum.
+ */
+static void sonicMixFloats(speedyConnection mySpeedyConnector,
+                           const float* input, float* output,
+                           int sampleCount) {
+  int i = 0, k, channelCount = mySpeedyConnector->channelCount;
+  const float* weights = mySpeedyConnector->channelWeights;
+  if (weights) {
+    for (; i<sampleCount; i++) {
+      float sum = 0.0;
+      for (k = 0; k<channelCount; k++) {
+        sum += weights[k]*input[i*channelCount + k];
+      }
+      output[i] = sum;
+    }
+    return;
+  }
+#ifdef  SONIC_HAVE_SIMD
+  if (channelCount == 2 || channelCount == 6) {
+    sonicVector rows[6];
+    for (; i+4 <= sampleCount; i += 4) {
+      const float* samples = input + i*channelCount;
+      for (k = 0; k<channelCount; k++) {
+        rows[k] = sonicVectorLoad(samples + 4*k);
+      }
+      sonicVectorStore(output + i, sonicAverageRows(rows, channelCount));
+    }
+  }
+#endif
+  for (; i<sampleCount; i++) {
+    float sum = 0.0;
+    for (k = 0; k<channelCount; k++) {
+      sum += input[i*channelCount + k];
+    }
+    output[i] = sum/channelCount;
+  }
+}
+
+/* Like sonicMixFloats, for shorts, scaled to (-1, 1) like
+ * speedyAddDataShort() does.  The (integer) average is rounded towards 0 to a
+ * short first, as speedy was given shorts before the mono ring.  A weighted
+ * sum is not rounded.
+ */
+static void sonicMixShorts(speedyConnection mySpeedyConnector,
+                           const short* input, float* output,
+                           int sampleCount) {
+  int i = 0, k, channelCount = mySpeedyConnector->channelCount;
+  const float* weights = mySpeedyConnector->channelWeights;
+  if (weights) {
+    for (; i<sampleCount; i++) {
+      float sum = 0.0;
+      for (k = 0; k<channelCount; k++) {
+        sum += weights[k]*input[i*channelCount + k];
+      }
+      output[i] = sum/32768.0f;
+    }
+    return;
+  }
+#ifdef  SONIC_HAVE_SIMD
+  /* The sums of shorts are exact in floats, and so is the quotient rounded
+   * towards 0, for these channel counts.
+   */
+  if (channelCount == 2 || channelCount == 6) {
+    sonicVector rows[6];
+    sonicVector scale = sonicVectorSplat(1.0f/32768.0f);
+    for (; i+4 <= sampleCount; i += 4) {
+      const short* samples = input + i*channelCount;
+      for (k = 0; k<channelCount; k += 2) {
+        sonicVectorLoadShorts(samples + 4*k, rows + k);
+      }
+      sonicVector average = sonicAverageRows(rows, channelCount);
+      sonicVectorStore(output + i,
+                       sonicVectorMul(sonicVectorTruncate(average), scale));
+    }
+  }
+#endif
+  for (; i<sampleCount; i++) {
+    int sum = 0;
+    for (k = 0; k<channelCount; k++) {
+      sum += input[i*channelCount + k];
+    }
+    output[i] = (short)(sum/channelCount)/32768.0;
+  }
+}
+
+/* Mix down sampleCount samples of buffer bufferIndex, starting at sample
+ * start, into its mono buffer, and into the mirror after the end of the mono
+ * ring if they are at its start.
+ */
+static void sonicDownmixForSpeedy(speedyConnection mySpeedyConnector,
+                                  int bufferIndex, int start,
+                                  int sampleCount) {
+  int channelCount = mySpeedyConnector->channelCount;
+  int monoStart = bufferIndex*mySpeedyConnector->bufferSize + start;
+  float* output = mySpeedyConnector->monoRing + monoStart;
+  if (mySpeedyConnector->floatBuffers) {
+    sonicMixFloats(mySpeedyConnector,
+                   mySpeedyConnector->floatBufferList[bufferIndex] +
+                   start*channelCount, output, sampleCount);
+  } else {
+    sonicMixShorts(mySpeedyConnector,
+                   mySpeedyConnector->bufferList[bufferIndex] +
+                   start*channelCount, output, sampleCount);
+  }
+  int mirrorCount = mySpeedyConnector->monoMirror - monoStart;
+  if (mirrorCount > 0) {
+    memcpy(mySpeedyConnector->monoRing + mySpeedyConnector->bufferCount*
+           mySpeedyConnector->bufferSize + monoStart, output,
+           sizeof(float)*(mirrorCount < sampleCount ? mirrorCount :
+                                                      sampleCount));
+  }
+}
+
+/* Is the buffer at frame time bufferTime in the output range (see
+ * sonicSetNonlinearOutputRange)?
+ */
+static int sonicIsOutputBuffer(speedyConnection mySpeedyConnector,
+                               int bufferTime) {
+  int firstSample = bufferTime*mySpeedyConnector->bufferSize;
+  return firstSample >= mySpeedyConnector->outputStart &&
+         (mySpeedyConnector->outputEnd < 0 ||
+          firstSample < mySpeedyConnector->outputEnd);
+}
+
+/* Send the buffer at frame time bufferTime to the original libsonic, unless it
+ * is outside the output range.
+ */
+static void sonicWriteBufferToSonic(sonicStream mySonicStream,
+                                    int bufferTime) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (!sonicIsOutputBuffer(mySpeedyConnector, bufferTime)) {
+    return;
+  }
+  int bufferIndex = bufferTime % mySpeedyConnector->bufferCount;
+  SONIC_STATS_START(solaStart);
+  if (mySpeedyConnector->floatBuffers) {
+    sonicIntWriteFloatToStream(mySonicStream,
+                               mySpeedyConnector->floatBufferList[bufferIndex],
+                               mySpeedyConnector->bufferSize);
+  } else {
+    sonicIntWriteShortToStream(mySonicStream,
+                               mySpeedyConnector->bufferList[bufferIndex],
+                               mySpeedyConnector->bufferSize);
+  }
+  SONIC_STATS_ADD(mySpeedyConnector, solaStart);
+  mySpeedyConnector->buffersToSola++;
+}
+
+/* Replace the speedy stream with one for these settings.  This changes the
+ * speedy frame sizes, so it is only allowed before the first buffer is
+ * allocated (i.e. before any data is written).
+ */
+static int sonicReplaceSpeedyStream(sonicStream mySonicStream,
+                                    int analysisRate, int fftBackend) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock) {
     return 0;
   }
+  speedyStream mySpeedyStream = speedyCreateStreamWithFFT(
+      sonicIntGetSampleRate(mySonicStream), analysisRate, fftBackend);
+  if (!mySpeedyStream) {
+    return 0;
+  }
+  speedyDestroyStream(mySpeedyConnector->mySpeedyStream);
+  mySpeedyConnector->mySpeedyStream = mySpeedyStream;
+  mySpeedyConnector->analysisRate = analysisRate;
+  mySpeedyConnector->fftBackend = fftBackend;
+  speedyStats mySpeedyStats;
+  speedyGetStats(mySpeedyStream, &mySpeedyStats);
+  mySpeedyConnector->speedyBytesAllocated = mySpeedyStats.bytes_allocated;
+  if (mySpeedyConnector->speedyNormalizationTime > 0.0) {
+    speedyUpdateTensionNormalization(
+        mySpeedyStream, mySpeedyConnector->speedyNormalizationTime);
+  }
+  speedySetHysteresis(mySpeedyStream, mySpeedyConnector->hysteresisFuture,
+                      mySpeedyConnector->hysteresisPast,
+                      mySpeedyConnector->hysteresisLookahead);
+  return 1;
+}
 
-  mySpeedyConnector->tensionList =
-      (float*)calloc(mySpeedyConnector->bufferCount, sizeof(float));
-  if (!mySpeedyConnector->tensionList) {
-      return 0;
+/* Analyze the audio at a fixed analysisRate. */
+int sonicSetNonlinearAnalysisRate(sonicStream mySonicStream,
+                                  int analysisRate) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  return sonicReplaceSpeedyStream(mySonicStream, analysisRate,
+                                  mySpeedyConnector->fftBackend);
+}
+
+int sonicSetNonlinearFFT(sonicStream mySonicStream, int fftBackend) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  return sonicReplaceSpeedyStream(mySonicStream,
+                                  mySpeedyConnector->analysisRate, fftBackend);
+}
+
+/* The settings are kept, so a new speedy stream from
+ * sonicSetNonlinearAnalysisRate or sonicSetNonlinearFFT gets them too.
+ */
+int sonicSetNonlinearHysteresis(sonicStream mySonicStream, int futureFrames,
+                                int pastFrames, int lookaheadFrames) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock ||
+      !speedySetHysteresis(mySpeedyConnector->mySpeedyStream, futureFrames,
+                           pastFrames, lookaheadFrames)) {
+    return 0;
   }
+  mySpeedyConnector->hysteresisFuture = futureFrames;
+  mySpeedyConnector->hysteresisPast = pastFrames;
+  mySpeedyConnector->hysteresisLookahead = lookaheadFrames;
+  mySpeedyConnector->minBufferCount = kMinBufferSize -
+                                      kTemporalHysteresisFuture +
+                                      lookaheadFrames;
   return 1;
 }
 
-/* Check to see if we have enough space to write the new data. */
-int sonicFreeSpace(speedyConnection mySpeedyConnection, int sampleCount) {
+/* Take the tension of each frame from track instead of computing it.  The
+ * track must be for this sample rate, and like sonicSetNonlinearAnalysisRate
+ * this is only allowed before any data is written.  A NULL track turns the
+ * analysis back on.
+ */
+int sonicSetNonlinearTensionTrack(sonicStream mySonicStream,
+                                  speedyTrack track) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock) {
+    return 0;
+  }
+  if (track && (speedyTrackSampleRate(track) !=
+                sonicIntGetSampleRate(mySonicStream) ||
+                speedyTrackFrameStep(track) !=
+                speedyInputFrameStep(mySpeedyConnector->mySpeedyStream))) {
+    return 0;
+  }
+  mySpeedyConnector->tensionTrack = track;
   return 1;
 }
 
-/* sonicSendDataToSpeedy - We now have enough new data to send to Speedy. Send
- * one buffer. Then check to see if we have sent enough data to speedy to get
- * back a new tension estimate.  If so, use the tension to calculate a new
- * speedup, tell the original libsonic the new speed, and send it the
- * corresponding buffer.
+/* Only time-scale and output the input samples in [startSample, endSample).
+ * The others are just analyzed.  Set endSample to -1 to output everything
+ * from startSample on.
  */
-void sonicSendDataToSpeedy(sonicStream mySonicStream) {
+void sonicSetNonlinearOutputRange(sonicStream mySonicStream, int startSample,
+                                  int endSample) {
   assert(mySonicStream);
   speedyConnection mySpeedyConnector =
       (speedyConnection)sonicIntGetUserData(mySonicStream);
-  speedyStream mySpeedyStream = (speedyStream)mySpeedyConnector->mySpeedyStream;
-  int speedyBufferSize = speedyInputFrameSize(mySpeedyStream);
-  int sonicBufferSize = mySpeedyConnector->bufferSize;
-  int speedyFullBufferCount = speedyBufferSize/mySpeedyConnector->bufferSize;
-  int partialCount = speedyBufferSize - sonicBufferSize*speedyFullBufferCount;
-  assert(mySpeedyConnector->speedyBufferFrameIndex <
-         mySpeedyConnector->writeBufferFrameIndex);
-  assert(mySpeedyConnector->writeBufferFrameLocation > partialCount);
+  mySpeedyConnector->outputStart = startSample;
+  mySpeedyConnector->outputEnd = endSample;
+}
 
-  /* Copy the full buffers, averaging the channels to get a mono signal for
-   * speedy analysis.
-   */
-  int i, j, k, bufferIndex, sum;
-  short* bp = mySpeedyConnector->speedyInputBuffer;
-  short* wp;
-  for (i=0; i<speedyFullBufferCount; i++) {
-    bufferIndex = (mySpeedyConnector->speedyBufferFrameIndex + i) %
-                      mySpeedyConnector->bufferCount;
-    short* wp = mySpeedyConnector->bufferList[bufferIndex];
-    for (j = 0; j<sonicBufferSize; j++) {
-      int channelCount = mySpeedyConnector->channelCount;
-      for (k = 0, sum=0; k<channelCount; k++) {
-        sum += wp[j*channelCount + k];
-      }
-      *bp++ = sum /channelCount;
-    }
+/* Run the speedy analysis on its own thread (started by the first write.)  Like
+ * sonicSetNonlinearAnalysisRate, this is only allowed before any data is
+ * written.
+ */
+int sonicSetNonlinearAnalysisThread(sonicStream mySonicStream,
+                                    int useThread) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock) {
+    return 0;
+  }
+  mySpeedyConnector->useAnalysisThread = useThread;
+  return 1;
+}
+
+int sonicSetNonlinearLatencyBudget(sonicStream mySonicStream,
+                                   int budgetFrames) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock || budgetFrames < 0) {
+    return 0;
   }
-  /* Then copy the last partial buffer before sending for speedy analysis. */
-  bufferIndex = (mySpeedyConnector->speedyBufferFrameIndex +
-                 speedyFullBufferCount) % mySpeedyConnector->bufferCount;
-  wp = mySpeedyConnector->bufferList[bufferIndex];
-  for (i = 0; i<partialCount; i++) {
-    int channelCount = mySpeedyConnector->channelCount;
-    for (j = 0, sum=0; j<channelCount; j++) {
-      sum += wp[i*channelCount + j];
+  mySpeedyConnector->latencyBudget = budgetFrames;
+  return 1;
+}
+
+/* The weights are copied, and NULL goes back to the average. */
+int sonicSetNonlinearChannelWeights(sonicStream mySonicStream,
+                                    const float* weights) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->bufferBlock) {
+    return 0;
+  }
+  if (!weights) {
+    free(mySpeedyConnector->channelWeights);
+    mySpeedyConnector->channelWeights = NULL;
+    return 1;
+  }
+  if (!mySpeedyConnector->channelWeights) {
+    mySpeedyConnector->channelWeights =
+        (float*)malloc(sizeof(float)*mySpeedyConnector->channelCount);
+    if (!mySpeedyConnector->channelWeights) {
+      return 0;
     }
-    *bp++ = sum /channelCount;
   }
-  mySpeedyConnector->speedyBufferFrameIndex++;  /* Move to next frame. */
+  memcpy(mySpeedyConnector->channelWeights, weights,
+         sizeof(float)*mySpeedyConnector->channelCount);
+  return 1;
+}
 
-  /* Send the full speedyInputBuffer to Speedy for analysis */
+/* A write stops at the first buffer that is still in use (the buffers from
+ * readBufferFrameIndex up to the one being filled), or at the start of the
+ * span that would complete a frame with no free analysis slot for it (see
+ * sonicWaitForWriteSpan.)
+ */
+int sonicFreeSpace(sonicStream mySonicStream) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  if (!mySpeedyConnector->speedyNonlinearFactor ||
+      !mySpeedyConnector->useAnalysisThread ||
+      mySpeedyConnector->tensionTrack ||
+      (mySpeedyConnector->bufferBlock && !myThread)) {
+    return INT_MAX;
+  }
+  int bufferSize = getSonicBufferSize(mySonicStream);
+  int speedyFullBufferCount =
+      speedyInputFrameSize(mySpeedyConnector->mySpeedyStream)/bufferSize;
+  if (!myThread) {
+    /* Nothing written yet, so the ring and the analysis queue are empty. */
+    int bufferCount = mySpeedyConnector->minBufferCount +
+                      mySpeedyConnector->latencyBudget +
+                      2*kAnalysisQueueSize;
+    int frameCount = kAnalysisQueueSize + speedyFullBufferCount;
+    return (bufferCount < frameCount ? bufferCount : frameCount)*bufferSize;
+  }
+  sonicPollAnalysis(mySonicStream);
+  int written = mySpeedyConnector->writeBufferFrameIndex*bufferSize +
+                mySpeedyConnector->writeBufferFrameLocation;
+  int bufferLimit = (mySpeedyConnector->readBufferFrameIndex +
+                     mySpeedyConnector->bufferCount)*bufferSize;
+  int freeSlots = kAnalysisQueueSize -
+                  (int)(atomic_load(&myThread->frameWrite) -
+                        atomic_load(&myThread->frameRead));
+  int blockedFrame = mySpeedyConnector->speedyBufferFrameIndex + freeSlots;
+  int frameLimit = (blockedFrame + speedyFullBufferCount)*bufferSize;
+  int limit = bufferLimit < frameLimit ? bufferLimit : frameLimit;
+  return limit > written ? limit - written : 0;
+}
+
+int sonicGetNonlinearLatency(sonicStream mySonicStream) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (!mySpeedyConnector->speedyNonlinearFactor) {
+    return 0;
+  }
+  return mySpeedyConnector->writeBufferFrameIndex -
+         mySpeedyConnector->readBufferFrameIndex;
+}
+
+/* Only reads what the writing thread changes, so it never waits. */
+int sonicGetNonlinearStats(sonicStream mySonicStream,
+                           sonicNonlinearStats* stats) {
+  assert(mySonicStream);
+  assert(stats);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  stats->solaNanoseconds = mySpeedyConnector->solaNanoseconds;
+  stats->buffersToSola = mySpeedyConnector->buffersToSola;
+  stats->bufferCount = mySpeedyConnector->bufferBlock ?
+                       mySpeedyConnector->bufferCount : 0;
+  stats->heldBuffers = sonicGetNonlinearLatency(mySonicStream);
+  stats->maxHeldBuffers = mySpeedyConnector->maxHeldBuffers;
+  stats->bytesAllocated = sizeof(struct speedyConnectionStruct) +
+                          mySpeedyConnector->bufferBlockSize +
+                          mySpeedyConnector->speedyBytesAllocated;
+  if (mySpeedyConnector->channelWeights) {
+    stats->bytesAllocated += sizeof(float)*mySpeedyConnector->channelCount;
+  }
+  if (mySpeedyConnector->analysisThread) {
+    stats->bytesAllocated += sizeof(struct sonicAnalysisThreadStruct);
+  }
+#ifdef  SPEEDY_STATS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* The analysis thread updates the speedy stream's stats, so let it finish
+ * first.
+ */
+int sonicGetNonlinearSpeedyStats(sonicStream mySonicStream,
+                                 struct speedyStatsStruct* stats) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->analysisThread) {
+    sonicWaitForAnalysis(mySonicStream, sonicAnalysisIdle);
+  }
+  return speedyGetStats(mySpeedyConnector->mySpeedyStream, stats);
+}
+
+/* Analyze the speedy input frame (in the mono ring) from frame time atTime,
+ * and report the spectrograms to the callbacks.  Then try to compute the
+ * tension at frame time tensionTime.  Return whether it is ready, and if so
+ * report it and the features to the callbacks.
+ */
+static int sonicAnalyzeFrame(sonicStream mySonicStream, const float* input,
+                             int atTime, int tensionTime, float* tension) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  speedyStream mySpeedyStream = (speedyStream)mySpeedyConnector->mySpeedyStream;
+  /* Send the full speedy input buffer to Speedy for analysis */
 #ifdef  DEBUG
-  printf("Sending data from buffer at time %d to speedy\n",
-         mySpeedyConnector->speedyBufferFrameIndex); fflush(stdout);
+  printf("Sending data from buffer at time %d to speedy\n", atTime);
+  fflush(stdout);
 #endif
-  speedyAddDataShort(mySpeedyStream, mySpeedyConnector->speedyInputBuffer,
-                     mySpeedyConnector->writeBufferFrameIndex);
+  speedyAddData(mySpeedyStream, input, atTime);
   if (mySpeedyConnector->returnSpectrogram) {
     /* Note: this spectrogram is calculated when the data is sent to speedy */
     (mySpeedyConnector->returnSpectrogram)(
-        mySonicStream, mySpeedyConnector->writeBufferFrameIndex,
-        speedyGetSpectrogram(mySpeedyStream));
+        mySonicStream, atTime, speedyGetSpectrogram(mySpeedyStream));
   }
   if (mySpeedyConnector->returnNormalizedSpectrogram) {
     /* Note: the normalized spectrogram is calculated when we have enough data
      * to compute the tension, so it is offset from the spectrogram above.
      */
     (mySpeedyConnector->returnNormalizedSpectrogram)(
-        mySonicStream, mySpeedyConnector->writeBufferFrameIndex,
-        speedyGetNormalizedSpectrogram(mySpeedyStream));
+        mySonicStream, atTime, speedyGetNormalizedSpectrogram(mySpeedyStream));
   }
 
-  /* Compute the tension. First see if anybody wants to know the result.
-   * But more importantly, compute the new speedup and pass it to the sonic
-   * library so the new samples we are sending here get spedup by this new
-   * speed. */
-  float newTension = 0.0;
-  if (speedyComputeTension(mySpeedyStream,
-                           mySpeedyConnector->readBufferFrameIndex,
-                           &newTension)) {
-    if (mySpeedyConnector->returnTension) {
-      (mySpeedyConnector->returnTension)(mySonicStream,
-                                         mySpeedyConnector->readBufferFrameIndex,
-                                         newTension);
-    }
-    if (mySpeedyConnector->returnFeatures) {
-      (mySpeedyConnector->returnFeatures)(mySonicStream,
-                                          mySpeedyConnector->readBufferFrameIndex,
-                                          speedyGetInternalState(mySpeedyStream));
-    }
-    /* Now that we have a new tension, send the data we have stored to the
-     * original libSonic for sola processing (along with the new speed.)
-     */
+  /* Compute the tension. First see if anybody wants to know the result. */
+  if (!speedyComputeTension(mySpeedyStream, tensionTime, tension)) {
+    return 0;
+  }
+  if (mySpeedyConnector->returnTension) {
+    (mySpeedyConnector->returnTension)(mySonicStream, tensionTime, *tension);
+  }
+  if (mySpeedyConnector->returnFeatures) {
+    (mySpeedyConnector->returnFeatures)(mySonicStream, tensionTime,
+                                        speedyGetInternalState(mySpeedyStream));
+  }
 #ifdef  DEBUG
-    printf("  Got back a tension result (%g) at time %d.\n",
-           newTension,
-           mySpeedyConnector->readBufferFrameIndex); fflush(stdout);
+  printf("  Got back a tension result (%g) at time %d.\n",
+         *tension, tensionTime); fflush(stdout);
 #endif
+  return 1;
+}
 
-    float newRate = speedyComputeSpeedFromTension(
-        newTension, mySpeedyConnector->globalSpeed);
-    // Interpolate between speedy-derived speed, and the global/linear request.
-    float globalSpeed = mySpeedyConnector->globalSpeed;
-    newRate = newRate    *   mySpeedyConnector->speedyNonlinearFactor +
-              globalSpeed*(1-mySpeedyConnector->speedyNonlinearFactor);
+/* We have a new tension for the buffer at readBufferFrameIndex.  Compute the
+ * new speedup and pass it to the sonic library, and then send it the buffer so
+ * these samples get spedup by this new speed.
+ */
+static void sonicApplyTension(sonicStream mySonicStream, float newTension) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (!sonicIsOutputBuffer(mySpeedyConnector,
+                           mySpeedyConnector->readBufferFrameIndex)) {
+    mySpeedyConnector->readBufferFrameIndex++;
+    return;
+  }
+  float newRate = speedyComputeSpeedFromTension(
+      newTension, mySpeedyConnector->globalSpeed);
+  // Interpolate between speedy-derived speed, and the global/linear request.
+  float globalSpeed = mySpeedyConnector->globalSpeed;
+  newRate = newRate    *   mySpeedyConnector->speedyNonlinearFactor +
+            globalSpeed*(1-mySpeedyConnector->speedyNonlinearFactor);
 #ifdef  DEBUG
-    printf("  Requesting a speed of %g from libsonicInt.\n", newRate);
+  printf("  Requesting a speed of %g from libsonicInt.\n", newRate);
 #endif
-    if (mySpeedyConnector->returnSpeed) {
-      (mySpeedyConnector->returnSpeed)(mySonicStream,
-                                       mySpeedyConnector->readBufferFrameIndex,
-                                       newRate);
-    }
-    sonicIntSetSpeed(mySonicStream, newRate);
-    int readIndex = mySpeedyConnector->readBufferFrameIndex %
-                    mySpeedyConnector->bufferCount;
-    short *readBuffer = mySpeedyConnector->bufferList[readIndex];
+  if (mySpeedyConnector->returnSpeed) {
+    (mySpeedyConnector->returnSpeed)(mySonicStream,
+                                     mySpeedyConnector->readBufferFrameIndex,
+                                     newRate);
+  }
+  sonicIntSetSpeed(mySonicStream, newRate);
 #ifdef  DEBUG
-    printf("  Sending %d samples at time %d to libsonicInt for processing...\n",
-           mySpeedyConnector->bufferSize,
-           mySpeedyConnector->readBufferFrameIndex);
-    fflush(stdout);
+  printf("  Sending %d samples at time %d to libsonicInt for processing...\n",
+         mySpeedyConnector->bufferSize,
+         mySpeedyConnector->readBufferFrameIndex);
+  fflush(stdout);
+  if (!mySpeedyConnector->floatBuffers) {
+    int i;
+    short *readBuffer = mySpeedyConnector->bufferList[
+        mySpeedyConnector->readBufferFrameIndex %
+        mySpeedyConnector->bufferCount];
     printf("Frame %d sb:", mySpeedyConnector->readBufferFrameIndex);
     for (i=0; i<mySpeedyConnector->bufferSize; i++) {
       printf(" %d", readBuffer[i]);
     }
     printf("\n");
+  }
 #endif
-    sonicIntWriteShortToStream(mySonicStream, readBuffer,
-                               mySpeedyConnector->bufferSize);
-    mySpeedyConnector->readBufferFrameIndex++;
+  sonicWriteBufferToSonic(mySonicStream,
+                          mySpeedyConnector->readBufferFrameIndex);
+  mySpeedyConnector->readBufferFrameIndex++;
+}
+
+/* The analysis thread.  The thread writing to the stream (the writer) queues
+ * each speedy input frame on a ring of kAnalysisQueueSize frames, and the
+ * analysis thread runs speedy on them and queues the tensions on a second
+ * ring.  The writer then applies the tensions (see sonicApplyTension) to the
+ * buffers, in frame order, when it next writes, reads or flushes.  Each ring
+ * has one producer and one consumer, so they need no locks.  The mutex and
+ * condition variables are only used when one side has to sleep until the
+ * other makes progress.
+ */
+static void sonicWakeAnalysis(sonicAnalysisThread myThread, atomic_int* waiting,
+                              pthread_cond_t* condition) {
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&myThread->mutex);
+    pthread_cond_signal(condition);
+    pthread_mutex_unlock(&myThread->mutex);
+  }
+}
+
+static void* sonicAnalysisThreadMain(void* arg) {
+  sonicAnalysisThread myThread = (sonicAnalysisThread)arg;
+  int tensionTime = 0;
+  while (1) {
+    unsigned int frame = atomic_load(&myThread->frameRead);
+    if (frame == atomic_load(&myThread->frameWrite)) {
+      pthread_mutex_lock(&myThread->mutex);
+      atomic_store(&myThread->analysisWaiting, 1);
+      while (!atomic_load(&myThread->stop) &&
+             frame == atomic_load(&myThread->frameWrite)) {
+        pthread_cond_wait(&myThread->frameReady, &myThread->mutex);
+      }
+      atomic_store(&myThread->analysisWaiting, 0);
+      pthread_mutex_unlock(&myThread->mutex);
+      if (atomic_load(&myThread->stop)) {
+        break;
+      }
+    }
+    int slot = frame % kAnalysisQueueSize;
+    float newTension = 0.0;
+    if (sonicAnalyzeFrame(myThread->mySonicStream, myThread->frameInputs[slot],
+                          myThread->frameTimes[slot], tensionTime,
+                          &newTension)) {
+      unsigned int result = atomic_load(&myThread->resultWrite);
+      if (result - atomic_load(&myThread->resultRead) >= kAnalysisQueueSize) {
+        pthread_mutex_lock(&myThread->mutex);
+        atomic_store(&myThread->analysisWaiting, 1);
+        while (!atomic_load(&myThread->stop) &&
+               result - atomic_load(&myThread->resultRead) >=
+               kAnalysisQueueSize) {
+          pthread_cond_wait(&myThread->resultRoom, &myThread->mutex);
+        }
+        atomic_store(&myThread->analysisWaiting, 0);
+        pthread_mutex_unlock(&myThread->mutex);
+        if (atomic_load(&myThread->stop)) {
+          break;
+        }
+      }
+      myThread->resultTimes[result % kAnalysisQueueSize] = tensionTime++;
+      myThread->resultTensions[result % kAnalysisQueueSize] = newTension;
+      atomic_store(&myThread->resultWrite, result + 1);
+    }
+    /* The slot is free once the frame is analyzed. */
+    atomic_store(&myThread->frameRead, frame + 1);
+    sonicWakeAnalysis(myThread, &myThread->writerWaiting,
+                      &myThread->writerWake);
+  }
+  return NULL;
+}
+
+/* Called by the writer: apply all the tensions the analysis thread has
+ * computed so far.
+ */
+static void sonicApplyAnalysisResults(sonicStream mySonicStream) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  unsigned int result = atomic_load(&myThread->resultRead);
+  unsigned int resultEnd = atomic_load(&myThread->resultWrite);
+  if (result == resultEnd) {
+    return;
+  }
+  for (; result != resultEnd; result++) {
+    assert(myThread->resultTimes[result % kAnalysisQueueSize] ==
+           mySpeedyConnector->readBufferFrameIndex);
+    sonicApplyTension(mySonicStream,
+                      myThread->resultTensions[result % kAnalysisQueueSize]);
+  }
+  atomic_store(&myThread->resultRead, result);
+  sonicWakeAnalysis(myThread, &myThread->analysisWaiting,
+                    &myThread->resultRoom);
+}
+
+/* Called by the writer: apply the tensions computed so far, and then, while
+ * done() is true, sleep until the analysis thread makes more progress.
+ */
+static void sonicWaitForAnalysis(sonicStream mySonicStream,
+                                 int (*done)(speedyConnection)) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  sonicApplyAnalysisResults(mySonicStream);
+  while (!done(mySpeedyConnector)) {
+    pthread_mutex_lock(&myThread->mutex);
+    atomic_store(&myThread->writerWaiting, 1);
+    /* Sleep unless progress was made after done() was checked.  The analysis
+     * thread wakes us after it makes progress, if it sees writerWaiting.
+     */
+    if (atomic_load(&myThread->resultWrite) ==
+        atomic_load(&myThread->resultRead) && !done(mySpeedyConnector)) {
+      pthread_cond_wait(&myThread->writerWake, &myThread->mutex);
+    }
+    atomic_store(&myThread->writerWaiting, 0);
+    pthread_mutex_unlock(&myThread->mutex);
+    sonicApplyAnalysisResults(mySonicStream);
   }
 }
 
+static int sonicFrameSlotFree(speedyConnection mySpeedyConnector) {
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  return atomic_load(&myThread->frameWrite) -
+         atomic_load(&myThread->frameRead) < kAnalysisQueueSize;
+}
+
+static int sonicAnalysisIdle(speedyConnection mySpeedyConnector) {
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  return atomic_load(&myThread->frameWrite) ==
+         atomic_load(&myThread->frameRead) &&
+         atomic_load(&myThread->resultWrite) ==
+         atomic_load(&myThread->resultRead);
+}
+
+/* The buffer at writeBufferFrameIndex can be filled once the buffer that was
+ * there before has been sent to the original libsonic.
+ */
+static int sonicWriteBufferFree(speedyConnection mySpeedyConnector) {
+  return mySpeedyConnector->writeBufferFrameIndex -
+         mySpeedyConnector->readBufferFrameIndex <
+         mySpeedyConnector->bufferCount;
+}
+
+/* Queue the frame of samples at input, from frame time atTime, once there is
+ * a free slot.
+ */
+static void sonicQueueFrame(sonicStream mySonicStream, const float* input,
+                            int atTime) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  sonicWaitForAnalysis(mySonicStream, sonicFrameSlotFree);
+  unsigned int frame = atomic_load(&myThread->frameWrite);
+  myThread->frameTimes[frame % kAnalysisQueueSize] = atTime;
+  myThread->frameInputs[frame % kAnalysisQueueSize] = input;
+  atomic_store(&myThread->frameWrite, frame + 1);
+  sonicWakeAnalysis(myThread, &myThread->analysisWaiting,
+                    &myThread->frameReady);
+}
+
+static void sonicStopAnalysisThread(speedyConnection mySpeedyConnector) {
+  sonicAnalysisThread myThread = mySpeedyConnector->analysisThread;
+  if (!myThread) {
+    return;
+  }
+  pthread_mutex_lock(&myThread->mutex);
+  atomic_store(&myThread->stop, 1);
+  pthread_cond_broadcast(&myThread->frameReady);
+  pthread_cond_broadcast(&myThread->resultRoom);
+  pthread_mutex_unlock(&myThread->mutex);
+  pthread_join(myThread->thread, NULL);
+  pthread_cond_destroy(&myThread->frameReady);
+  pthread_cond_destroy(&myThread->resultRoom);
+  pthread_cond_destroy(&myThread->writerWake);
+  pthread_mutex_destroy(&myThread->mutex);
+  free(myThread);
+  mySpeedyConnector->analysisThread = NULL;
+}
+
+/* Start the analysis thread.  Return 0 (and keep analyzing on the writer's
+ * thread) if it can't be started.
+ */
+static int sonicStartAnalysisThread(sonicStream mySonicStream) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  sonicAnalysisThread myThread = (sonicAnalysisThread)
+      calloc(1, sizeof(struct sonicAnalysisThreadStruct));
+  if (!myThread) {
+    return 0;
+  }
+  myThread->mySonicStream = mySonicStream;
+  pthread_mutex_init(&myThread->mutex, NULL);
+  pthread_cond_init(&myThread->frameReady, NULL);
+  pthread_cond_init(&myThread->resultRoom, NULL);
+  pthread_cond_init(&myThread->writerWake, NULL);
+  if (pthread_create(&myThread->thread, NULL, sonicAnalysisThreadMain,
+                     myThread)) {
+    pthread_cond_destroy(&myThread->frameReady);
+    pthread_cond_destroy(&myThread->resultRoom);
+    pthread_cond_destroy(&myThread->writerWake);
+    pthread_mutex_destroy(&myThread->mutex);
+    free(myThread);
+    return 0;
+  }
+  mySpeedyConnector->analysisThread = myThread;
+  return 1;
+}
+
+/* Apply any tensions the analysis thread has ready, without waiting. */
+static void sonicPollAnalysis(sonicStream mySonicStream) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (mySpeedyConnector->analysisThread) {
+    sonicApplyAnalysisResults(mySonicStream);
+  }
+}
+
+/* With a tension track there is no analysis, so instead of sending the frame
+ * to speedy, apply the track's tension for the oldest buffer.  This is one
+ * tension per frame, like the analysis, and the buffers after the end of the
+ * track are flushed at the last speed, so the output is the same as when the
+ * track was made.
+ */
+static void sonicUseTrackTension(sonicStream mySonicStream) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  speedyTrack track = mySpeedyConnector->tensionTrack;
+  int tensionTime = mySpeedyConnector->readBufferFrameIndex;
+  mySpeedyConnector->speedyBufferFrameIndex++;  /* Move to next frame. */
+  if (tensionTime >= speedyTrackFrameCount(track)) {
+    return;
+  }
+  float newTension = speedyTrackTension(track, tensionTime);
+  if (mySpeedyConnector->returnTension) {
+    (mySpeedyConnector->returnTension)(mySonicStream, tensionTime, newTension);
+  }
+  if (mySpeedyConnector->returnFeatures && speedyTrackFeatureCount(track)) {
+    (mySpeedyConnector->returnFeatures)(
+        mySonicStream, tensionTime,
+        (float*)speedyTrackFeatures(track, tensionTime));
+  }
+  sonicApplyTension(mySonicStream, newTension);
+}
+
+/* sonicSendDataToSpeedy - We now have enough new data to send to Speedy. Send
+ * one buffer. Then check to see if we have sent enough data to speedy to get
+ * back a new tension estimate.  If so, use the tension to calculate a new
+ * speedup, tell the original libsonic the new speed, and send it the
+ * corresponding buffer.  With an analysis thread, the frame is queued for it
+ * instead, and the tension is applied later by sonicApplyAnalysisResults().
+ */
+void sonicSendDataToSpeedy(sonicStream mySonicStream) {
+  assert(mySonicStream);
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  int sonicBufferSize = mySpeedyConnector->bufferSize;
+  assert(mySpeedyConnector->speedyBufferFrameIndex <
+         mySpeedyConnector->writeBufferFrameIndex);
+  assert(mySpeedyConnector->writeBufferFrameLocation >
+         speedyInputFrameSize(
+             (speedyStream)mySpeedyConnector->mySpeedyStream) %
+         sonicBufferSize);
+  if (mySpeedyConnector->tensionTrack) {
+    sonicUseTrackTension(mySonicStream);
+    return;
+  }
+  /* The frame's full buffers and the start of the next one are already mixed
+   * down, one after the other in the mono ring.
+   */
+  const float* input = mySpeedyConnector->monoRing +
+      (mySpeedyConnector->speedyBufferFrameIndex %
+       mySpeedyConnector->bufferCount)*sonicBufferSize;
+  mySpeedyConnector->speedyBufferFrameIndex++;  /* Move to next frame. */
+
+  if (mySpeedyConnector->analysisThread) {
+    sonicQueueFrame(mySonicStream, input,
+                    mySpeedyConnector->writeBufferFrameIndex);
+    return;
+  }
+  float newTension = 0.0;
+  if (sonicAnalyzeFrame(mySonicStream, input,
+                        mySpeedyConnector->writeBufferFrameIndex,
+                        mySpeedyConnector->readBufferFrameIndex,
+                        &newTension)) {
+    /* Now that we have a new tension, send the data we have stored to the
+     * original libSonic for sola processing (along with the new speed.)
+     */
+    sonicApplyTension(mySonicStream, newTension);
+  }
+}
+
+/* The write functions copy the input in spans that stop at the end of the
+ * current buffer, and at the sample that completes the next frame for speedy
+ * (partialCountNeeded+1 samples into a buffer).  Return the number of samples
+ * (at most sampleCount) that go into the current buffer before the next of
+ * these boundaries, and where to put them (the buffer index, and the offset
+ * in values into that buffer.)
+ */
+static int sonicNextWriteSpan(speedyConnection mySpeedyConnector,
+                              int partialCountNeeded, int sampleCount,
+                              int* writeIndex, int* writeOffset) {
+  int location = mySpeedyConnector->writeBufferFrameLocation;
+  int spanEnd = mySpeedyConnector->bufferSize;
+  if (location <= partialCountNeeded) {
+    spanEnd = partialCountNeeded + 1;
+  }
+  int spanCount = spanEnd - location;
+  if (spanCount > sampleCount) {
+    spanCount = sampleCount;
+  }
+  *writeIndex = mySpeedyConnector->writeBufferFrameIndex %
+                mySpeedyConnector->bufferCount;
+  *writeOffset = location*mySpeedyConnector->channelCount;
+  return spanCount;
+}
+
+/* Whether writing spanCount more samples (0 for the span just written)
+ * completes the next frame for speedy.
+ */
+static int sonicSpanCompletesFrame(speedyConnection mySpeedyConnector,
+                                   int spanCount, int speedyFullBufferCount,
+                                   int partialCountNeeded) {
+  return mySpeedyConnector->writeBufferFrameIndex >=
+         mySpeedyConnector->speedyBufferFrameIndex+speedyFullBufferCount &&
+         mySpeedyConnector->writeBufferFrameLocation + spanCount ==
+         partialCountNeeded+1;
+}
+
+/* Account for spanCount samples just copied by the write functions.  Then,
+ * exactly as if they were written one at a time, send a frame to speedy if
+ * the span completed one, and move to the next buffer if this one is full.
+ */
+static void sonicFinishWriteSpan(sonicStream mySonicStream, int spanCount,
+                                 int speedyFullBufferCount,
+                                 int partialCountNeeded) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  mySpeedyConnector->writeBufferFrameLocation += spanCount;
+  /* Check to see if we have enough of a partial buffer to send to Speedy. */
+  if (sonicSpanCompletesFrame(mySpeedyConnector, 0, speedyFullBufferCount,
+                              partialCountNeeded)) {
+    sonicSendDataToSpeedy(mySonicStream);
+  }
+  /* Check for full buffer and then wrap. */
+  if (mySpeedyConnector->writeBufferFrameLocation >=
+      mySpeedyConnector->bufferSize) {
+    mySpeedyConnector->writeBufferFrameLocation = 0;
+    mySpeedyConnector->writeBufferFrameIndex++;
+  }
+  int heldBuffers = mySpeedyConnector->writeBufferFrameIndex -
+                    mySpeedyConnector->readBufferFrameIndex;
+  if (heldBuffers > mySpeedyConnector->maxHeldBuffers) {
+    mySpeedyConnector->maxHeldBuffers = heldBuffers;
+  }
+}
+
+/* With an analysis thread, a span can be written once the buffer at
+ * writeBufferFrameIndex is free, and if it completes a frame for speedy, once
+ * there is a slot to queue the frame.  This only waits if nothing has been
+ * written yet.  Otherwise return 0, and the write returns the samplesWritten
+ * so far.
+ */
+static int sonicWaitForWriteSpan(sonicStream mySonicStream,
+                                 int completesFrame, int samplesWritten) {
+  speedyConnection mySpeedyConnector =
+      (speedyConnection)sonicIntGetUserData(mySonicStream);
+  if (!mySpeedyConnector->analysisThread) {
+    /* The frames are analyzed as they are written, so this always holds. */
+    assert(sonicWriteBufferFree(mySpeedyConnector));
+    return 1;
+  }
+  sonicApplyAnalysisResults(mySonicStream);
+  if (sonicWriteBufferFree(mySpeedyConnector) &&
+      (!completesFrame || sonicFrameSlotFree(mySpeedyConnector))) {
+    return 1;
+  }
+  if (samplesWritten > 0) {
+    return 0;
+  }
+  sonicWaitForAnalysis(mySonicStream, sonicWriteBufferFree);
+  return 1;
+}
+
 /*
  * This the main input for sound to Speedy. This kicks off the processing needed
  * so Speedy can calculate the necessary speedup (when you use sonicRead...
@@ -386,6 +1378,10 @@ void sonicSendDataToSpeedy(sonicStream mySonicStream) {
  * buffer list, and eventually passed to the original sonic.  But speedy needs
  * more data to do its analysis (50% overlap) so we have to make sure we have
  * enough data to pass a full buffer to Speedy.
+ *
+ * If the stream's buffers hold floats (see sonicWriteFloatToStream) the shorts
+ * are converted to floats as they are stored.  Returns the number of samples
+ * taken, which is only less than sampleCount with an analysis thread.
 */
 int sonicWriteShortToStream(sonicStream mySonicStream, short* inBuffer,
                             int sampleCount){
@@ -394,10 +1390,18 @@ int sonicWriteShortToStream(sonicStream mySonicStream, short* inBuffer,
   speedyConnection mySpeedyConnector =
       (speedyConnection)sonicIntGetUserData(mySonicStream);
   if (!mySpeedyConnector->speedyNonlinearFactor) {    /* Short circuit speedy */
-    return sonicIntWriteShortToStream(mySonicStream, inBuffer, sampleCount);
+    SONIC_STATS_START(solaStart);
+    int written = sonicIntWriteShortToStream(mySonicStream, inBuffer,
+                                             sampleCount);
+    SONIC_STATS_ADD(mySpeedyConnector, solaStart);
+    if (!written) {
+      return 0;
+    }
+    return sampleCount > 0 ? sampleCount : 1;
   }
-  if (!mySpeedyConnector->bufferList) {
-    sonicAllocateBuffers(mySonicStream, sampleCount);
+  if (!mySpeedyConnector->bufferBlock &&
+      !sonicAllocateBuffers(mySonicStream, 0)) {
+    return 0;
   }
   speedyStream mySpeedyStream = (speedyStream)mySpeedyConnector->mySpeedyStream;
   int speedyBufferSize = speedyInputFrameSize(mySpeedyStream);
@@ -423,35 +1427,49 @@ int sonicWriteShortToStream(sonicStream mySonicStream, short* inBuffer,
          speedyFullBufferCount, mySpeedyConnector->writeBufferFrameLocation);
   #endif
 
+  int channelCount = mySpeedyConnector->channelCount;
+  int samplesWritten = 0;
   while (inBuffer && sampleCount > 0) {
-    int writeIndex = mySpeedyConnector->writeBufferFrameIndex %
-                     mySpeedyConnector->bufferCount;
-    short* writeBuffer = mySpeedyConnector->bufferList[writeIndex];
-    int j, channelCount = mySpeedyConnector->channelCount;
-    /* Copy all the channels into sonic buffer for the sample at this time. */
-    for (j=0; j<channelCount; j++) {
-      int loc = mySpeedyConnector->writeBufferFrameLocation * channelCount;
-      writeBuffer[loc+j] = *inBuffer++;
+    int writeIndex, writeOffset;
+    int spanCount = sonicNextWriteSpan(mySpeedyConnector, partialCountNeeded,
+                                       sampleCount, &writeIndex, &writeOffset);
+    if (!sonicWaitForWriteSpan(
+            mySonicStream,
+            sonicSpanCompletesFrame(mySpeedyConnector, spanCount,
+                                    speedyFullBufferCount, partialCountNeeded),
+            samplesWritten)) {
+      break;
     }
-    mySpeedyConnector->writeBufferFrameLocation++;
-    sampleCount--;
-    /* Check to see if we have enough of a partial buffer to send to Speedy. */
-    if (mySpeedyConnector->writeBufferFrameIndex >=
-        mySpeedyConnector->speedyBufferFrameIndex+speedyFullBufferCount &&
-        mySpeedyConnector->writeBufferFrameLocation == partialCountNeeded+1) {
-      sonicSendDataToSpeedy(mySonicStream);
+    int j, valueCount = spanCount*channelCount;
+    /* Copy all the channels of the whole span into the sonic buffer. */
+    if (mySpeedyConnector->floatBuffers) {
+      float* writeBuffer =
+          mySpeedyConnector->floatBufferList[writeIndex] + writeOffset;
+      for (j=0; j<valueCount; j++) {
+        writeBuffer[j] = inBuffer[j]/32768.0f;
+      }
+    } else {
+      memcpy(mySpeedyConnector->bufferList[writeIndex] + writeOffset,
+             inBuffer, sizeof(short)*valueCount);
     }
-    /* Check for full buffer and then wrap. */
-    if (mySpeedyConnector->writeBufferFrameLocation >= sonicBufferSize) {
-      mySpeedyConnector->writeBufferFrameLocation = 0;
-      mySpeedyConnector->writeBufferFrameIndex++;
+    if (!mySpeedyConnector->tensionTrack) {
+      sonicDownmixForSpeedy(mySpeedyConnector, writeIndex,
+                            mySpeedyConnector->writeBufferFrameLocation,
+                            spanCount);
     }
+    inBuffer += valueCount;
+    sampleCount -= spanCount;
+    samplesWritten += spanCount;
+    sonicFinishWriteSpan(mySonicStream, spanCount, speedyFullBufferCount,
+                         partialCountNeeded);
   }
-  return 1;
+  return samplesWritten > 0 ? samplesWritten : 1;
 }
 
-/* Like above, but convert floats to shorts before saving them into the buffer
- * and processing them.
+/* Like above, but for floats.  If this is the first write to the stream the
+ * buffers hold floats, and the samples go to speedy and to the original
+ * libsonic without being quantized to shorts.  Otherwise they are converted
+ * to shorts, saturating at full scale.
  */
 int sonicWriteFloatToStream(sonicStream mySonicStream, float* inBuffer,
                             int sampleCount){
@@ -460,10 +1478,18 @@ int sonicWriteFloatToStream(sonicStream mySonicStream, float* inBuffer,
   speedyConnection mySpeedyConnector =
       (speedyConnection)sonicIntGetUserData(mySonicStream);
   if (!mySpeedyConnector->speedyNonlinearFactor) {    /* Short circuit speedy */
-    return sonicIntWriteFloatToStream(mySonicStream, inBuffer, sampleCount);
+    SONIC_STATS_START(solaStart);
+    int written = sonicIntWriteFloatToStream(mySonicStream, inBuffer,
+                                             sampleCount);
+    SONIC_STATS_ADD(mySpeedyConnector, solaStart);
+    if (!written) {
+      return 0;
+    }
+    return sampleCount > 0 ? sampleCount : 1;
   }
-  if (!mySpeedyConnector->bufferList) {
-    sonicAllocateBuffers(mySonicStream, sampleCount);
+  if (!mySpeedyConnector->bufferBlock &&
+      !sonicAllocateBuffers(mySonicStream, 1)) {
+    return 0;
   }
   speedyStream mySpeedyStream = (speedyStream)mySpeedyConnector->mySpeedyStream;
   int speedyBufferSize = speedyInputFrameSize(mySpeedyStream);
@@ -485,40 +1511,54 @@ int sonicWriteFloatToStream(sonicStream mySonicStream, float* inBuffer,
          speedyFullBufferCount, mySpeedyConnector->writeBufferFrameLocation);
   #endif
 
+  assert(partialCountNeeded < sonicBufferSize);
+  int channelCount = mySpeedyConnector->channelCount;
+  int samplesWritten = 0;
   while (inBuffer && sampleCount > 0) {
-    int writeIndex = mySpeedyConnector->writeBufferFrameIndex %
-                     mySpeedyConnector->bufferCount;
-    short* writeBuffer = mySpeedyConnector->bufferList[writeIndex];
-    int j, channelCount = mySpeedyConnector->channelCount;
-    for (j=0; j<channelCount; j++) {
-      int loc = mySpeedyConnector->writeBufferFrameLocation * channelCount;
-      writeBuffer[loc + j] = (short)(*inBuffer++ * 32768.0);
+    int writeIndex, writeOffset;
+    int spanCount = sonicNextWriteSpan(mySpeedyConnector, partialCountNeeded,
+                                       sampleCount, &writeIndex, &writeOffset);
+    if (!sonicWaitForWriteSpan(
+            mySonicStream,
+            sonicSpanCompletesFrame(mySpeedyConnector, spanCount,
+                                    speedyFullBufferCount, partialCountNeeded),
+            samplesWritten)) {
+      break;
     }
-    mySpeedyConnector->writeBufferFrameLocation++;
-    sampleCount--;
-    /* Check to see if we have enough of a partial buffer to send to Speedy. */
-    assert(partialCountNeeded < sonicBufferSize);
-    if (mySpeedyConnector->writeBufferFrameIndex >=
-        mySpeedyConnector->speedyBufferFrameIndex+speedyFullBufferCount &&
-        mySpeedyConnector->writeBufferFrameLocation == partialCountNeeded+1) {
-      sonicSendDataToSpeedy(mySonicStream);
+    int j, valueCount = spanCount*channelCount;
+    if (mySpeedyConnector->floatBuffers) {
+      memcpy(mySpeedyConnector->floatBufferList[writeIndex] + writeOffset,
+             inBuffer, sizeof(float)*valueCount);
+    } else {
+      short* writeBuffer =
+          mySpeedyConnector->bufferList[writeIndex] + writeOffset;
+      for (j=0; j<valueCount; j++) {
+        writeBuffer[j] = sonicFloatToShort(inBuffer[j]);
+      }
     }
-    /* Check for full buffer and then wrap. */
-    if (mySpeedyConnector->writeBufferFrameLocation >= sonicBufferSize) {
-      mySpeedyConnector->writeBufferFrameLocation = 0;
-      mySpeedyConnector->writeBufferFrameIndex++;
+    if (!mySpeedyConnector->tensionTrack) {
+      sonicDownmixForSpeedy(mySpeedyConnector, writeIndex,
+                            mySpeedyConnector->writeBufferFrameLocation,
+                            spanCount);
     }
+    inBuffer += valueCount;
+    sampleCount -= spanCount;
+    samplesWritten += spanCount;
+    sonicFinishWriteSpan(mySonicStream, spanCount, speedyFullBufferCount,
+                         partialCountNeeded);
   }
-  return 1;
+  return samplesWritten > 0 ? samplesWritten : 1;
 }
 
 int sonicReadShortFromStream(sonicStream mySonicStream, short* outBuffer,
                              int bufferSize){
+  sonicPollAnalysis(mySonicStream);
   return sonicIntReadShortFromStream(mySonicStream, outBuffer, bufferSize);
 }
 
 int sonicReadFloatFromStream(sonicStream mySonicStream, float* outBuffer,
                              int bufferSize){
+  sonicPollAnalysis(mySonicStream);
   return sonicIntReadFloatFromStream(mySonicStream, outBuffer, bufferSize);
 }
 
@@ -531,20 +1571,26 @@ int sonicFlushStream(sonicStream mySonicStream){
         mySpeedyConnector->readBufferFrameIndex,
         mySpeedyConnector->writeBufferFrameIndex);
 #endif
+  /* Let the analysis thread finish the frames it has, so these buffers are
+   * sent with the speed it computes.
+   */
+  if (mySpeedyConnector->analysisThread) {
+    sonicWaitForAnalysis(mySonicStream, sonicAnalysisIdle);
+  }
   while (mySpeedyConnector->readBufferFrameIndex <
          mySpeedyConnector->writeBufferFrameIndex) {
-    int readIndex = mySpeedyConnector->readBufferFrameIndex %
-                    mySpeedyConnector->bufferCount;
-    short *curBuffer = mySpeedyConnector->bufferList[readIndex];
 #ifdef  DEBUG
     printf("Flushing buffer at time %d to libsonicInt\n",
            mySpeedyConnector->readBufferFrameIndex); fflush(stdout);
 #endif
-    sonicIntWriteShortToStream(mySonicStream, curBuffer,
-                               mySpeedyConnector->bufferSize);
+    sonicWriteBufferToSonic(mySonicStream,
+                            mySpeedyConnector->readBufferFrameIndex);
     mySpeedyConnector->readBufferFrameIndex++;
   }
-  return sonicIntFlushStream(mySonicStream);
+  SONIC_STATS_START(solaStart);
+  int flushed = sonicIntFlushStream(mySonicStream);
+  SONIC_STATS_ADD(mySpeedyConnector, solaStart);
+  return flushed;
 }
 
 /* Enable non-linear speedup. */
@@ -655,7 +1701,7 @@ int sonicSpectrogramSize(sonicStream mySonicStream) {
   if (mySonicStream) {
     speedyConnection mySpeedyConnector =
         (speedyConnection)sonicIntGetUserData(mySonicStream);
-    return speedyFFTSize(mySpeedyConnector->mySpeedyStream);
+    return speedySpectrogramSize(mySpeedyConnector->mySpeedyStream);
   } else {
     return 0;
   }
@@ -666,6 +1712,10 @@ int getSonicBufferSize(sonicStream mySonicStream) {
   if (mySonicStream) {
     speedyConnection mySpeedyConnector =
         (speedyConnection)sonicIntGetUserData(mySonicStream);
+    if (!mySpeedyConnector->bufferBlock) {
+      /* Not allocated yet, but this is the size it will be. */
+      return speedyInputFrameStep(mySpeedyConnector->mySpeedyStream);
+    }
     return mySpeedyConnector->bufferSize;
   } else {
     return 0;
@@ -20,31 +20,51 @@
 
    TODO(malcolmslaney): Need to write tests for higher-level functions
    TODO(malcolmslaney): Make sure I get the same response no matter the input
-     sample rate.
+     sample rate.  (Streams created with speedyCreateStreamWithAnalysisRate()
+     resample to a fixed analysis rate, which addresses this.)
    TODO(malcolmslaney): check to see if hysteresis is better if center point
      is part of forward and backward average (so we don't get a big impulse at
      the center.)
-   TODO(malcolmslaney): Make sure all the spectrogram history allocs gets checked.
 */
 
 #include "speedy.h"
+#include "speedy_fft.h"
+#include "speedy_kernels.h"
 #include <assert.h>
-#include <complex.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifdef  KISS_FFT
-#include "kiss_fft.h"
-#else
-#include "fftw3.h"
-#endif  /* KISS_FFT */
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
+/* With SPEEDY_STATS, the stages add their time to stream->stats:
+ *   SPEEDY_STATS_START(start);
+ *   ... the stage ...
+ *   SPEEDY_STATS_ADD(stream, fft_ns, start);
+ * Otherwise these are empty.
+ */
+#ifdef  SPEEDY_STATS
+#include <time.h>
+
+static int64_t speedyNanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+#define SPEEDY_STATS_START(start) int64_t start = speedyNanoseconds()
+#define SPEEDY_STATS_ADD(stream, field, start) \
+  ((stream)->stats.field += speedyNanoseconds() - (start))
+#else
+#define SPEEDY_STATS_START(start)
+#define SPEEDY_STATS_ADD(stream, field, start)
+#endif  /* SPEEDY_STATS */
+
 /* A simple structure to implement a digital first order filter. */
 struct FirstOrderFilterStruct{
   float state;
@@ -88,36 +108,104 @@ void DeleteFirstOrderFilter(FirstOrderFilter fof) {
 
 #define  kFrameRateHz  100.0    /* in Hz */
 
-/* Make this buffer bigger than necessary to faciliate testing. */
-#define  kTemporalHysteresisBufferSize  2*(kTemporalHysteresisFuture+kTemporalHysteresisPast+1)
+/* Number of zero crossings on each side of the analysis resampling filter. */
+#define  kResampleZeroCrossings  8
+
+/* Make this buffer bigger than necessary to faciliate testing.  It is a power
+ * of two (at least 2*(kTemporalHysteresisFuture+kTemporalHysteresisPast+1)) so
+ * a time is wrapped into it with a mask.
+ */
+#define  kTemporalHysteresisBufferSize  64
+#if 2*(kTemporalHysteresisFuture+kTemporalHysteresisPast+1) > \
+    kTemporalHysteresisBufferSize
+#error "kTemporalHysteresisBufferSize is too small for the hysteresis spans"
+#endif
+
+/* Room for the candidates of a tapered maximum (at most span+1 of them), as a
+ * power of two.
+ */
+#define  kTaperedMaxQueueSize  16
+#if kTemporalHysteresisFuture >= kTaperedMaxQueueSize || \
+    kTemporalHysteresisPast >= kTaperedMaxQueueSize
+#error "kTaperedMaxQueueSize is too small for the hysteresis spans"
+#endif
 
 #define  kSpectrogramBufferSize  (kTemporalHysteresisFuture+kTemporalHysteresisPast+1)
 
+/* Each slot of the spectrogram history starts on a cache line. */
+#define  kCacheLineSize  64     /* in bytes */
+
+/* Marks a normalized history slot that does not hold any frame yet. */
+#define  kNoTime  INT64_MIN
+
+/* The running maximum of the hysteresis buffer over a window that slides one
+ * frame per query, with each frame tapered by a triangle that is 1 at the
+ * query time and reaches 0 span frames away (see speedyTaperedMax.)  A frame's
+ * tapered value is a line in the query time, rising in the future window and
+ * falling in the past one, and once a later frame's line overtakes an earlier
+ * one it stays ahead until the earlier frame leaves the window.  So only the
+ * frames that will be the maximum for some query are kept, oldest first, with
+ * the time the next one takes over.  Each frame is added and removed once, so
+ * the cost per query does not depend on the span.
+ */
+struct speedyTaperedMaxStruct {
+  int direction;                /* 1 for the future window, -1 for the past */
+  int span;
+  int count;                    /* Frames past the query time, at most span */
+  int64_t query_time;           /* The last query, or kNoTime */
+  int64_t next_time;            /* The next frame to add */
+  float max;                    /* The result of the last query */
+  int head;
+  int size;
+  int64_t times[kTaperedMaxQueueSize];
+  float values[kTaperedMaxQueueSize];
+  int64_t takeover[kTaperedMaxQueueSize];   /* When the next frame is larger */
+};
+
 /* These symbols are defined here with the preprocessor so we can keep their
  * values in the stream structure. This is needed to allow the test code to
  * query the internal state of the calculations, on a frame-by-frame basis.
  * These defines make their purpose clear, and makes the equations look like the
  * original matlab code (for easier checking.)
  */
+/* Position of each state variable in the features array.  A speedyBatch
+ * keeps the same variables, one row (of all its streams) per feature.
+ */
+#define kFeatureSpectrogramEnergy            0
+#define kFeatureEnergyLp                     1
+#define kFeatureEnergyLocal                  2
+#define kFeatureEnergyCompressed             3
+#define kFeatureEnergyHysteresis             4
+#define kFeatureLowEnergyFrame               5
+#define kFeatureLocalSpectralDifference      6
+#define kFeatureEmphasisWeightedDifference   7
+#define kFeatureEmphasisWeightedLpf          8
+#define kFeatureRelativeSpectralDifference   9
+#define kFeatureSpeechChanges               10
+#define kFeatureAudioTension                11
+#define kFeatureTimeEnergy                  12
+#define kFeatureTimeSpectral                13
+#define kFeatureLowEnergyThreshold          14
+
 /* These first state variables are computed at AddData time */
-#define s_energy_lp                          (stream->features[1])
-#define s_energy_local                       (stream->features[2])
-#define s_energy_compressed                  (stream->features[3])
-#define s_time_energy                        (stream->features[12])
+#define s_energy_lp                          (stream->features[kFeatureEnergyLp])
+#define s_energy_local                       (stream->features[kFeatureEnergyLocal])
+#define s_energy_compressed                  (stream->features[kFeatureEnergyCompressed])
+#define s_time_energy                        (stream->features[kFeatureTimeEnergy])
 
 /* These next variables are calculated at ComputeTension time */
-#define s_energy_hysteresis                  (stream->features[4])
-#define s_spectrogram_energy                 (stream->features[0])
-#define s_low_energy_threshold               (stream->features[14])
-#define s_low_energy_frame                   (stream->features[5])
-#define s_local_spectral_difference          (stream->features[6])
-#define s_emphasis_weighted_local_difference (stream->features[7])
-#define s_emphasis_weighted_lpf              (stream->features[8])
-#define s_relative_spectral_difference       (stream->features[9])
-#define s_speech_changes                     (stream->features[10])
-#define s_time_spectral                      (stream->features[13])
-
-#define s_audio_tension                      (stream->features[11])
+#define s_energy_hysteresis                  (stream->features[kFeatureEnergyHysteresis])
+#define s_spectrogram_energy                 (stream->features[kFeatureSpectrogramEnergy])
+#define s_low_energy_threshold               (stream->features[kFeatureLowEnergyThreshold])
+#define s_low_energy_frame                   (stream->features[kFeatureLowEnergyFrame])
+#define s_local_spectral_difference          (stream->features[kFeatureLocalSpectralDifference])
+#define s_emphasis_weighted_local_difference (stream->features[kFeatureEmphasisWeightedDifference])
+#define s_emphasis_weighted_lpf              (stream->features[kFeatureEmphasisWeightedLpf])
+#define s_relative_spectral_difference       (stream->features[kFeatureRelativeSpectralDifference])
+#define s_speech_changes                     (stream->features[kFeatureSpeechChanges])
+#define s_time_spectral                      (stream->features[kFeatureTimeSpectral])
+
+#define s_audio_tension                      (stream->features[kFeatureAudioTension])
 #define kFeatureValueCount                   15
 
 
@@ -126,28 +214,66 @@ void DeleteFirstOrderFilter(FirstOrderFilter fof) {
  *****************************************************************************/
 struct speedyStreamStruct {
   int sample_rate;                        /* samples per second, Hz */
-  int window_size;                        /* Number of samples in analysis */
-  int fft_size;                           /* Should be > window_size */
-  float* window;                          /* Cache the window for later use */
+  int window_size;                        /* Number of input samples per frame */
+  /* The spectrogram is computed at the analysis rate, which is the sample rate
+   * unless the stream was created with a (lower) fixed analysis rate.
+   */
+  int analysis_rate;                      /* samples per second, Hz */
+  int analysis_window_size;               /* Number of samples in analysis */
+  int fft_size;                           /* Should be > analysis_window_size */
+  int spectrogram_size;                   /* fft_size/2+1 real-input bins */
+  /* The window, resampler and FFT plan, shared by all streams with the same
+   * rates and FFT backend.  The next four fields point into it.
+   */
+  struct speedyAnalysisSetupStruct* setup;
+  const speedyFFT* fft;
+  const float* window;
+  const float* resample_weights;
+  const int* resample_start;
+  int resample_taps;
   float* input;
+  float* analysis_input;                  /* Same as input unless resampling */
   /* Last frame number received for processing via speedyAddData() */
   int64_t current_time;
-  float* spectrogram;                     /* Output of FFT routine, temporary */
+  float* spectrogram;                     /* Most recent history slot */
   float* last_spectrogram;
-  float* spectrogram_history[kSpectrogramBufferSize];
+  /* One aligned block with kSpectrogramBufferSize slots, spectrogram_stride
+   * floats apart.  The FFT magnitudes are written directly into the slot for
+   * the frame's time.
+   */
+  float* spectrogram_history;
+  int spectrogram_stride;
+  /* Each history slot is normalized (by speedyNormalizeByEnergy) once, the
+   * first time the spectral difference needs it, and then reused when it is
+   * the previous frame.  normalized_time says which frame each slot holds.
+   */
+  float* normalized_history;
+  float normalized_energy[kSpectrogramBufferSize];
+  float normalized_max[kSpectrogramBufferSize];
+  int64_t normalized_time[kSpectrogramBufferSize];
+  float* normalized_current;              /* Returned for debugging */
+  /* Scratch space for slices that are not in the history. */
   float* normalized_spectrogram;
   float* normalized_last_spectrogram;
-#ifdef  KISS_FFT
-  kiss_fft_cpx* input_buffer;
-  kiss_fft_cpx* fft_buffer;
-  kiss_fft_cfg spectrogram_plan;
-#else
-  fftw_complex* input_buffer;
-  fftw_complex* fft_buffer;
-  fftw_plan spectrogram_plan;
-#endif  /* KISS_FFT */
+  char* fft_scratch;                      /* For fft->execute() */
   float *hysteresis_buffer;
   int64_t hysteresis_index;    /* So it never wraps, even with long input */
+  /* The hysteresis spans, and how far it looks ahead before the tension is
+   * ready (see speedySetHysteresis.)  With less lookahead than the future
+   * span, future_max_bias estimates what the unseen frames add to the future
+   * maximum.
+   */
+  int hysteresis_future;
+  int hysteresis_past;
+  int hysteresis_lookahead;
+  struct FirstOrderFilterStruct future_max_bias;
+  /* The tapered maxima at the query time, and (for future_max_bias) over the
+   * whole and the seen future spans of the last fully seen frame.
+   */
+  struct speedyTaperedMaxStruct future_max;
+  struct speedyTaperedMaxStruct past_max;
+  struct speedyTaperedMaxStruct known_full_max;
+  struct speedyTaperedMaxStruct known_seen_max;
   float preemph_state;
   /* The following four variables are means over a long utterance and are used
    * to normalize the calculations below.
@@ -165,8 +291,15 @@ struct speedyStreamStruct {
   struct FirstOrderFilterStruct tension_filter;
 
   /* Internal state for debugging and testing purposes. */
-  int skipped_frames;
+  speedyStats stats;
   float features[kFeatureValueCount];
+
+  /* The stream and all its buffers are one aligned block of arena_size
+   * bytes.  The buffers start header_size bytes after the stream.
+   */
+  size_t arena_size;
+  size_t header_size;
+  struct speedyStreamStruct* next_idle;   /* For speedyStreamPool */
 };
 
 /* Just used for debugging */
@@ -194,61 +327,350 @@ int modulo(int x, int N){
 }
 
 
-/* Create a speedy stream.  Return NULL only if we are out of memory and cannot
-   allocate the stream. Design the windows and filters, initialize the FFT
-   package, and allocate all the storage. */
-speedyStream speedyCreateStream(int sample_rate) {
-  speedyStream stream = (speedyStream)calloc(1,
-                                             sizeof(struct speedyStreamStruct));
+/* Return the smallest even FFT length >= size whose only prime factors are 2,
+ * 3 and 5.  These lengths use the fast radix butterflies in both KISS FFT and
+ * FFTW, instead of their slow generic code for other prime factors.
+ */
+int speedyFastFFTSize(int size) {
+  if (size < 2) {
+    size = 2;
+  }
+  for (;; size++) {
+    int remainder = size;
+    if (remainder % 2) {
+      continue;
+    }
+    while (remainder % 2 == 0) remainder /= 2;
+    while (remainder % 3 == 0) remainder /= 3;
+    while (remainder % 5 == 0) remainder /= 5;
+    if (remainder == 1) {
+      return size;
+    }
+  }
+}
 
-  if (stream == NULL) {
+/*****************************************************************************
+ * The analysis setup (window, resampler and FFT plan) only depends on the
+ * sample and analysis rates, and is never changed once it is built.  So it is
+ * kept in a process-wide cache and shared by all the streams that use it.
+ * Streams take a reference when they are created and drop it when they are
+ * destroyed, and the setup is freed with the last reference.
+ *****************************************************************************/
+typedef struct speedyAnalysisSetupStruct {
+  int sample_rate;                        /* The cache key */
+  int analysis_rate;
+  int fft_size;
+  int window_size;
+  int analysis_window_size;
+  int reference_count;                    /* Protected by setup_mutex */
+  float* window;                          /* Hamming window */
+  /* Sparse filter that resamples one input frame to the analysis rate.  Output
+   * sample m is the dot product of resample_weights[m*resample_taps...] with
+   * input[resample_start[m]...]. NULL when no resampling is needed.
+   */
+  float* resample_weights;
+  int* resample_start;
+  int resample_taps;
+  const speedyFFT* fft;                   /* Also part of the key */
+  void* fft_plan;                         /* Only read by fft->execute() */
+  struct speedyAnalysisSetupStruct* next;
+} speedyAnalysisSetup;
+
+static pthread_mutex_t setup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static speedyAnalysisSetup* setup_cache = NULL;
+
+/* Design the windowed-sinc lowpass filter that takes one input frame
+ * (window_size samples at sample_rate) to analysis_window_size samples at
+ * analysis_rate.  The frame step is an integer number of samples at both
+ * rates, so the same filter applies to every frame.  Return 0 if out of memory.
+ */
+static int speedyDesignResampler(speedyAnalysisSetup* setup) {
+  double ratio = setup->sample_rate/(double)setup->analysis_rate;  /* > 1 */
+  double cutoff = 0.45/ratio;             /* Cycles per input sample */
+  double half_width = kResampleZeroCrossings*ratio;   /* In input samples */
+  int taps = 2*(int)ceil(half_width) + 1;
+  int m, k;
+
+  setup->resample_taps = taps;
+  setup->resample_weights = (float *) calloc(
+      (size_t)setup->analysis_window_size*taps, sizeof(float));
+  setup->resample_start = (int *) malloc(sizeof(int)*
+                                         setup->analysis_window_size);
+  if (!setup->resample_weights || !setup->resample_start) {
+    return 0;
+  }
+  for (m=0; m < setup->analysis_window_size; m++) {
+    double center = m*ratio;
+    int first = (int)ceil(center - half_width);
+    int last = (int)floor(center + half_width);
+    float* weights = setup->resample_weights + (size_t)m*taps;
+    double sum = 0.0;
+    if (first < 0) first = 0;
+    if (last > setup->window_size-1) last = setup->window_size-1;
+    setup->resample_start[m] = first;
+    for (k=first; k <= last; k++) {
+      double x = k - center;
+      double sinc = x == 0 ? 1.0 : sin(2*M_PI*cutoff*x)/(M_PI*x)/(2*cutoff);
+      double hann = 0.5 + 0.5*cos(M_PI*x/half_width);
+      weights[k-first] = sinc*hann;
+      sum += weights[k-first];
+    }
+    for (k=first; k <= last; k++) {          /* Unity gain at DC */
+      weights[k-first] /= sum;
+    }
+  }
+  return 1;
+}
+
+/* Free a setup that is no longer referenced (or was never finished.)  Called
+ * with setup_mutex held.
+ */
+static void speedyFreeSetup(speedyAnalysisSetup* setup) {
+  if (setup->window) free(setup->window);
+  if (setup->resample_weights) free(setup->resample_weights);
+  if (setup->resample_start) free(setup->resample_start);
+  if (setup->fft_plan) setup->fft->free_plan(setup->fft_plan);
+  free(setup);
+}
+
+/* Build the setup.  Return NULL if out of memory.  Called with setup_mutex
+ * held.
+ */
+static speedyAnalysisSetup* speedyCreateSetup(int sample_rate,
+                                              int analysis_rate, int fft_size,
+                                              int window_size,
+                                              int analysis_window_size,
+                                              const speedyFFT* fft) {
+  speedyAnalysisSetup* setup = (speedyAnalysisSetup*)calloc(
+      1, sizeof(speedyAnalysisSetup));
+  int i;
+
+  if (setup == NULL) {
+    return NULL;
+  }
+  setup->sample_rate = sample_rate;
+  setup->analysis_rate = analysis_rate;
+  setup->fft_size = fft_size;
+  setup->window_size = window_size;
+  setup->analysis_window_size = analysis_window_size;
+  setup->fft = fft;
+  setup->window = (float *) malloc(sizeof(float)*analysis_window_size);
+  if (!setup->window ||
+      (analysis_rate < sample_rate && !speedyDesignResampler(setup))) {
+    speedyFreeSetup(setup);
+    return NULL;
+  }
+  /* Design the Hamming window used when computing the spectrogram. */
+  for (i=0; i < analysis_window_size; i++) {
+    setup->window[i] = 0.54 - 0.46*cos(2*M_PI*i /
+                                       (analysis_window_size-1.0));
+  }
+  /* fft_size is always even, as required by the real-input transforms. */
+  setup->fft_plan = fft->create_plan(fft_size);
+  if (!setup->fft_plan) {
+    speedyFreeSetup(setup);
+    return NULL;
+  }
+  return setup;
+}
+
+/* Return a reference to the setup for these rates and FFT backend, building
+ * it if no other stream is using it.  Return NULL if out of memory.
+ */
+static speedyAnalysisSetup* speedyAcquireSetup(int sample_rate,
+                                               int analysis_rate, int fft_size,
+                                               int window_size,
+                                               int analysis_window_size,
+                                               const speedyFFT* fft) {
+  speedyAnalysisSetup* setup;
+  pthread_mutex_lock(&setup_mutex);
+  for (setup = setup_cache; setup; setup = setup->next) {
+    if (setup->sample_rate == sample_rate &&
+        setup->analysis_rate == analysis_rate && setup->fft_size == fft_size &&
+        setup->fft == fft) {
+      break;
+    }
+  }
+  if (!setup) {
+    setup = speedyCreateSetup(sample_rate, analysis_rate, fft_size,
+                              window_size, analysis_window_size, fft);
+    if (setup) {
+      setup->next = setup_cache;
+      setup_cache = setup;
+    }
+  }
+  if (setup) {
+    setup->reference_count++;
+  }
+  pthread_mutex_unlock(&setup_mutex);
+  return setup;
+}
+
+static void speedyReleaseSetup(speedyAnalysisSetup* setup) {
+  pthread_mutex_lock(&setup_mutex);
+  if (--setup->reference_count == 0) {
+    speedyAnalysisSetup** link = &setup_cache;
+    while (*link != setup) {
+      link = &(*link)->next;
+    }
+    *link = setup->next;
+    speedyFreeSetup(setup);
+    /* Only safe once no plans are in use anywhere. */
+    if (!setup_cache) {
+      speedyFFTCleanup();
+    }
+  }
+  pthread_mutex_unlock(&setup_mutex);
+}
+
+/* Resample one frame of input (window_size samples) into analysis_window_size
+ * samples at the analysis rate.  Taps that fall off the end of the frame
+ * have zero weight.
+ */
+static void speedyResampleInput(speedyStream stream, const float* input,
+                                float* output) {
+  int m, k, taps = stream->resample_taps;
+  for (m=0; m < stream->analysis_window_size; m++) {
+    const float* weights = stream->resample_weights + (size_t)m*taps;
+    const float* source = input + stream->resample_start[m];
+    int count = stream->window_size - stream->resample_start[m];
+    float sum = 0.0;
+    if (count > taps) count = taps;
+    for (k=0; k < count; k++) {
+      sum += weights[k]*source[k];
+    }
+    output[m] = sum;
+  }
+}
+
+/* Allocate size bytes aligned to a cache line.  The pointer returned by
+ * malloc is saved just before the aligned block so it can be freed.
+ */
+static void* speedyAlignedMalloc(size_t size) {
+  char* block = (char *) malloc(size + kCacheLineSize + sizeof(void*));
+  if (!block) {
     return NULL;
   }
+  char* aligned = block + sizeof(void*);
+  aligned += (kCacheLineSize - (uintptr_t)aligned % kCacheLineSize) %
+             kCacheLineSize;
+  ((void**)aligned)[-1] = block;
+  return aligned;
+}
+
+static void speedyAlignedFree(void* aligned) {
+  if (aligned) {
+    free(((void**)aligned)[-1]);
+  }
+}
+
+/* Round a size up to a whole number of cache lines. */
+static size_t speedyCacheLines(size_t size) {
+  return (size + kCacheLineSize-1)/kCacheLineSize*kCacheLineSize;
+}
+
+/* Set the frame, analysis and FFT sizes for a new stream. */
+static void speedySetStreamSizes(speedyStream stream, int sample_rate,
+                                 int analysis_rate) {
   stream->window_size = (int)(1.5*sample_rate/(float)kFrameRateHz);
-  stream->fft_size = 2*stream->window_size;
   stream->sample_rate = sample_rate;
+  if (analysis_rate <= 0) {
+    /* Original behavior: analyze at the input rate with 2x zero padding. */
+    stream->analysis_rate = sample_rate;
+    stream->analysis_window_size = stream->window_size;
+    stream->fft_size = 2*stream->window_size;
+  } else {
+    /* Never upsample, but always use a fast FFT length. */
+    stream->analysis_rate = analysis_rate < sample_rate ? analysis_rate :
+                                                          sample_rate;
+    stream->analysis_window_size =
+        (int)(1.5*stream->analysis_rate/(float)kFrameRateHz);
+    stream->fft_size = speedyFastFFTSize(2*stream->analysis_window_size);
+  }
+  /* The input is real, so only the non-negative frequencies are computed. */
+  stream->spectrogram_size = stream->fft_size/2 + 1;
+  int floats_per_line = kCacheLineSize/sizeof(float);
+  stream->spectrogram_stride = (stream->spectrogram_size + floats_per_line-1) /
+                               floats_per_line * floats_per_line;
+}
+
+/* Carve the stream's buffers out of its arena, each starting on a cache line
+ * (which is more than the alignment FFTW wants), and return the arena size.
+ * With a NULL arena, only compute the size.
+ */
+static size_t speedyLayoutArena(speedyStream stream, char* arena) {
+  size_t used = speedyCacheLines(sizeof(struct speedyStreamStruct));
+  size_t history_floats = (size_t)kSpectrogramBufferSize*
+                          stream->spectrogram_stride;
+#define TAKE(field, type, count) \
+  do { \
+    if (arena) stream->field = (type *)(arena + used); \
+    used += speedyCacheLines(sizeof(type)*(count)); \
+  } while (0)
+
+  stream->header_size = used;
+  TAKE(input, float, stream->window_size);
+  if (stream->analysis_rate < stream->sample_rate) {
+    TAKE(analysis_input, float, stream->analysis_window_size);
+  } else if (arena) {
+    stream->analysis_input = stream->input;
+  }
+  TAKE(hysteresis_buffer, float, kTemporalHysteresisBufferSize);
+  TAKE(fft_scratch, char, stream->fft->scratch_size(stream->fft_size));
+  TAKE(normalized_spectrogram, float, stream->spectrogram_size);
+  TAKE(normalized_last_spectrogram, float, stream->spectrogram_size);
+  TAKE(spectrogram_history, float, history_floats);
+  TAKE(normalized_history, float, history_floats);
+#undef TAKE
+  return used;
+}
+
+static void speedyResetTaperedMax(struct speedyTaperedMaxStruct* tm,
+                                  int direction, int span, int count) {
+  tm->direction = direction;
+  tm->span = span;
+  tm->count = count;
+  tm->query_time = kNoTime;
+  tm->next_time = 0;
+  tm->max = 0.0;
+  tm->head = 0;
+  tm->size = 0;
+}
+
+/* Empty the tapered maxima, and set their spans from the hysteresis spans. */
+static void speedyResetHysteresisMaxima(speedyStream stream) {
+  int future = stream->hysteresis_future;
+  int lookahead = stream->hysteresis_lookahead;
+  speedyResetTaperedMax(&stream->future_max, 1, future, lookahead);
+  speedyResetTaperedMax(&stream->past_max, -1, stream->hysteresis_past,
+                        stream->hysteresis_past);
+  speedyResetTaperedMax(&stream->known_full_max, 1, future, future);
+  speedyResetTaperedMax(&stream->known_seen_max, 1, future, lookahead);
+}
+
+/* Set all the analysis state to that of a new stream.  The buffers must
+ * already be zero.
+ */
+static void speedyInitializeState(speedyStream stream) {
+  int i;
   stream->current_time = 0;
   stream->preemph_state = 0.0;
   stream->hysteresis_index = 0;
-  stream->input = (float *) malloc(sizeof(float) * stream->window_size);
-  stream->hysteresis_buffer = (float *) malloc(sizeof(float) *
-                                               kTemporalHysteresisBufferSize);
-#ifdef  KISS_FFT
-  stream->fft_buffer = (kiss_fft_cpx *) malloc(sizeof(kiss_fft_cpx) *
-                                               stream->fft_size);
-  stream->input_buffer = (kiss_fft_cpx *) malloc(sizeof(kiss_fft_cpx) *
-                                                 stream->fft_size);
-#else
-  stream->fft_buffer = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) *
-                                                    stream->fft_size);
-  stream->input_buffer = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) *
-                                                      stream->fft_size);
-#endif  /* KISS_FFT */
-  stream->normalized_spectrogram = (float *) malloc(sizeof(float) *
-                                                    stream->fft_size);
-  stream->normalized_last_spectrogram = (float *) malloc(sizeof(float) *
-                                                         stream->fft_size);
-  stream->spectrogram = (float *) malloc(sizeof(float) * stream->fft_size);
-  stream->spectrogram_plan = 0;    /* Will allocate later. */
-  stream->window = (float *) malloc(sizeof(float)*stream->window_size);
-
-  int i, j;
+  stream->hysteresis_future = kTemporalHysteresisFuture;
+  stream->hysteresis_past = kTemporalHysteresisPast;
+  stream->hysteresis_lookahead = kTemporalHysteresisFuture;
+  DesignFirstOrderLowpassFilter(&stream->future_max_bias, kFrameRateHz);
+  speedyResetHysteresisMaxima(stream);
+  memset(&stream->stats, 0, sizeof(stream->stats));
+  stream->stats.bytes_allocated = stream->arena_size;
+  memset(stream->features, 0, sizeof(stream->features));
+  stream->spectrogram = stream->spectrogram_history;
+  stream->last_spectrogram = NULL;
+  stream->normalized_current = stream->normalized_spectrogram;
   for (i=0; i < kSpectrogramBufferSize; i++) {
-    stream->spectrogram_history[i] = (float *) malloc(sizeof(float)*
-                                                       stream->fft_size);
-    for (j=0; j < stream->fft_size; j++) {
-     stream->spectrogram_history[i][j] = 0.0;
-    }
-  }
-  if (!stream->input || !stream->input_buffer || !stream->spectrogram ||
-      !stream->hysteresis_buffer || !stream->fft_buffer ||
-      !stream->normalized_spectrogram || !stream->normalized_last_spectrogram) {
-    speedyDestroyStream(stream);
-    return NULL;
-  }
-  /* Design the Hamming window used when computing the spectrogram. */
-  for (i=0; i < stream->window_size; i++) {
-    stream->window[i] = 0.54 - 0.46*cos(2*M_PI*i / (stream->window_size-1.0));
+    stream->normalized_time[i] = kNoTime;
+    stream->normalized_energy[i] = 0.0;
+    stream->normalized_max[i] = 0.0;
   }
   /* The following constants were calculated from the Matlab implementation
    * by running the feature calculation over the BillForShortExerpt and
@@ -259,25 +681,7 @@ speedyStream speedyCreateStream(int sample_rate) {
   stream->mean_emphasis_weighted_lpf = 123.979;
   stream->mean_relative_spectral_difference = 0.971975;
   stream->max_energy_hysteresis = 1.41421;
-#ifdef  KISS_FFT
-  stream->spectrogram_plan = kiss_fft_alloc(stream->fft_size, 0, NULL, NULL);
-#else
-  /* Initialize the FFT software.  Use complex->complex because that is what is
-   * done internally by FFTW.
-   */
-  stream->spectrogram_plan = fftw_plan_dft_1d(stream->fft_size,
-                                              stream->input_buffer,
-                                              stream->fft_buffer,
-                                              FFTW_FORWARD, FFTW_ESTIMATE);
-#endif  /* KISS_FFT */
-  if (!stream->spectrogram_plan) {
-    speedyDestroyStream(stream);
-    return NULL;
-  }
 
-  for (i=0; i < kTemporalHysteresisBufferSize; i++){
-    stream->hysteresis_buffer[i] = 0.0;
-  }
   DesignFirstOrderLowpassFilter(&stream->energy_filter, kFrameRateHz);
   SetFirstOrderFilterState(&stream->energy_filter,
                            stream->mean_spectrogram_energy);
@@ -286,36 +690,160 @@ speedyStream speedyCreateStream(int sample_rate) {
                            stream->mean_emphasis_weighted_local_difference);
   speedyUpdateTensionNormalization(stream, 0.0);
   stream->skip_frame_count = 1;          /* Skip the first frame */
+}
+
+/* Create a speedy stream.  Return NULL only if we are out of memory and cannot
+   allocate the stream. Design the windows and filters, initialize the FFT
+   package, and allocate all the storage. */
+speedyStream speedyCreateStream(int sample_rate) {
+  return speedyCreateStreamWithAnalysisRate(sample_rate, 0);
+}
+
+speedyStream speedyCreateStreamWithAnalysisRate(int sample_rate,
+                                                int analysis_rate) {
+  return speedyCreateStreamWithFFT(sample_rate, analysis_rate,
+                                   kSpeedyFFTDefault);
+}
+
+speedyStream speedyCreateStreamWithFFT(int sample_rate, int analysis_rate,
+                                       int fft) {
+  struct speedyStreamStruct sizes;
+  memset(&sizes, 0, sizeof(sizes));
+  sizes.fft = speedyFindFFT(fft);
+  if (sizes.fft == NULL) {
+    return NULL;
+  }
+  speedySetStreamSizes(&sizes, sample_rate, analysis_rate);
+  sizes.arena_size = speedyLayoutArena(&sizes, NULL);
+
+  /* One allocation holds the stream and all of its buffers. */
+  char* arena = (char *) speedyAlignedMalloc(sizes.arena_size);
+  if (arena == NULL) {
+    return NULL;
+  }
+  memset(arena, 0, sizes.arena_size);
+  speedyStream stream = (speedyStream)arena;
+  *stream = sizes;
+  speedyLayoutArena(stream, arena);
+
+  stream->setup = speedyAcquireSetup(stream->sample_rate,
+                                     stream->analysis_rate, stream->fft_size,
+                                     stream->window_size,
+                                     stream->analysis_window_size,
+                                     stream->fft);
+  if (!stream->setup) {
+    speedyDestroyStream(stream);
+    return NULL;
+  }
+  stream->window = stream->setup->window;
+  stream->resample_weights = stream->setup->resample_weights;
+  stream->resample_start = stream->setup->resample_start;
+  stream->resample_taps = stream->setup->resample_taps;
+  speedyInitializeState(stream);
   return stream;
 }
 
-/* Destroy the speedy stream by first freeing all the allocated storage. */
+/* Destroy the speedy stream.  The shared setup (and, with the last stream,
+ * the FFT package) is only freed when no other stream uses it.
+ */
 void speedyDestroyStream(speedyStream stream) {
-  if (stream->input) free(stream->input);
-  if (stream->hysteresis_buffer) free(stream->hysteresis_buffer);
-#ifdef  KISS_FFT
-  if (stream->fft_buffer) free(stream->fft_buffer);
-  if (stream->input_buffer) free(stream->input_buffer);
-  if (stream->spectrogram_plan) free(stream->spectrogram_plan);
-  kiss_fft_cleanup();
-#else
-  if (stream->fft_buffer) fftw_free(stream->fft_buffer);
-  if (stream->input_buffer) fftw_free(stream->input_buffer);
-  if (stream->spectrogram_plan) fftw_destroy_plan(stream->spectrogram_plan);
-#endif  /* KISS_FFT */
-  if (stream->normalized_spectrogram) free(stream->normalized_spectrogram);
-  if (stream->normalized_last_spectrogram) {
-      free(stream->normalized_last_spectrogram);
-  }
-  if (stream->spectrogram) free(stream->spectrogram);
-  if (stream->window) free(stream->window);
-  int i;
-  for (i=0; i < kSpectrogramBufferSize; i++) {
-    if (stream->spectrogram_history[i]) {
-      free(stream->spectrogram_history[i]);
-    }
+  if (stream->setup) speedyReleaseSetup(stream->setup);
+  speedyAlignedFree(stream);
+}
+
+/* Put the stream back in the state it was created in, without reallocating
+ * anything, so it can be used for a new input.
+ */
+void speedyResetStream(speedyStream stream) {
+  assert(stream);
+  memset((char *)stream + stream->header_size, 0,
+         stream->arena_size - stream->header_size);
+  speedyInitializeState(stream);
+}
+
+/*****************************************************************************
+ * A speedyStreamPool keeps streams that are no longer needed, so a server
+ * can reuse them for new requests instead of going back to the allocator.
+ *****************************************************************************/
+struct speedyStreamPoolStruct {
+  int sample_rate;
+  int analysis_rate;
+  int max_idle;                           /* Keep at most this many */
+  int idle_count;
+  speedyStream idle;                      /* Linked through next_idle */
+  pthread_mutex_t mutex;
+};
+
+speedyStreamPool speedyCreateStreamPool(int sample_rate, int analysis_rate,
+                                        int max_idle) {
+  speedyStreamPool pool = (speedyStreamPool)calloc(
+      1, sizeof(struct speedyStreamPoolStruct));
+  if (pool == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&pool->mutex, NULL)) {
+    free(pool);
+    return NULL;
+  }
+  pool->sample_rate = sample_rate;
+  pool->analysis_rate = analysis_rate;
+  pool->max_idle = max_idle;
+  return pool;
+}
+
+/* Destroy the pool and its idle streams.  Streams that are still in use must
+ * be destroyed with speedyDestroyStream() instead of being released.
+ */
+void speedyDestroyStreamPool(speedyStreamPool pool) {
+  assert(pool);
+  while (pool->idle) {
+    speedyStream stream = pool->idle;
+    pool->idle = stream->next_idle;
+    speedyDestroyStream(stream);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+/* Return an idle stream if there is one, otherwise create one.  Either way
+ * the stream is in its newly created state.  Return NULL if out of memory.
+ */
+speedyStream speedyAcquireStream(speedyStreamPool pool) {
+  assert(pool);
+  pthread_mutex_lock(&pool->mutex);
+  speedyStream stream = pool->idle;
+  if (stream) {
+    pool->idle = stream->next_idle;
+    pool->idle_count--;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (!stream) {
+    return speedyCreateStreamWithAnalysisRate(pool->sample_rate,
+                                              pool->analysis_rate);
+  }
+  stream->next_idle = NULL;
+  return stream;
+}
+
+/* Give a stream (from speedyAcquireStream()) back to the pool.  It is reset
+ * here, so acquiring it again is quick.
+ */
+void speedyReleaseStream(speedyStreamPool pool, speedyStream stream) {
+  assert(pool);
+  assert(stream);
+  assert(stream->sample_rate == pool->sample_rate);
+  speedyResetStream(stream);
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->idle_count < pool->max_idle) {
+    stream->next_idle = pool->idle;
+    pool->idle = stream;
+    pool->idle_count++;
+    stream = NULL;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (stream) {
+    speedyDestroyStream(stream);
   }
-  free(stream);
 }
 
 int speedyInputFrameSize(speedyStream stream) {
@@ -333,14 +861,29 @@ int speedyFFTSize(speedyStream stream) {
   return stream->fft_size;
 }
 
+int speedySpectrogramSize(speedyStream stream) {
+  assert(stream);
+  return stream->spectrogram_size;
+}
+
+int speedyGetFFT(speedyStream stream) {
+  assert(stream);
+  return stream->fft->fft;
+}
+
+int speedyAnalysisRate(speedyStream stream) {
+  assert(stream);
+  return stream->analysis_rate;
+}
+
 float speedyBinToFreq(speedyStream stream, int bin_number) {
   assert(stream);
-  return bin_number * (stream->sample_rate/(float)stream->fft_size);
+  return bin_number * (stream->analysis_rate/(float)stream->fft_size);
 }
 
 int speedyFreqToBin(speedyStream stream, float freq) {
   assert(stream);
-  return round(freq*stream->fft_size/stream->sample_rate);
+  return round(freq*stream->fft_size/stream->analysis_rate);
 }
 
 float *speedyGetSpectrogram(speedyStream stream) {
@@ -350,7 +893,7 @@ float *speedyGetSpectrogram(speedyStream stream) {
 
 float *speedyGetNormalizedSpectrogram(speedyStream stream) {
   assert(stream);
-  return stream->normalized_spectrogram;
+  return stream->normalized_current;
 }
 
 /* Get a copy of the internal Speedy state so we can inspect and plot it.
@@ -388,7 +931,7 @@ float* speedyGetInternalSpectrogram(speedyStream stream) {
 
 float* speedyGetInternalNormalizedSpectrogram(speedyStream stream) {
   assert(stream);
-  return stream->normalized_spectrogram;
+  return stream->normalized_current;
 }
 
 /*****************************************************************************
@@ -419,61 +962,36 @@ void speedyPreemphasisFilter(speedyStream stream, float* input, int length) {
 /* Compute the spectrogram of an input signal (usually after preemphasis.)
  * This is done at AddData time.  It is used in the energy calculation at this
  * point, and also saved in a ring buffer for use when calculating the spectral
- * difference, at ComputeTension time.
+ * difference, at ComputeTension time.  The input is real, so only the
+ * spectrogram_size (fft_size/2+1) non-negative frequency bins are computed.
+ * The result is written to stream->spectrogram, which speedyAddData() points
+ * at the history slot for the new frame, so no copy is needed.
  */
-#ifdef  KISS_FFT
-float kiss_abs(kiss_fft_cpx c) {
-  return sqrt(c.r*c.r + c.i*c.i);
-}
-
 float* speedySpectrogram(speedyStream stream, float input[]) {
   assert(stream);
-  int i;
-  for (i=0; i < stream->window_size; i++) {
-    stream->input_buffer[i].r = input[i] * stream->window[i];
-    stream->input_buffer[i].i = 0.0;
-  }
-  for (i=stream->window_size; i < stream->fft_size; i++) {
-    stream->input_buffer[i].r = 0.0;
-    stream->input_buffer[i].i = 0.0;
-  }
-  kiss_fft(stream->spectrogram_plan, stream->input_buffer, stream->fft_buffer);
-  for (i=0; i < stream->fft_size; i++) {
-    stream->spectrogram[i] = kiss_abs(stream->fft_buffer[i]);
-  }
+  stream->fft->execute(stream->setup->fft_plan, input, stream->window,
+                       stream->analysis_window_size, stream->fft_size,
+                       stream->fft_scratch, stream->spectrogram);
   return stream->spectrogram;
 }
 
-#else
-
-float* speedySpectrogram(speedyStream stream, float input[]) {
-  assert(stream);
-  int i;
-  for (i=0; i < stream->window_size; i++) {
-    stream->input_buffer[i] = input[i] * stream->window[i];
-  }
-  for (i=stream->window_size; i < stream->fft_size; i++) {
-    stream->input_buffer[i] = 0.0;
-  }
-  fftw_execute(stream->spectrogram_plan); /* repeat as needed */
-  for (i=0; i < stream->fft_size; i++) {
-    stream->spectrogram[i] = cabs(stream->fft_buffer[i]);
-  }
-  return stream->spectrogram;
-}
-#endif  /* KISS_FFT */
-
+/* Save a spectrogram slice into the history ring buffer.  Nothing to do when
+ * it was computed in place (the usual case.)
+ */
 void speedySaveSpectrogramData(speedyStream stream, float spectrogram[],
                               int64_t at_time) {
-  int i;
-  for (i=0; i < stream->fft_size; i++) {
-    stream->spectrogram_history[modulo(at_time, kSpectrogramBufferSize)][i] =
-        spectrogram[i];
+  float* slot = speedyGetSpectrogramAtTime(stream, at_time);
+  if (spectrogram != slot) {
+    memcpy(slot, spectrogram, sizeof(float)*stream->spectrogram_size);
   }
+  /* This slot's normalized spectrogram (if any) is now stale. */
+  stream->normalized_time[modulo(at_time, kSpectrogramBufferSize)] = kNoTime;
 }
 
 float *speedyGetSpectrogramAtTime(speedyStream stream, int64_t at_time) {
-    return stream->spectrogram_history[modulo(at_time, kSpectrogramBufferSize)];
+    return stream->spectrogram_history +
+        (size_t)modulo(at_time, kSpectrogramBufferSize)*
+        stream->spectrogram_stride;
 }
 
 /* To estimate local emphasis, we first calculate the local energy. We
@@ -499,11 +1017,9 @@ float *speedyGetSpectrogramAtTime(speedyStream stream, int64_t at_time) {
 
 void speedyComputeLocalEnergy(speedyStream stream, float *spectrogram,
                               int64_t at_time) {
-  int i;
-  float my_spectrogram_energy = 0.0;
-  for (i=1; i < stream->fft_size/2; i++) {
-    my_spectrogram_energy += stream->spectrogram[i]*stream->spectrogram[i];
-  }
+  /* Skip the DC term */
+  float my_spectrogram_energy = speedyGetKernels()->energy(
+      stream->spectrogram + 1, stream->fft_size/2 - 1, NULL);
   s_energy_lp = IterateFirstOrderFilter(&stream->energy_filter,
                                       my_spectrogram_energy);
   s_energy_local = my_spectrogram_energy / s_energy_lp;
@@ -516,6 +1032,59 @@ float speedyGetEnergyCompressed(speedyStream stream) {
   return s_energy_compressed;
 }
 
+/* Whether every sample of the analysis window is zero (-0 included; NaN is
+ * not, so it still reaches the FFT.)  This is the only test that can skip the
+ * FFT for a frame and still give the same result: a frame that is just quiet
+ * may be marked low energy, but its spectrogram is still compared against by
+ * the next frame and fed to the local energy filter.
+ */
+static int speedyIsSilent(const float* input, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (input[i] != 0.0f) return 0;
+  }
+  return 1;
+}
+
+/* Analyze the frame that was just copied into stream->input.  When the stream
+ * has a lower analysis rate the frame is first resampled, so the preemphasis
+ * filter and the spectrogram always run at the analysis rate.  The spectrogram
+ * is written into slot.
+ */
+static float* speedyAnalyzeSpectrogram(speedyStream stream, float* slot) {
+  if (stream->resample_weights) {
+    SPEEDY_STATS_START(resample_start);
+    speedyResampleInput(stream, stream->input, stream->analysis_input);
+    SPEEDY_STATS_ADD(stream, resample_ns, resample_start);
+  }
+  SPEEDY_STATS_START(preemphasis_start);
+  speedyPreemphasisFilter(stream, stream->analysis_input,
+                          stream->analysis_window_size);
+  SPEEDY_STATS_ADD(stream, preemphasis_ns, preemphasis_start);
+  stream->spectrogram = slot;
+  if (speedyIsSilent(stream->analysis_input, stream->analysis_window_size)) {
+    /* Digital silence: the FFT of zeros is zeros, so skip it. */
+    memset(slot, 0, stream->spectrogram_size*sizeof(float));
+    stream->stats.silent_frames++;
+    return slot;
+  }
+  SPEEDY_STATS_START(fft_start);
+  float* spectrogram = speedySpectrogram(stream, stream->analysis_input);
+  SPEEDY_STATS_ADD(stream, fft_ns, fft_start);
+  return spectrogram;
+}
+
+static void speedyAnalyzeInput(speedyStream stream, int64_t at_time) {
+  float* spectrogram = speedyAnalyzeSpectrogram(
+      stream, speedyGetSpectrogramAtTime(stream, at_time));
+  speedySaveSpectrogramData(stream, spectrogram, at_time);
+  SPEEDY_STATS_START(energy_start);
+  speedyComputeLocalEnergy(stream, spectrogram, at_time);
+  SPEEDY_STATS_ADD(stream, local_energy_ns, energy_start);
+  stream->current_time = at_time;
+  stream->stats.frames_analyzed++;
+}
+
 /* speedyAddData() - Add data to our stream, and compute the current energy.
  * This is called to add some data to the speedy calculation and does the
  * following steps:
@@ -533,11 +1102,7 @@ void speedyAddData(speedyStream stream, const float input[], int64_t at_time) {
   for (i=0; i < stream->window_size; i++) {
     stream->input[i] = input[i];
   }
-  speedyPreemphasisFilter(stream, stream->input, stream->window_size);
-  float* spectrogram = speedySpectrogram(stream, stream->input);
-  speedySaveSpectrogramData(stream, spectrogram, at_time);
-  speedyComputeLocalEnergy(stream, spectrogram, at_time);
-  stream->current_time = at_time;
+  speedyAnalyzeInput(stream, at_time);
 }
 
 void speedyAddDataShort(speedyStream stream, const int16_t input[],
@@ -547,11 +1112,7 @@ void speedyAddDataShort(speedyStream stream, const int16_t input[],
   for (i=0; i < stream->window_size; i++) {
     stream->input[i] = input[i]/32768.0;
   }
-  speedyPreemphasisFilter(stream, stream->input, stream->window_size);
-  float* spectrogram = speedySpectrogram(stream, stream->input);
-  speedySaveSpectrogramData(stream, spectrogram, at_time);
-  speedyComputeLocalEnergy(stream, spectrogram, at_time);
-  stream->current_time = at_time;
+  speedyAnalyzeInput(stream, at_time);
 }
 
 /*****************************************************************************
@@ -575,30 +1136,176 @@ void speedyAddDataShort(speedyStream stream, const int16_t input[],
  * The same "function" name can then be used for reading and writing the array.
  */
 #define HysteresisBuffer(time) \
-  (stream->hysteresis_buffer[modulo((time), kTemporalHysteresisBufferSize)])
+  (stream->hysteresis_buffer[(time) & (kTemporalHysteresisBufferSize-1)])
+
+/* The value of the frame at time, tapered for a query at at_time. */
+static float speedyTaperedValue(const struct speedyTaperedMaxStruct* tm,
+                                int64_t time, float value, int64_t at_time) {
+  if (tm->span > 0) {
+    int i = (int)(tm->direction*(time - at_time));
+    value *= (tm->span-i)/(float)tm->span;
+  }
+  return value;
+}
 
-float speedyEvaluateHysteresis(speedyStream stream, int64_t at_time) {
-  assert(stream);
-  assert(at_time >= 0);
-  int i;
-  float past_max = 0.0, future_max = 0.0;
-  for (i=0; i <= kTemporalHysteresisFuture; i++) {
-    float value = HysteresisBuffer(at_time+i);
-    value *= (kTemporalHysteresisFuture-i)/(float)kTemporalHysteresisFuture;
-    if (value > future_max) {
-      future_max = value;
+/* The first query time at which the frame at b_time (after a_time) tapers to
+ * at least the frame at a_time, or the time a leaves the window if sooner.
+ * The difference of the two tapered values (times span) is the line
+ * slope*x + offset, where x is the query time less a_time.
+ */
+static int64_t speedyTakeoverTime(const struct speedyTaperedMaxStruct* tm,
+                                  int64_t a_time, float a_value,
+                                  int64_t b_time, float b_value) {
+  int64_t leave_time = a_time + 1 + (tm->direction > 0 ? 0 : tm->count);
+  /* Both frames are in the window from when the later one enters. */
+  int64_t first_time = b_time - (tm->direction > 0 ? tm->count : 0);
+  double span = tm->span;
+  double delta = b_time - a_time;
+  double slope, offset;
+  if (tm->direction > 0) {
+    slope = (double)b_value - a_value;
+    offset = b_value*(span - delta) - a_value*span;
+  } else {
+    slope = (double)a_value - b_value;
+    offset = b_value*(span + delta) - a_value*span;
+  }
+  double first_x = first_time - a_time;
+  double last_x = leave_time - a_time;
+  double x;
+  if (slope > 0) {
+    x = ceil(-offset/slope);
+    x = x < first_x ? first_x : x;
+  } else {
+    x = offset + slope*first_x >= 0 ? first_x : last_x;
+  }
+  return x < last_x ? a_time + (int64_t)x : leave_time;
+}
+
+/* Add the frame at time (the newest) to the candidates, first dropping those
+ * that the new frame takes over from before they would be the maximum.
+ */
+static void speedyPushTaperedMax(struct speedyTaperedMaxStruct* tm,
+                                 int64_t time, float value) {
+  const int mask = kTaperedMaxQueueSize - 1;
+  while (tm->size > 0) {
+    int last = (tm->head + tm->size - 1) & mask;
+    int64_t takeover = speedyTakeoverTime(tm, tm->times[last],
+                                          tm->values[last], time, value);
+    tm->takeover[last] = takeover;
+    if (tm->size < 2 ||
+        tm->takeover[(tm->head + tm->size - 2) & mask] < takeover) {
+      break;
     }
+    tm->size--;
   }
-  for (i=0; i <= kTemporalHysteresisPast; i++) {
-    float value = HysteresisBuffer(at_time-i);
-    value *= (kTemporalHysteresisPast-i)/(float)kTemporalHysteresisPast;
-    if (value > past_max) {
-      past_max = value;
+  assert(tm->size < kTaperedMaxQueueSize);
+  int slot = (tm->head + tm->size) & mask;
+  tm->times[slot] = time;
+  tm->values[slot] = value;
+  tm->takeover[slot] = INT64_MAX;
+  tm->size++;
+}
+
+/* The maximum of the frames at_time+direction*i, for i from 0 to count,
+ * tapered by a triangle that reaches 0 at i == span.  Queries are expected at
+ * the same or increasing times; going back in time starts over.
+ */
+static float speedyTaperedMax(speedyStream stream,
+                              struct speedyTaperedMaxStruct* tm,
+                              int64_t at_time) {
+  const int mask = kTaperedMaxQueueSize - 1;
+  if (at_time == tm->query_time) {
+    return tm->max;
+  }
+  int64_t first_time = at_time - (tm->direction > 0 ? 0 : tm->count);
+  int64_t last_time = at_time + (tm->direction > 0 ? tm->count : 0);
+  if (tm->query_time == kNoTime || at_time < tm->query_time) {
+    tm->size = 0;
+  }
+  if (tm->size == 0 || tm->next_time < first_time) {
+    tm->next_time = first_time;
+  }
+  while (tm->size > 0 && tm->times[tm->head] < first_time) {
+    tm->head = (tm->head + 1) & mask;
+    tm->size--;
+  }
+  for (; tm->next_time <= last_time; tm->next_time++) {
+    speedyPushTaperedMax(tm, tm->next_time, HysteresisBuffer(tm->next_time));
+  }
+  while (tm->size > 1 && tm->takeover[tm->head] <= at_time) {
+    tm->head = (tm->head + 1) & mask;
+    tm->size--;
+  }
+  /* Also check the next candidate, in case rounding puts it ahead. */
+  float max = 0.0;
+  int i;
+  for (i = 0; i < tm->size && i < 2; i++) {
+    int slot = (tm->head + i) & mask;
+    float value = speedyTaperedValue(tm, tm->times[slot], tm->values[slot],
+                                     at_time);
+    if (value > max) {
+      max = value;
     }
   }
+  tm->query_time = at_time;
+  tm->max = max;
+  return max;
+}
+
+float speedyEvaluateHysteresis(speedyStream stream, int64_t at_time) {
+  assert(stream);
+  assert(at_time >= 0);
+  int future = stream->hysteresis_future;
+  int lookahead = stream->hysteresis_lookahead;
+  float future_max = speedyTaperedMax(stream, &stream->future_max, at_time);
+  if (lookahead < future) {
+    future_max += stream->future_max_bias.state;
+  }
+  float past_max = speedyTaperedMax(stream, &stream->past_max, at_time);
   return (past_max + future_max)/2.0;
 }
 
+/* With a short lookahead, the future maximum only covers the frames up to
+ * the lookahead.  Those after it can only raise it, so estimate how much they
+ * add by averaging what they added to the most recent frame whose whole
+ * future span has been seen (future-lookahead frames ago.)  Call once per
+ * tension, before evaluating the hysteresis at at_time.
+ */
+static void speedyUpdateFutureMaxBias(speedyStream stream, int64_t at_time) {
+  int future = stream->hysteresis_future;
+  int lookahead = stream->hysteresis_lookahead;
+  int64_t known_time = at_time - (future - lookahead);
+  if (lookahead >= future || known_time < 0) {
+    return;
+  }
+  float full_max = speedyTaperedMax(stream, &stream->known_full_max,
+                                    known_time);
+  float seen_max = speedyTaperedMax(stream, &stream->known_seen_max,
+                                    known_time);
+  IterateFirstOrderFilter(&stream->future_max_bias, full_max - seen_max);
+}
+
+int speedySetHysteresis(speedyStream stream, int future_frames,
+                        int past_frames, int lookahead_frames) {
+  assert(stream);
+  if (future_frames < 0 || future_frames > kTemporalHysteresisFuture ||
+      past_frames < 0 || past_frames > kTemporalHysteresisPast ||
+      lookahead_frames < 0 || lookahead_frames > future_frames) {
+    return 0;
+  }
+  stream->hysteresis_future = future_frames;
+  stream->hysteresis_past = past_frames;
+  stream->hysteresis_lookahead = lookahead_frames;
+  ResetFirstOrderFilter(&stream->future_max_bias);
+  speedyResetHysteresisMaxima(stream);
+  return 1;
+}
+
+int speedyHysteresisLookahead(speedyStream stream) {
+  assert(stream);
+  return stream->hysteresis_lookahead;
+}
+
 /* Store the compressed energy (computed at AddData time) to the hysteresis
  * ring buffer
  */
@@ -606,6 +1313,18 @@ void speedyAddToHysteresisBuffer(speedyStream stream, float value,
                                  int64_t at_time) {
   assert(stream);
   HysteresisBuffer(at_time) = value;
+  /* The maxima keep copies of the frames they have seen, so they start over
+   * if one of those is replaced.
+   */
+  struct speedyTaperedMaxStruct* maxima[] = {
+    &stream->future_max, &stream->past_max,
+    &stream->known_full_max, &stream->known_seen_max};
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (at_time < maxima[i]->next_time) {
+      maxima[i]->query_time = kNoTime;
+    }
+  }
 }
 
 
@@ -615,27 +1334,50 @@ void speedyAddToHysteresisBuffer(speedyStream stream, float value,
  * The resulting normalized spectrogram slice is put into the normalized array.
  * BUG FIX: remove the 100x threshold check, since we do it later.
  */
-float speedyNormalizeByEnergy(const float *spectrogram, float *normalized,
-                               int length) {
+static float speedyNormalizeByEnergyAndMax(const float *spectrogram,
+                                           float *normalized, int length,
+                                           float *max) {
   assert(spectrogram);
   assert(normalized);
-  int i;
-  float signal_energy = 0.0;           /* Overall frame energy */
-  float max_value = 0;                 /* Maximum of this frame. */
-  for (i=1; i < length; i++) {           /* Skip the DC term */
-    signal_energy += spectrogram[i] * spectrogram[i];
-    if (spectrogram[i] > max_value) {
-      max_value = spectrogram[i];
-    }
-  }
+  const speedyKernels* kernels = speedyGetKernels();
+  float max_value;                     /* Maximum of this frame. */
+  /* Overall frame energy, skipping the DC term */
+  float signal_energy = kernels->energy(spectrogram + 1, length - 1,
+                                        &max_value);
   const float eps = 2.2204e-16;        /* Smallest increment around 1.0 */
   float inverse_norm = 1.0/(sqrt(signal_energy)+eps);
-  for (i=0; i < length; i++) {
-    normalized[i] = spectrogram[i]*inverse_norm;
+  kernels->scale(spectrogram, normalized, length, inverse_norm);
+  if (max) {
+    *max = max_value;
   }
   return signal_energy;
 }
 
+float speedyNormalizeByEnergy(const float *spectrogram, float *normalized,
+                               int length) {
+  return speedyNormalizeByEnergyAndMax(spectrogram, normalized, length, NULL);
+}
+
+/* Return the normalized version of the history slot for at_time, computing it
+ * only if this slot hasn't been normalized since its spectrogram was saved.
+ * Also return the slot's energy and (non-DC) maximum.
+ */
+static float* speedyGetNormalizedAtTime(speedyStream stream, int64_t at_time,
+                                        float* energy, float* max) {
+  int slot = modulo(at_time, kSpectrogramBufferSize);
+  float* normalized = stream->normalized_history +
+                      (size_t)slot*stream->spectrogram_stride;
+  if (stream->normalized_time[slot] != at_time) {
+    stream->normalized_energy[slot] = speedyNormalizeByEnergyAndMax(
+        speedyGetSpectrogramAtTime(stream, at_time), normalized,
+        stream->fft_size/2, &stream->normalized_max[slot]);
+    stream->normalized_time[slot] = at_time;
+  }
+  *energy = stream->normalized_energy[slot];
+  *max = stream->normalized_max[slot];
+  return normalized;
+}
+
 /*
  * This functions computes:
  *  s_energy_hysteresis: Energy estimate taking into account the hysteresis
@@ -658,14 +1400,26 @@ void speedyComputeSpectralDifference(speedyStream stream,
   assert(stream);
   assert(spectrogram);
   assert(last_spectrogram);
-  int i;
+  const float *normalized_spectrogram, *normalized_last_spectrogram;
+  float spectrogram_max, unused;
+  int in_history;
   s_energy_hysteresis = speedyEvaluateHysteresis(stream, at_time);
-  s_spectrogram_energy = speedyNormalizeByEnergy(spectrogram,
-                                                 stream->normalized_spectrogram,
-                                                 stream->fft_size/2);
-  speedyNormalizeByEnergy(last_spectrogram,
-                          stream->normalized_last_spectrogram,
-                          stream->fft_size/2);
+  if (spectrogram == speedyGetSpectrogramAtTime(stream, at_time) &&
+      last_spectrogram == speedyGetSpectrogramAtTime(stream, at_time-1)) {
+    /* The usual case: both slices are in the history, and the previous one
+     * was already normalized when it was the current frame.
+     */
+    in_history = 1;
+    stream->normalized_current = speedyGetNormalizedAtTime(
+        stream, at_time, &s_spectrogram_energy, &spectrogram_max);
+  } else {
+    in_history = 0;
+    s_spectrogram_energy = speedyNormalizeByEnergyAndMax(
+        spectrogram, stream->normalized_spectrogram, stream->fft_size/2,
+        &spectrogram_max);
+    stream->normalized_current = stream->normalized_spectrogram;
+  }
+  normalized_spectrogram = stream->normalized_current;
   /* Bug: This probably should be based on energy_local, not hysteresis.  Bug
    * in the Matlab code too.
    */
@@ -679,6 +1433,7 @@ void speedyComputeSpectralDifference(speedyStream stream,
     stream->skip_frame_count = 1;
   }
   if (stream->skip_frame_count-- > 0) {
+    stream->stats.skipped_frames++;
     s_low_energy_frame = 1;
     s_local_spectral_difference = 0;
     s_emphasis_weighted_local_difference = 0;
@@ -692,21 +1447,26 @@ void speedyComputeSpectralDifference(speedyStream stream,
     stream->skip_frame_count = 0;
   }
 
-  float bin_threshold = 0;
-  for (i=1; i < stream->fft_size/2; i++) {
-    bin_threshold = fmax(bin_threshold, spectrogram[i]);
+  /* The previous slice is only needed for the difference, so skipped frames
+   * don't normalize it.
+   */
+  if (in_history) {
+    normalized_last_spectrogram = speedyGetNormalizedAtTime(
+        stream, at_time-1, &unused, &unused);
+  } else {
+    speedyNormalizeByEnergy(last_spectrogram,
+                            stream->normalized_last_spectrogram,
+                            stream->fft_size/2);
+    normalized_last_spectrogram = stream->normalized_last_spectrogram;
   }
+
+  /* Same as the max over bins 1 to fft_size/2-1, found while normalizing. */
+  float bin_threshold = spectrogram_max;
   bin_threshold /= 100.0;                         /* 40dB below the peak. */
 
-  s_local_spectral_difference = 0.0;
-  const float eps = 2.2204e-16;        /* Smallest increment around 1.0 */
-  for (i=1; i < stream->fft_size/2; i++) {
-    if (spectrogram[i] > bin_threshold && last_spectrogram[i] > bin_threshold) {
-      s_local_spectral_difference +=
-          fabs(log((stream->normalized_spectrogram[i] + eps) /
-                   (stream->normalized_last_spectrogram[i] + eps)));
-    }
-  }
+  s_local_spectral_difference = speedyGetKernels()->log_difference(
+      spectrogram + 1, last_spectrogram + 1, normalized_spectrogram + 1,
+      normalized_last_spectrogram + 1, stream->fft_size/2 - 1, bin_threshold);
   s_emphasis_weighted_local_difference = s_local_spectral_difference *
                                          s_energy_hysteresis;
   s_emphasis_weighted_lpf =
@@ -733,6 +1493,17 @@ int64_t speedyGetCurrentTime(speedyStream stream) {
   return stream->current_time;
 }
 
+int speedyGetStats(speedyStream stream, speedyStats* stats) {
+  assert(stream);
+  assert(stats);
+  *stats = stream->stats;
+#ifdef  SPEEDY_STATS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 
 /* We don't want the normal value of E here, as we want to reuse this variable
  * name. (So we can match the Mach1 paper's signal names.)
@@ -742,12 +1513,18 @@ int64_t speedyGetCurrentTime(speedyStream stream) {
 int speedyComputeTension(speedyStream stream, int64_t at_time, float* tension) {
   assert(tension);
   float a = 1/2.0, b=1/4.0, M_E = 0.7, M_S = 1.0;
-  if (at_time + kTemporalHysteresisFuture <= stream->current_time) {
+  if (at_time + stream->hysteresis_lookahead <= stream->current_time) {
     float *current_spectrogram = speedyGetSpectrogramAtTime(stream, at_time);
     float *previous_spectrogram = speedyGetSpectrogramAtTime(stream, at_time-1);
+    SPEEDY_STATS_START(hysteresis_start);
+    speedyUpdateFutureMaxBias(stream, at_time);
     s_energy_hysteresis = speedyEvaluateHysteresis(stream, at_time);
+    SPEEDY_STATS_ADD(stream, hysteresis_ns, hysteresis_start);
+    SPEEDY_STATS_START(difference_start);
     speedyComputeSpectralDifference(stream, current_spectrogram,
                                     previous_spectrogram, at_time);
+    SPEEDY_STATS_ADD(stream, spectral_difference_ns, difference_start);
+    stream->stats.tensions_computed++;
     s_audio_tension = a*(s_energy_hysteresis-M_E) + b*(s_speech_changes-M_S);
     s_audio_tension -= IterateFirstOrderFilter(&stream->tension_filter,
                                                s_audio_tension);
@@ -775,3 +1552,452 @@ float speedyComputeSpeedFromTension(float tension, float R_g) {
     return fmin(1, R_g - (1-R_g)*tension);
   }
 }
+
+/*****************************************************************************
+ * Batch analysis.  A speedyBatch computes the same features as stream_count
+ * separate speedy streams, but takes one frame from every stream per call.
+ * All the streams share one FFT plan, window and resampler (those of a
+ * prototype stream), and the per-stream state is kept as rows with one entry
+ * per stream, so the filters, hysteresis and feature equations are loops
+ * across streams that the compiler can vectorize.  Only the per-bin work
+ * (FFT, normalization and spectral difference) is done one stream at a time.
+ *****************************************************************************/
+struct speedyBatchStruct {
+  int stream_count;
+  /* Supplies the analysis parameters, the shared window, resampler and FFT
+   * plan, and the scratch buffers used while transforming each frame.
+   */
+  speedyStream prototype;
+  /* Stream s uses history slots s*kSpectrogramBufferSize and up, each
+   * prototype->spectrogram_stride floats long.
+   */
+  float* spectrogram_history;
+  float* normalized_history;
+  int64_t* normalized_time;
+  float* normalized_energy;
+  float* normalized_max;
+  /* One entry per stream. */
+  int64_t* current_time;
+  float* preemph_state;
+  float* energy_state;                    /* prototype->energy_filter */
+  float* difference_state;                /* prototype->difference_filter */
+  float* tension_state;
+  float* tension_alpha;
+  int* skip_frame_count;
+  /* kTemporalHysteresisBufferSize rows of stream_count values. */
+  float* hysteresis;
+  /* kFeatureValueCount rows of stream_count values, see the s_* symbols. */
+  float* features;
+  /* Scratch, one entry per stream. */
+  float* frame_energy;
+  float* past_max;
+  int* slot;
+  int* active;
+};
+
+#define BatchFeature(index) \
+  (batch->features + (size_t)(index)*batch->stream_count)
+
+static float* speedyBatchSpectrogramAtTime(speedyBatch batch, int stream_index,
+                                           int64_t at_time) {
+  return batch->spectrogram_history +
+      ((size_t)stream_index*kSpectrogramBufferSize +
+       modulo(at_time, kSpectrogramBufferSize))*
+      batch->prototype->spectrogram_stride;
+}
+
+/* Same as speedyGetNormalizedAtTime(), for one stream of the batch. */
+static float* speedyBatchNormalizedAtTime(speedyBatch batch, int stream_index,
+                                          int64_t at_time, float* energy,
+                                          float* max) {
+  size_t index = (size_t)stream_index*kSpectrogramBufferSize +
+                 modulo(at_time, kSpectrogramBufferSize);
+  float* normalized = batch->normalized_history +
+                      index*batch->prototype->spectrogram_stride;
+  if (batch->normalized_time[index] != at_time) {
+    batch->normalized_energy[index] = speedyNormalizeByEnergyAndMax(
+        speedyBatchSpectrogramAtTime(batch, stream_index, at_time),
+        normalized, batch->prototype->fft_size/2,
+        &batch->normalized_max[index]);
+    batch->normalized_time[index] = at_time;
+  }
+  *energy = batch->normalized_energy[index];
+  *max = batch->normalized_max[index];
+  return normalized;
+}
+
+speedyBatch speedyBatchCreate(int stream_count, int sample_rate) {
+  return speedyBatchCreateWithAnalysisRate(stream_count, sample_rate, 0);
+}
+
+speedyBatch speedyBatchCreateWithAnalysisRate(int stream_count,
+                                              int sample_rate,
+                                              int analysis_rate) {
+  if (stream_count <= 0) {
+    return NULL;
+  }
+  speedyBatch batch = (speedyBatch)calloc(1, sizeof(struct speedyBatchStruct));
+  if (batch == NULL) {
+    return NULL;
+  }
+  size_t n = stream_count;
+  batch->stream_count = stream_count;
+  batch->prototype = speedyCreateStreamWithAnalysisRate(sample_rate,
+                                                        analysis_rate);
+  if (!batch->prototype) {
+    speedyBatchDestroy(batch);
+    return NULL;
+  }
+  size_t history_bytes = sizeof(float)*n*kSpectrogramBufferSize*
+                         batch->prototype->spectrogram_stride;
+  batch->spectrogram_history = (float *) speedyAlignedMalloc(history_bytes);
+  batch->normalized_history = (float *) speedyAlignedMalloc(history_bytes);
+  batch->normalized_time = (int64_t *) malloc(sizeof(int64_t)*n*
+                                              kSpectrogramBufferSize);
+  batch->normalized_energy = (float *) calloc(n*kSpectrogramBufferSize,
+                                              sizeof(float));
+  batch->normalized_max = (float *) calloc(n*kSpectrogramBufferSize,
+                                           sizeof(float));
+  batch->current_time = (int64_t *) calloc(n, sizeof(int64_t));
+  batch->preemph_state = (float *) calloc(n, sizeof(float));
+  batch->energy_state = (float *) calloc(n, sizeof(float));
+  batch->difference_state = (float *) calloc(n, sizeof(float));
+  batch->tension_state = (float *) calloc(n, sizeof(float));
+  batch->tension_alpha = (float *) calloc(n, sizeof(float));
+  batch->skip_frame_count = (int *) calloc(n, sizeof(int));
+  batch->hysteresis = (float *) calloc(n*kTemporalHysteresisBufferSize,
+                                       sizeof(float));
+  batch->features = (float *) calloc(n*kFeatureValueCount, sizeof(float));
+  batch->frame_energy = (float *) calloc(n, sizeof(float));
+  batch->past_max = (float *) calloc(n, sizeof(float));
+  batch->slot = (int *) calloc(n, sizeof(int));
+  batch->active = (int *) calloc(n, sizeof(int));
+  if (!batch->spectrogram_history || !batch->normalized_history ||
+      !batch->normalized_time || !batch->normalized_energy ||
+      !batch->normalized_max || !batch->current_time ||
+      !batch->preemph_state || !batch->energy_state ||
+      !batch->difference_state || !batch->tension_state ||
+      !batch->tension_alpha || !batch->skip_frame_count ||
+      !batch->hysteresis || !batch->features || !batch->frame_energy ||
+      !batch->past_max || !batch->slot || !batch->active) {
+    speedyBatchDestroy(batch);
+    return NULL;
+  }
+  int i;
+  for (i=0; i < stream_count; i++) {
+    speedyBatchUpdateTensionNormalization(batch, i, 0.0);
+    speedyBatchResetStream(batch, i);
+  }
+  return batch;
+}
+
+void speedyBatchDestroy(speedyBatch batch) {
+  if (batch->prototype) speedyDestroyStream(batch->prototype);
+  speedyAlignedFree(batch->spectrogram_history);
+  speedyAlignedFree(batch->normalized_history);
+  free(batch->normalized_time);
+  free(batch->normalized_energy);
+  free(batch->normalized_max);
+  free(batch->current_time);
+  free(batch->preemph_state);
+  free(batch->energy_state);
+  free(batch->difference_state);
+  free(batch->tension_state);
+  free(batch->tension_alpha);
+  free(batch->skip_frame_count);
+  free(batch->hysteresis);
+  free(batch->features);
+  free(batch->frame_energy);
+  free(batch->past_max);
+  free(batch->slot);
+  free(batch->active);
+  free(batch);
+}
+
+/* Put one stream back in the state of a newly created stream (keeping its
+ * tension normalization time), so a new source can start at time 0.
+ */
+void speedyBatchResetStream(speedyBatch batch, int stream_index) {
+  assert(batch);
+  assert(stream_index >= 0 && stream_index < batch->stream_count);
+  speedyStream prototype = batch->prototype;
+  int n = batch->stream_count, i;
+  size_t first_slot = (size_t)stream_index*kSpectrogramBufferSize;
+  size_t history_floats = (size_t)kSpectrogramBufferSize*
+                          prototype->spectrogram_stride;
+
+  memset(batch->spectrogram_history + first_slot*prototype->spectrogram_stride,
+         0, sizeof(float)*history_floats);
+  memset(batch->normalized_history + first_slot*prototype->spectrogram_stride,
+         0, sizeof(float)*history_floats);
+  for (i=0; i < kSpectrogramBufferSize; i++) {
+    batch->normalized_time[first_slot + i] = kNoTime;
+  }
+  for (i=0; i < kTemporalHysteresisBufferSize; i++) {
+    batch->hysteresis[(size_t)i*n + stream_index] = 0.0;
+  }
+  for (i=0; i < kFeatureValueCount; i++) {
+    batch->features[(size_t)i*n + stream_index] = 0.0;
+  }
+  batch->current_time[stream_index] = 0;
+  batch->preemph_state[stream_index] = 0.0;
+  batch->energy_state[stream_index] = prototype->mean_spectrogram_energy;
+  batch->difference_state[stream_index] =
+      prototype->mean_emphasis_weighted_local_difference;
+  batch->tension_state[stream_index] = 0.0;
+  batch->skip_frame_count[stream_index] = 1;   /* Skip the first frame */
+}
+
+int speedyBatchStreamCount(speedyBatch batch) {
+  assert(batch);
+  return batch->stream_count;
+}
+
+int speedyBatchInputFrameSize(speedyBatch batch) {
+  assert(batch);
+  return speedyInputFrameSize(batch->prototype);
+}
+
+int speedyBatchInputFrameStep(speedyBatch batch) {
+  assert(batch);
+  return speedyInputFrameStep(batch->prototype);
+}
+
+int64_t speedyBatchGetCurrentTime(speedyBatch batch, int stream_index) {
+  assert(batch);
+  assert(stream_index >= 0 && stream_index < batch->stream_count);
+  return batch->current_time[stream_index];
+}
+
+void speedyBatchUpdateTensionNormalization(speedyBatch batch, int stream_index,
+                                           float normalizationTime) {
+  assert(batch);
+  assert(stream_index >= 0 && stream_index < batch->stream_count);
+  struct FirstOrderFilterStruct filter;
+  if (normalizationTime < .01) {  /* less than 10ms */
+    normalizationTime = 1e10;   /* Forever */
+  }
+  DesignFirstOrderLowpassFilter(&filter, normalizationTime*kFrameRateHz);
+  batch->tension_alpha[stream_index] = filter.alpha;
+  batch->tension_state[stream_index] = 0.0;
+}
+
+void speedyBatchGetInternalState(speedyBatch batch, int stream_index,
+                                 float features[kFeatureValueCount]) {
+  assert(batch);
+  assert(stream_index >= 0 && stream_index < batch->stream_count);
+  int i;
+  for (i=0; i < kFeatureValueCount; i++) {
+    features[i] = batch->features[(size_t)i*batch->stream_count + stream_index];
+  }
+}
+
+/* The batch version of speedyAddData() and speedyComputeLocalEnergy(). */
+void speedyBatchAddData(speedyBatch batch, const float* frames[],
+                        const int64_t times[]) {
+  assert(batch);
+  assert(frames);
+  assert(times);
+  speedyStream prototype = batch->prototype;
+  const speedyKernels* kernels = speedyGetKernels();
+  int n = batch->stream_count, s;
+  int* active = batch->active;
+  float* frame_energy = batch->frame_energy;
+
+  for (s=0; s < n; s++) {
+    active[s] = frames[s] != NULL;
+    frame_energy[s] = 0.0;
+    if (!active[s]) {
+      continue;
+    }
+    memcpy(prototype->input, frames[s], sizeof(float)*prototype->window_size);
+    prototype->preemph_state = batch->preemph_state[s];
+    float* spectrogram = speedyAnalyzeSpectrogram(
+        prototype, speedyBatchSpectrogramAtTime(batch, s, times[s]));
+    batch->preemph_state[s] = prototype->preemph_state;
+    batch->normalized_time[(size_t)s*kSpectrogramBufferSize +
+                           modulo(times[s], kSpectrogramBufferSize)] = kNoTime;
+    frame_energy[s] = kernels->energy(spectrogram + 1,
+                                      prototype->fft_size/2 - 1, NULL);
+  }
+
+  const float alpha = prototype->energy_filter.alpha;
+  float* energy_state = batch->energy_state;
+  float* energy_lp = BatchFeature(kFeatureEnergyLp);
+  float* energy_local = BatchFeature(kFeatureEnergyLocal);
+  float* energy_compressed = BatchFeature(kFeatureEnergyCompressed);
+  for (s=0; s < n; s++) {
+    float lp = (1-alpha)*frame_energy[s] + alpha*energy_state[s];
+    float local = frame_energy[s] / lp;
+    float compressed = sqrtf(local>2 ? 2.0f : local);
+    energy_state[s] = active[s] ? lp : energy_state[s];
+    energy_lp[s] = active[s] ? lp : energy_lp[s];
+    energy_local[s] = active[s] ? local : energy_local[s];
+    energy_compressed[s] = active[s] ? compressed : energy_compressed[s];
+  }
+
+  float* time_energy = BatchFeature(kFeatureTimeEnergy);
+  for (s=0; s < n; s++) {
+    if (active[s]) {
+      batch->hysteresis[(size_t)modulo(times[s],
+                                       kTemporalHysteresisBufferSize)*n + s] =
+          energy_compressed[s];
+      time_energy[s] = times[s];
+      batch->current_time[s] = times[s];
+    }
+  }
+}
+
+/* The batch version of speedyEvaluateHysteresis(), for every stream. */
+static void speedyBatchEvaluateHysteresis(speedyBatch batch,
+                                          const int64_t times[],
+                                          float* energy_hysteresis) {
+  int n = batch->stream_count, s, i;
+  int* slot = batch->slot;
+  float* future_max = energy_hysteresis;
+  float* past_max = batch->past_max;
+  const float* hysteresis = batch->hysteresis;
+
+  for (s=0; s < n; s++) {
+    slot[s] = modulo(times[s], kTemporalHysteresisBufferSize);
+    future_max[s] = 0.0;
+    past_max[s] = 0.0;
+  }
+  for (i=0; i <= kTemporalHysteresisFuture; i++) {
+    float weight = (kTemporalHysteresisFuture-i)/
+                   (float)kTemporalHysteresisFuture;
+    for (s=0; s < n; s++) {
+      int index = slot[s] + i;
+      index -= index >= kTemporalHysteresisBufferSize ?
+               kTemporalHysteresisBufferSize : 0;
+      float value = hysteresis[(size_t)index*n + s] * weight;
+      future_max[s] = value > future_max[s] ? value : future_max[s];
+    }
+  }
+  for (i=0; i <= kTemporalHysteresisPast; i++) {
+    float weight = (kTemporalHysteresisPast-i)/(float)kTemporalHysteresisPast;
+    for (s=0; s < n; s++) {
+      int index = slot[s] - i;
+      index += index < 0 ? kTemporalHysteresisBufferSize : 0;
+      float value = hysteresis[(size_t)index*n + s] * weight;
+      past_max[s] = value > past_max[s] ? value : past_max[s];
+    }
+  }
+  for (s=0; s < n; s++) {
+    energy_hysteresis[s] = (past_max[s] + future_max[s])/2.0;
+  }
+}
+
+/* The batch version of speedyComputeTension() (with
+ * speedyComputeSpectralDifference()).  Compute the tension of stream s at
+ * times[s] (use a negative time to skip a stream.)  ready[s] is set to 1 and
+ * tensions[s] to the tension if there was enough data, otherwise ready[s] is
+ * set to 0 and tensions[s] is not changed.  Return the number of streams that
+ * are ready.
+ */
+int speedyBatchComputeTension(speedyBatch batch, const int64_t times[],
+                              float tensions[], int ready[]) {
+  assert(batch);
+  assert(times);
+  assert(tensions);
+  assert(ready);
+  speedyStream prototype = batch->prototype;
+  const speedyKernels* kernels = speedyGetKernels();
+  float a = 1/2.0, b=1/4.0, M_E = 0.7, M_S = 1.0;
+  int n = batch->stream_count, s, ready_count = 0;
+  float* energy_hysteresis = batch->frame_energy;
+  int* skipping = batch->active;
+
+  for (s=0; s < n; s++) {
+    ready[s] = times[s] >= 0 &&
+               times[s] + kTemporalHysteresisFuture <= batch->current_time[s];
+    ready_count += ready[s];
+  }
+  if (ready_count == 0) {
+    return 0;
+  }
+  speedyBatchEvaluateHysteresis(batch, times, energy_hysteresis);
+
+  /* The per-bin work, one stream at a time. */
+  float* spectrogram_energy = BatchFeature(kFeatureSpectrogramEnergy);
+  float* low_energy_threshold = BatchFeature(kFeatureLowEnergyThreshold);
+  float* low_energy_frame = BatchFeature(kFeatureLowEnergyFrame);
+  float* local_spectral_difference =
+      BatchFeature(kFeatureLocalSpectralDifference);
+  float* time_spectral = BatchFeature(kFeatureTimeSpectral);
+  float threshold = 0.04*prototype->max_energy_hysteresis;
+  for (s=0; s < n; s++) {
+    skipping[s] = 0;
+    if (!ready[s]) {
+      continue;
+    }
+    float spectrogram_max, energy, unused;
+    const float* normalized = speedyBatchNormalizedAtTime(
+        batch, s, times[s], &energy, &spectrogram_max);
+    const float* normalized_last = speedyBatchNormalizedAtTime(
+        batch, s, times[s]-1, &unused, &unused);
+    int low_energy = energy <= threshold;
+    int skip_frame_count = low_energy ? 1 : batch->skip_frame_count[s];
+    skipping[s] = skip_frame_count > 0;
+    batch->skip_frame_count[s] = skipping[s] ? skip_frame_count - 1 : 0;
+    spectrogram_energy[s] = energy;
+    low_energy_threshold[s] = threshold;
+    low_energy_frame[s] = skipping[s] ? 1 : low_energy;
+    time_spectral[s] = times[s];
+    if (skipping[s]) {
+      local_spectral_difference[s] = 0;
+      continue;
+    }
+    float bin_threshold = spectrogram_max;
+    bin_threshold /= 100.0;                         /* 40dB below the peak. */
+    local_spectral_difference[s] = kernels->log_difference(
+        speedyBatchSpectrogramAtTime(batch, s, times[s]) + 1,
+        speedyBatchSpectrogramAtTime(batch, s, times[s]-1) + 1,
+        normalized + 1, normalized_last + 1, prototype->fft_size/2 - 1,
+        bin_threshold);
+  }
+
+  /* The rest of the feature equations, across streams. */
+  const float difference_alpha = prototype->difference_filter.alpha;
+  const float mean_lpf = prototype->mean_emphasis_weighted_lpf;
+  const float max_speech_changes =
+      4*prototype->mean_relative_spectral_difference;
+  float* difference_state = batch->difference_state;
+  float* tension_state = batch->tension_state;
+  float* tension_alpha = batch->tension_alpha;
+  float* hysteresis_feature = BatchFeature(kFeatureEnergyHysteresis);
+  float* weighted_difference = BatchFeature(kFeatureEmphasisWeightedDifference);
+  float* weighted_lpf = BatchFeature(kFeatureEmphasisWeightedLpf);
+  float* relative_difference = BatchFeature(kFeatureRelativeSpectralDifference);
+  float* speech_changes = BatchFeature(kFeatureSpeechChanges);
+  float* audio_tension = BatchFeature(kFeatureAudioTension);
+  for (s=0; s < n; s++) {
+    float weighted = skipping[s] ? 0.0f :
+        local_spectral_difference[s] * energy_hysteresis[s];
+    float lpf = (1-difference_alpha)*weighted +
+                difference_alpha*difference_state[s];
+    float relative = weighted / (lpf + 0.01*mean_lpf);
+    relative = skipping[s] ? 0.0f : relative;
+    float changes = relative < max_speech_changes ? relative :
+                                                    max_speech_changes;
+    float tension = a*(energy_hysteresis[s]-M_E) + b*(changes-M_S);
+    float tension_lpf = (1-tension_alpha[s])*tension +
+                        tension_alpha[s]*tension_state[s];
+    tension -= tension_lpf;
+    hysteresis_feature[s] = ready[s] ? energy_hysteresis[s] :
+                                       hysteresis_feature[s];
+    weighted_difference[s] = ready[s] ? weighted : weighted_difference[s];
+    weighted_lpf[s] = ready[s] ? lpf : weighted_lpf[s];
+    difference_state[s] = ready[s] ? lpf : difference_state[s];
+    relative_difference[s] = ready[s] ? relative : relative_difference[s];
+    speech_changes[s] = ready[s] ? changes : speech_changes[s];
+    audio_tension[s] = ready[s] ? tension : audio_tension[s];
+    tension_state[s] = ready[s] ? tension_lpf : tension_state[s];
+  }
+  for (s=0; s < n; s++) {
+    if (ready[s]) {
+      tensions[s] = audio_tension[s];
+    }
+  }
+  return ready_count;
+}
@@ -61,6 +61,65 @@ typedef struct speedyStreamStruct* speedyStream;
 speedyStream speedyCreateStream(int sample_rate);
 void speedyDestroyStream(speedyStream stream);
 
+/* Return a stream to the state it was created in (keeping its memory), so it
+ * can analyze a new input starting at time 0.  This also undoes
+ * speedyUpdateTensionNormalization() and speedySetHysteresis().
+ */
+void speedyResetStream(speedyStream stream);
+
+/* A thread-safe pool of reusable streams, all with the same sample and
+ * analysis rates.  speedyAcquireStream() returns a stream in its newly created
+ * state, reusing an idle one if possible, or NULL if out of memory.
+ * speedyReleaseStream() resets the stream and keeps it for reuse, or destroys
+ * it if max_idle streams are already idle.  Destroying the pool destroys the
+ * idle streams only.
+ */
+struct speedyStreamPoolStruct;  /* Defined internally in speedy.c */
+typedef struct speedyStreamPoolStruct* speedyStreamPool;
+
+speedyStreamPool speedyCreateStreamPool(int sample_rate, int analysis_rate,
+                                        int max_idle);
+void speedyDestroyStreamPool(speedyStreamPool pool);
+speedyStream speedyAcquireStream(speedyStreamPool pool);
+void speedyReleaseStream(speedyStreamPool pool, speedyStream stream);
+
+/* Like speedyCreateStream(), but resample each input frame to analysis_rate
+ * before computing its spectrogram, and use a fast (2, 3 and 5 factor) FFT
+ * length.  The analysis cost is then fixed, and the response is the same for
+ * any input sample rate at or above analysis_rate.  Input frames are still
+ * speedyInputFrameSize() samples at sample_rate.  Inputs below analysis_rate
+ * are not upsampled.  An analysis_rate of 0 gives the original behavior of
+ * speedyCreateStream().
+ */
+#define kSpeedyDefaultAnalysisRate 16000   /* Hz */
+speedyStream speedyCreateStreamWithAnalysisRate(int sample_rate,
+                                                int analysis_rate);
+
+/* Like speedyCreateStreamWithAnalysisRate(), but compute the spectrogram with
+ * the given FFT backend.  The backends are compiled in with -DKISS_FFT,
+ * -DSPEEDY_FFTW (FFTW is also used when neither of the others is) and
+ * -DSPEEDY_POCKETFFT, and give the same spectrogram up to rounding.
+ * kSpeedyFFTDefault is the first one compiled in, in the order below.  The
+ * FFTW plans are made with FFTW_ESTIMATE, or for kSpeedyFFTFFTWMeasure by
+ * timing FFTW's algorithms with FFTW_MEASURE, once for each analysis rate.
+ * Import saved wisdom (e.g. at startup) to skip the timing.  Returns NULL if
+ * out of memory or the backend is not compiled in.
+ */
+#define kSpeedyFFTDefault     -1
+#define kSpeedyFFTKiss         0
+#define kSpeedyFFTFFTW         1
+#define kSpeedyFFTFFTWMeasure  2
+#define kSpeedyFFTPocketFFT    3
+speedyStream speedyCreateStreamWithFFT(int sample_rate, int analysis_rate,
+                                       int fft);
+int speedyGetFFT(speedyStream stream);  /* The kSpeedyFFT* value in use */
+const char* speedyFFTName(int fft);     /* NULL if not compiled in */
+/* Read or write FFTW's wisdom file.  Return 1 on success, and 0 on failure or
+ * without FFTW.
+ */
+int speedyImportFFTWisdom(const char* filename);
+int speedyExportFFTWisdom(const char* filename);
+
 /* Data sent to Speedy must have this number of samples, and the output tension
  * is returned with the given frame step.
  */
@@ -86,11 +145,92 @@ int64_t speedyGetCurrentTime(speedyStream stream);
 void speedyUpdateTensionNormalization(speedyStream stream,
                                       float normalizationTime);
 
+/* The energy hysteresis extends each frame's energy future_frames into the
+ * future and past_frames into the past (kTemporalHysteresisFuture and
+ * kTemporalHysteresisPast by default, which are also the largest spans.)  The
+ * tension of a frame is ready once the input is lookahead_frames past it,
+ * normally the whole future span.  A shorter lookahead, for lower latency,
+ * only sees part of the future span, and the rest of the future maximum is
+ * estimated from how much the unseen frames added to earlier frames.  Call
+ * before adding any data.  speedyResetStream() restores the defaults.
+ * Returns 0 if a value is out of range.  Batches always use the defaults.
+ */
+int speedySetHysteresis(speedyStream stream, int future_frames,
+                        int past_frames, int lookahead_frames);
+int speedyHysteresisLookahead(speedyStream stream);     /* in frames */
+
+/* Totals for a stream since it was created (or reset), e.g. to attribute the
+ * CPU time of each stream.  The counts are always kept.  The times, in
+ * nanoseconds of the monotonic clock, are only kept when speedy is compiled
+ * with -DSPEEDY_STATS, and are 0 otherwise, so the timing costs nothing
+ * unless it is built in.  speedyGetStats() returns whether the times are kept.
+ * A speedyBatch doesn't keep these.
+ */
+typedef struct speedyStatsStruct {
+  int64_t frames_analyzed;        /* Added with speedyAddData() */
+  int64_t tensions_computed;
+  int64_t skipped_frames;         /* Low energy, no spectral difference */
+  int64_t silent_frames;          /* All zero, so no FFT */
+  int64_t resample_ns;            /* To a lower analysis rate */
+  int64_t preemphasis_ns;
+  int64_t fft_ns;                 /* Window, FFT and magnitudes */
+  int64_t local_energy_ns;
+  int64_t hysteresis_ns;
+  int64_t spectral_difference_ns;
+  /* The stream and its buffers, but not the window and FFT plan it shares
+   * with the other streams of the same rates.
+   */
+  int64_t bytes_allocated;
+} speedyStats;
+int speedyGetStats(speedyStream stream, speedyStats* stats);
+
+/* Batch analysis: run the analysis for stream_count independent streams (all
+ * at the same sample rate), one frame from each per call.  All the streams
+ * share one FFT plan and window, and the per-stream state is stored so the
+ * feature calculations vectorize across streams.  The results are the same as
+ * using one speedyStream per stream.  Return NULL if out of memory.
+ */
+struct speedyBatchStruct;  /* Defined internally in speedy.c */
+typedef struct speedyBatchStruct* speedyBatch;
+
+speedyBatch speedyBatchCreate(int stream_count, int sample_rate);
+speedyBatch speedyBatchCreateWithAnalysisRate(int stream_count,
+                                              int sample_rate,
+                                              int analysis_rate);
+void speedyBatchDestroy(speedyBatch batch);
+int speedyBatchStreamCount(speedyBatch batch);
+int speedyBatchInputFrameSize(speedyBatch batch);   /* in samples */
+int speedyBatchInputFrameStep(speedyBatch batch);   /* in samples */
+/* Start stream_index over at time 0, e.g. for a new source. */
+void speedyBatchResetStream(speedyBatch batch, int stream_index);
+
+/* Add frames[s] (speedyBatchInputFrameSize() samples) to stream s at frame
+ * time times[s].  A NULL frame leaves that stream alone.
+ */
+void speedyBatchAddData(speedyBatch batch, const float* frames[],
+                        const int64_t times[]);
+/* Compute the tension of stream s at frame time times[s], where a negative
+ * time skips the stream.  ready[s] is set to whether there was enough data
+ * (see speedyComputeTension()), and if so tensions[s] is set.  Returns the
+ * number of ready streams.
+ */
+int speedyBatchComputeTension(speedyBatch batch, const int64_t times[],
+                              float tensions[], int ready[]);
+int64_t speedyBatchGetCurrentTime(speedyBatch batch, int stream_index);
+void speedyBatchUpdateTensionNormalization(speedyBatch batch, int stream_index,
+                                           float normalizationTime);
+
 /* The following functions are NOT designed to be user callable.  They are
  * defined here to make the internals of this function available for testing.
  */
 float* speedySpectrogram(speedyStream stream, float input[]);
 int speedyFFTSize(speedyStream stream);
+/* Number of bins in each spectrogram slice.  The input is real, so only the
+ * fft_size/2+1 non-negative frequencies are computed and stored.
+ */
+int speedySpectrogramSize(speedyStream stream);
+int speedyAnalysisRate(speedyStream stream);       /* Hz */
+int speedyFastFFTSize(int size);
 float speedyBinToFreq(speedyStream stream, int bin_number);
 int speedyFreqToBin(speedyStream stream, float freq);
 
@@ -116,11 +256,31 @@ float* speedyGetSpectrogram(speedyStream stream);
 float* speedyGetInternalState(speedyStream stream);
 float* speedyGetInternalSpectrogram(speedyStream stream);
 float* speedyGetInternalNormalizedSpectrogram(speedyStream stream);
+void speedyBatchGetInternalState(speedyBatch batch, int stream_index,
+                                 float features[kFeatureValueCount]);
 float speedyGetEnergyCompressed(speedyStream stream);
 float speedyGetSpeechChanges(speedyStream stream);
 float speedyNormalizeByEnergy(const float* spectrogram, float* normalized,
                                int length);
 
+/* The loops over spectrogram bins have scalar and SIMD versions, and by
+ * default the fastest one this CPU supports is used.  The SIMD versions sum
+ * in a different order and use an approximate log.  The tension then differs
+ * from the scalar result by less than 1e-4, and the features by about 1e-5
+ * relative (up to 1e-3 for the spectral difference, which is sensitive to the
+ * rounding of each frame's energy).  Select the scalar versions to get results
+ * identical to the original code.  This setting is shared by all streams, so
+ * set it before creating any.  Returns the kSpeedyKernels* value now in use;
+ * unsupported choices are ignored.
+ */
+#define kSpeedyKernelsAuto   -1
+#define kSpeedyKernelsScalar  0
+#define kSpeedyKernelsSSE2    1
+#define kSpeedyKernelsAVX2    2
+#define kSpeedyKernelsNEON    3
+int speedySelectKernels(int kernels);
+const char* speedyKernelsName(void);
+
 /* A simple structure to implement a digital first order filter. */
 struct FirstOrderFilterStruct;
 typedef struct FirstOrderFilterStruct* FirstOrderFilter;
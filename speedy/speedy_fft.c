@@ -0,0 +1,365 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - FFT backends for the spectrogram.
+
+   KISS FFT is compiled in with -DKISS_FFT, FFTW with -DSPEEDY_FFTW (or when
+   no other backend is, as before) and pocketfft with -DSPEEDY_POCKETFFT.
+   Each computes the same magnitudes, up to rounding.
+*/
+
+#include "speedy.h"
+#include "speedy_fft.h"
+#include <complex.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(KISS_FFT) && !defined(SPEEDY_FFTW) && !defined(SPEEDY_POCKETFFT)
+#define SPEEDY_FFTW 1
+#endif
+
+#ifdef  KISS_FFT
+#include "kiss_fft.h"
+#endif
+#ifdef  SPEEDY_FFTW
+#include "fftw3.h"          /* After complex.h, so fftw_complex is complex */
+#endif
+#ifdef  SPEEDY_POCKETFFT
+#include "pocketfft.h"
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Each buffer in the scratch space starts on a cache line, which is more than
+ * the alignment FFTW wants.
+ */
+#define  kScratchAlignment  64     /* in bytes */
+
+static size_t speedyScratchBytes(size_t size) {
+  return (size + kScratchAlignment-1)/kScratchAlignment*kScratchAlignment;
+}
+
+/*****************************************************************************
+ * KISS FFT.  kiss_fftr() keeps scratch space in its plan, so it can't be
+ * shared.  Instead share the fft_size/2 point complex plan (which is only read
+ * when transforming out of place) and the twiddles of the real-input split.
+ *****************************************************************************/
+#ifdef  KISS_FFT
+typedef struct {
+  kiss_fft_cfg fft_plan;
+  kiss_fft_cpx* super_twiddles;           /* fft_size/4 of them */
+} speedyKissPlan;
+
+static void speedyKissFreePlan(void* plan) {
+  speedyKissPlan* kiss = (speedyKissPlan*)plan;
+  if (kiss->fft_plan) kiss_fft_free(kiss->fft_plan);
+  if (kiss->super_twiddles) free(kiss->super_twiddles);
+  free(kiss);
+}
+
+/* The twiddles are computed just like kiss_fftr_alloc() does. */
+static void* speedyKissCreatePlan(int fft_size) {
+  speedyKissPlan* kiss = (speedyKissPlan*)calloc(1, sizeof(speedyKissPlan));
+  int i, half_size = fft_size/2;
+  if (!kiss) {
+    return NULL;
+  }
+  kiss->fft_plan = kiss_fft_alloc(half_size, 0, NULL, NULL);
+  kiss->super_twiddles = (kiss_fft_cpx *) malloc(sizeof(kiss_fft_cpx)*
+                                                 (half_size/2 + 1));
+  if (!kiss->fft_plan || !kiss->super_twiddles) {
+    speedyKissFreePlan(kiss);
+    return NULL;
+  }
+  for (i=0; i < half_size/2; i++) {
+    double phase = -M_PI*((double)(i+1)/half_size + .5);
+    kiss->super_twiddles[i].r = (kiss_fft_scalar)cos(phase);
+    kiss->super_twiddles[i].i = (kiss_fft_scalar)sin(phase);
+  }
+  return kiss;
+}
+
+/* The real input, the half-length complex FFT, then the fft_size/2+1 bins. */
+static size_t speedyKissScratchSize(int fft_size) {
+  return speedyScratchBytes(sizeof(kiss_fft_scalar)*fft_size) +
+         speedyScratchBytes(sizeof(kiss_fft_cpx)*(fft_size/2)) +
+         speedyScratchBytes(sizeof(kiss_fft_cpx)*(fft_size/2 + 1));
+}
+
+static float kiss_abs(kiss_fft_cpx c) {
+  return sqrt(c.r*c.r + c.i*c.i);
+}
+
+/* Real-input FFT of input into the half_size+1 bins of output: a half-length
+ * complex FFT of the even and odd samples, then the split into the real
+ * spectrum.  This is the arithmetic of kiss_fftr(), but with the scratch
+ * space passed in so the plan can be shared.
+ */
+static void speedyKissRealFFT(const speedyKissPlan* kiss,
+                              const kiss_fft_scalar* input, int half_size,
+                              kiss_fft_cpx* half, kiss_fft_cpx* output) {
+  const kiss_fft_cpx* twiddles = kiss->super_twiddles;
+  int k;
+
+  kiss_fft(kiss->fft_plan, (const kiss_fft_cpx*)input, half);
+  output[0].r = half[0].r + half[0].i;
+  output[half_size].r = half[0].r - half[0].i;
+  output[half_size].i = output[0].i = 0;
+  for (k=1; k <= half_size/2; k++) {
+    kiss_fft_cpx fpk = half[k], fpnk, f1k, f2k, tw;
+    fpnk.r = half[half_size-k].r;
+    fpnk.i = -half[half_size-k].i;
+    f1k.r = fpk.r + fpnk.r;
+    f1k.i = fpk.i + fpnk.i;
+    f2k.r = fpk.r - fpnk.r;
+    f2k.i = fpk.i - fpnk.i;
+    tw.r = f2k.r*twiddles[k-1].r - f2k.i*twiddles[k-1].i;
+    tw.i = f2k.r*twiddles[k-1].i + f2k.i*twiddles[k-1].r;
+    output[k].r = (f1k.r + tw.r)*.5;
+    output[k].i = (f1k.i + tw.i)*.5;
+    output[half_size-k].r = (f1k.r - tw.r)*.5;
+    output[half_size-k].i = (tw.i - f1k.i)*.5;
+  }
+}
+
+static void speedyKissExecute(const void* plan, const float* input,
+                              const float* window, int input_size,
+                              int fft_size, void* scratch, float* magnitudes) {
+  kiss_fft_scalar* buffer = (kiss_fft_scalar*)scratch;
+  kiss_fft_cpx* half = (kiss_fft_cpx*)((char*)buffer + speedyScratchBytes(
+      sizeof(kiss_fft_scalar)*fft_size));
+  kiss_fft_cpx* output = (kiss_fft_cpx*)((char*)half + speedyScratchBytes(
+      sizeof(kiss_fft_cpx)*(fft_size/2)));
+  int i;
+  for (i=0; i < input_size; i++) {
+    buffer[i] = input[i] * window[i];
+  }
+  for (i=input_size; i < fft_size; i++) {
+    buffer[i] = 0.0;
+  }
+  speedyKissRealFFT((const speedyKissPlan*)plan, buffer, fft_size/2, half,
+                    output);
+  for (i=0; i <= fft_size/2; i++) {
+    magnitudes[i] = kiss_abs(output[i]);
+  }
+}
+
+static const speedyFFT kiss_fft_backend = {
+  "kiss", kSpeedyFFTKiss,
+  speedyKissCreatePlan, speedyKissFreePlan, speedyKissScratchSize,
+  speedyKissExecute
+};
+#endif  /* KISS_FFT */
+
+/*****************************************************************************
+ * FFTW, with a real->complex plan that only computes the fft_size/2+1
+ * non-negative bins.  The plan is executed with fftw_execute_dft_r2c() on each
+ * stream's own (equally aligned) buffers.
+ *****************************************************************************/
+#ifdef  SPEEDY_FFTW
+/* FFTW's planner and its wisdom are not thread safe. */
+static pthread_mutex_t fftw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The arrays are only needed for planning (and are overwritten by
+ * FFTW_MEASURE.)
+ */
+static void* speedyFFTWCreatePlan(int fft_size, unsigned flags) {
+  double* input = (double *) fftw_malloc(sizeof(double)*fft_size);
+  fftw_complex* output = (fftw_complex *) fftw_malloc(sizeof(fftw_complex)*
+                                                      (fft_size/2 + 1));
+  fftw_plan plan = NULL;
+  if (input && output) {
+    pthread_mutex_lock(&fftw_mutex);
+    plan = fftw_plan_dft_r2c_1d(fft_size, input, output, flags);
+    pthread_mutex_unlock(&fftw_mutex);
+  }
+  if (input) fftw_free(input);
+  if (output) fftw_free(output);
+  return plan;
+}
+
+static void* speedyFFTWEstimatePlan(int fft_size) {
+  return speedyFFTWCreatePlan(fft_size, FFTW_ESTIMATE);
+}
+
+static void* speedyFFTWMeasurePlan(int fft_size) {
+  return speedyFFTWCreatePlan(fft_size, FFTW_MEASURE);
+}
+
+static void speedyFFTWFreePlan(void* plan) {
+  pthread_mutex_lock(&fftw_mutex);
+  fftw_destroy_plan((fftw_plan)plan);
+  pthread_mutex_unlock(&fftw_mutex);
+}
+
+static size_t speedyFFTWScratchSize(int fft_size) {
+  return speedyScratchBytes(sizeof(double)*fft_size) +
+         speedyScratchBytes(sizeof(fftw_complex)*(fft_size/2 + 1));
+}
+
+static void speedyFFTWExecute(const void* plan, const float* input,
+                              const float* window, int input_size,
+                              int fft_size, void* scratch, float* magnitudes) {
+  double* buffer = (double*)scratch;
+  fftw_complex* output = (fftw_complex*)((char*)buffer + speedyScratchBytes(
+      sizeof(double)*fft_size));
+  int i;
+  for (i=0; i < input_size; i++) {
+    buffer[i] = input[i] * window[i];
+  }
+  for (i=input_size; i < fft_size; i++) {
+    buffer[i] = 0.0;
+  }
+  fftw_execute_dft_r2c((fftw_plan)plan, buffer, output);
+  for (i=0; i <= fft_size/2; i++) {
+    magnitudes[i] = cabs(output[i]);
+  }
+}
+
+static const speedyFFT fftw_backend = {
+  "fftw", kSpeedyFFTFFTW,
+  speedyFFTWEstimatePlan, speedyFFTWFreePlan, speedyFFTWScratchSize,
+  speedyFFTWExecute
+};
+
+static const speedyFFT fftw_measure_backend = {
+  "fftw_measure", kSpeedyFFTFFTWMeasure,
+  speedyFFTWMeasurePlan, speedyFFTWFreePlan, speedyFFTWScratchSize,
+  speedyFFTWExecute
+};
+#endif  /* SPEEDY_FFTW */
+
+int speedyImportFFTWisdom(const char* filename) {
+#ifdef  SPEEDY_FFTW
+  pthread_mutex_lock(&fftw_mutex);
+  int imported = fftw_import_wisdom_from_filename(filename);
+  pthread_mutex_unlock(&fftw_mutex);
+  return imported;
+#else
+  (void)filename;
+  return 0;
+#endif  /* SPEEDY_FFTW */
+}
+
+int speedyExportFFTWisdom(const char* filename) {
+#ifdef  SPEEDY_FFTW
+  pthread_mutex_lock(&fftw_mutex);
+  int exported = fftw_export_wisdom_to_filename(filename);
+  pthread_mutex_unlock(&fftw_mutex);
+  return exported;
+#else
+  (void)filename;
+  return 0;
+#endif  /* SPEEDY_FFTW */
+}
+
+/*****************************************************************************
+ * pocketfft (the C version), which handles any length and needs no planning
+ * beyond its twiddles.  rfft_forward() transforms in place, into FFTPACK's
+ * order: r0, r1, i1, r2, i2, ... r(n/2).  It allocates its own scratch on each
+ * call.
+ *****************************************************************************/
+#ifdef  SPEEDY_POCKETFFT
+static void* speedyPocketCreatePlan(int fft_size) {
+  return make_rfft_plan((size_t)fft_size);
+}
+
+static void speedyPocketFreePlan(void* plan) {
+  destroy_rfft_plan((rfft_plan)plan);
+}
+
+static size_t speedyPocketScratchSize(int fft_size) {
+  return speedyScratchBytes(sizeof(double)*fft_size);
+}
+
+/* If pocketfft runs out of memory the magnitudes are all zero. */
+static void speedyPocketExecute(const void* plan, const float* input,
+                                const float* window, int input_size,
+                                int fft_size, void* scratch,
+                                float* magnitudes) {
+  double* buffer = (double*)scratch;
+  int i, half_size = fft_size/2;
+  for (i=0; i < input_size; i++) {
+    buffer[i] = input[i] * window[i];
+  }
+  for (i=input_size; i < fft_size; i++) {
+    buffer[i] = 0.0;
+  }
+  if (rfft_forward((rfft_plan)plan, buffer, 1.0) != 0) {
+    memset(magnitudes, 0, sizeof(float)*(half_size + 1));
+    return;
+  }
+  magnitudes[0] = fabs(buffer[0]);
+  for (i=1; i < half_size; i++) {
+    magnitudes[i] = sqrt(buffer[2*i-1]*buffer[2*i-1] +
+                         buffer[2*i]*buffer[2*i]);
+  }
+  magnitudes[half_size] = fabs(buffer[fft_size-1]);
+}
+
+static const speedyFFT pocketfft_backend = {
+  "pocketfft", kSpeedyFFTPocketFFT,
+  speedyPocketCreatePlan, speedyPocketFreePlan, speedyPocketScratchSize,
+  speedyPocketExecute
+};
+#endif  /* SPEEDY_POCKETFFT */
+
+/*****************************************************************************
+ * Selection.  The default is the first one compiled in, in the order of the
+ * kSpeedyFFT* values.
+ *****************************************************************************/
+const speedyFFT* speedyFindFFT(int fft) {
+  switch (fft) {
+    case kSpeedyFFTDefault:
+#ifdef  KISS_FFT
+      return &kiss_fft_backend;
+#elif defined(SPEEDY_FFTW)
+      return &fftw_backend;
+#else
+      return &pocketfft_backend;
+#endif
+#ifdef  KISS_FFT
+    case kSpeedyFFTKiss:
+      return &kiss_fft_backend;
+#endif
+#ifdef  SPEEDY_FFTW
+    case kSpeedyFFTFFTW:
+      return &fftw_backend;
+    case kSpeedyFFTFFTWMeasure:
+      return &fftw_measure_backend;
+#endif
+#ifdef  SPEEDY_POCKETFFT
+    case kSpeedyFFTPocketFFT:
+      return &pocketfft_backend;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+const char* speedyFFTName(int fft) {
+  const speedyFFT* backend = speedyFindFFT(fft);
+  return backend ? backend->name : NULL;
+}
+
+void speedyFFTCleanup(void) {
+#ifdef  KISS_FFT
+  kiss_fft_cleanup();
+#endif  /* KISS_FFT */
+}
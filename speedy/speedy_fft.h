@@ -0,0 +1,63 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - FFT backends for the spectrogram.
+
+   This header is internal to the Speedy library.  Each backend computes the
+   magnitude spectrum of a windowed, zero padded, real frame.  The plan only
+   depends on the FFT size, so it is built once per analysis setup and shared
+   (read only) by all the streams that use it, and each stream passes its own
+   scratch space.  See speedyCreateStreamWithFFT() in speedy.h.
+*/
+
+#ifndef SPEEDY_SPEEDY_FFT_H_
+#define SPEEDY_SPEEDY_FFT_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct speedyFFTStruct {
+  const char* name;
+  int fft;                      /* One of the kSpeedyFFT* values */
+  /* Plan a real-input FFT of fft_size (always even) points.  Return NULL if
+   * out of memory.
+   */
+  void* (*create_plan)(int fft_size);
+  void (*free_plan)(void* plan);
+  /* The bytes of scratch space execute() needs, starting on a cache line. */
+  size_t (*scratch_size)(int fft_size);
+  /* Write the fft_size/2+1 magnitudes of the FFT of input[i]*window[i], for i
+   * < input_size and zero up to fft_size, to magnitudes.
+   */
+  void (*execute)(const void* plan, const float* input, const float* window,
+                  int input_size, int fft_size, void* scratch,
+                  float* magnitudes);
+} speedyFFT;
+
+/* The backend for the given kSpeedyFFT* value (kSpeedyFFTDefault for the
+ * default one), or NULL if it is not compiled in.
+ */
+const speedyFFT* speedyFindFFT(int fft);
+
+/* Free any global state of the backends, once no plans are left. */
+void speedyFFTCleanup(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPEEDY_SPEEDY_FFT_H_ */
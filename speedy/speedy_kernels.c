@@ -0,0 +1,521 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - inner loops of the spectral calculations.
+
+   Each loop has a scalar version, which gives exactly the same answers as the
+   original code, and SSE2, AVX2 (with FMA) and NEON versions.  The vector
+   versions add up the bins in a different order and use a polynomial
+   approximation to log() (good to a few float ULP, after Cephes' logf), so
+   each kernel's result differs from the scalar one by about 1e-6 relative.
+   See speedySelectKernels() in speedy.h for the effect on the features.
+
+   The vector versions skip the eps that the scalar code adds before taking
+   the log.  Only bins above 1/100 of the frame's peak are used, and these are
+   at least 0.01/sqrt(length) after normalization, far above eps.
+*/
+
+#include "speedy.h"
+#include "speedy_kernels.h"
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define SPEEDY_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPEEDY_HAVE_AVX2 1
+#include <immintrin.h>
+#define SPEEDY_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+#if defined(__aarch64__)
+#define SPEEDY_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Cephes' logf() constants.  log(x) = e*log(2) + log(m), with m in
+ * [sqrt(1/2), sqrt(2)), and log(2) split into two parts for accuracy.
+ */
+#define kLogMinNormal   1.17549435e-38f
+#define kLogSqrtHalf    0.707106781186547524f
+#define kLogP0          7.0376836292e-2f
+#define kLogP1         -1.1514610310e-1f
+#define kLogP2          1.1676998740e-1f
+#define kLogP3         -1.2420140846e-1f
+#define kLogP4          1.4249322787e-1f
+#define kLogP5         -1.6668057665e-1f
+#define kLogP6          2.0000714765e-1f
+#define kLogP7         -2.4999993993e-1f
+#define kLogP8          3.3333331174e-1f
+#define kLogQ1         -2.12194440e-4f
+#define kLogQ2          0.693359375f
+
+/*****************************************************************************
+ * Scalar (reference) kernels.  These are the loops from the original code.
+ *****************************************************************************/
+
+static float speedyEnergyScalar(const float* input, int length, float* max) {
+  int i;
+  float energy = 0.0;
+  float max_value = 0;
+  for (i = 0; i < length; i++) {
+    energy += input[i] * input[i];
+    if (input[i] > max_value) {
+      max_value = input[i];
+    }
+  }
+  if (max) {
+    *max = max_value;
+  }
+  return energy;
+}
+
+static void speedyScaleScalar(const float* input, float* output, int length,
+                              float gain) {
+  int i;
+  for (i = 0; i < length; i++) {
+    output[i] = input[i]*gain;
+  }
+}
+
+static float speedyLogDifferenceScalar(const float* spectrogram,
+                                       const float* last_spectrogram,
+                                       const float* normalized,
+                                       const float* normalized_last,
+                                       int length, float threshold) {
+  int i;
+  float difference = 0.0;
+  const float eps = 2.2204e-16;        /* Smallest increment around 1.0 */
+  for (i = 0; i < length; i++) {
+    if (spectrogram[i] > threshold && last_spectrogram[i] > threshold) {
+      difference += fabs(log((normalized[i] + eps) /
+                             (normalized_last[i] + eps)));
+    }
+  }
+  return difference;
+}
+
+static const speedyKernels scalar_kernels = {
+  "scalar", kSpeedyKernelsScalar,
+  speedyEnergyScalar, speedyScaleScalar, speedyLogDifferenceScalar
+};
+
+/*****************************************************************************
+ * SSE2 kernels, 4 bins at a time.
+ *****************************************************************************/
+
+#ifdef SPEEDY_HAVE_SSE2
+static float speedyHorizontalSumSSE2(__m128 x) {
+  x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+  x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+  return _mm_cvtss_f32(x);
+}
+
+static float speedyHorizontalMaxSSE2(__m128 x) {
+  x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+  x = _mm_max_ss(x, _mm_shuffle_ps(x, x, 1));
+  return _mm_cvtss_f32(x);
+}
+
+/* Natural log of positive x.  NaN and values below the smallest normal float
+ * are treated as the smallest normal float.
+ */
+static __m128 speedyLogSSE2(__m128 x) {
+  const __m128 one = _mm_set1_ps(1.0f);
+  x = _mm_max_ps(x, _mm_set1_ps(kLogMinNormal));
+  __m128i exponent = _mm_srli_epi32(_mm_castps_si128(x), 23);
+  /* Keep the mantissa, scaled to [0.5, 1) */
+  x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+  x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+  exponent = _mm_sub_epi32(exponent, _mm_set1_epi32(0x7f));
+  __m128 e = _mm_add_ps(_mm_cvtepi32_ps(exponent), one);
+  /* Move m below sqrt(1/2) up an octave so it is centered on 1. */
+  __m128 small = _mm_cmplt_ps(x, _mm_set1_ps(kLogSqrtHalf));
+  e = _mm_sub_ps(e, _mm_and_ps(one, small));
+  x = _mm_add_ps(_mm_sub_ps(x, one), _mm_and_ps(x, small));
+
+  __m128 z = _mm_mul_ps(x, x);
+  __m128 y = _mm_set1_ps(kLogP0);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP1));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP2));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP3));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP4));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP5));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP6));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP7));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP8));
+  y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+  y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(kLogQ1)));
+  y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+  x = _mm_add_ps(x, y);
+  return _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(kLogQ2)));
+}
+
+static float speedyEnergySSE2(const float* input, int length, float* max) {
+  int i;
+  __m128 energy4 = _mm_setzero_ps();
+  __m128 max4 = _mm_setzero_ps();
+  for (i = 0; i + 4 <= length; i += 4) {
+    __m128 x = _mm_loadu_ps(input + i);
+    energy4 = _mm_add_ps(energy4, _mm_mul_ps(x, x));
+    max4 = _mm_max_ps(max4, x);
+  }
+  float max_value;
+  float energy = speedyHorizontalSumSSE2(energy4) +
+      speedyEnergyScalar(input + i, length - i, &max_value);
+  if (max) {
+    float max_vector = speedyHorizontalMaxSSE2(max4);
+    *max = max_vector > max_value ? max_vector : max_value;
+  }
+  return energy;
+}
+
+static void speedyScaleSSE2(const float* input, float* output, int length,
+                            float gain) {
+  int i;
+  __m128 gain4 = _mm_set1_ps(gain);
+  for (i = 0; i + 4 <= length; i += 4) {
+    _mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(input + i), gain4));
+  }
+  speedyScaleScalar(input + i, output + i, length - i, gain);
+}
+
+static float speedyLogDifferenceSSE2(const float* spectrogram,
+                                     const float* last_spectrogram,
+                                     const float* normalized,
+                                     const float* normalized_last,
+                                     int length, float threshold) {
+  int i;
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 threshold4 = _mm_set1_ps(threshold);
+  __m128 difference4 = _mm_setzero_ps();
+  for (i = 0; i + 4 <= length; i += 4) {
+    __m128 use = _mm_and_ps(
+        _mm_cmpgt_ps(_mm_loadu_ps(spectrogram + i), threshold4),
+        _mm_cmpgt_ps(_mm_loadu_ps(last_spectrogram + i), threshold4));
+    __m128 ratio = _mm_div_ps(_mm_loadu_ps(normalized + i),
+                              _mm_loadu_ps(normalized_last + i));
+    /* Unused bins get a ratio of 1, so they add log(1) = 0. */
+    ratio = _mm_or_ps(_mm_and_ps(use, ratio), _mm_andnot_ps(use, one));
+    difference4 = _mm_add_ps(difference4,
+                             _mm_and_ps(speedyLogSSE2(ratio), abs_mask));
+  }
+  return speedyHorizontalSumSSE2(difference4) +
+      speedyLogDifferenceScalar(spectrogram + i, last_spectrogram + i,
+                                normalized + i, normalized_last + i,
+                                length - i, threshold);
+}
+
+static const speedyKernels sse2_kernels = {
+  "sse2", kSpeedyKernelsSSE2,
+  speedyEnergySSE2, speedyScaleSSE2, speedyLogDifferenceSSE2
+};
+#endif  /* SPEEDY_HAVE_SSE2 */
+
+/*****************************************************************************
+ * AVX2 + FMA kernels, 8 bins at a time.  These are compiled for AVX2 no
+ * matter the compiler flags, and only used if the CPU has AVX2 and FMA.
+ *****************************************************************************/
+
+#ifdef SPEEDY_HAVE_AVX2
+SPEEDY_TARGET_AVX2
+static float speedyHorizontalSumAVX2(__m256 x) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(x),
+                          _mm256_extractf128_ps(x, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+SPEEDY_TARGET_AVX2
+static float speedyHorizontalMaxAVX2(__m256 x) {
+  __m128 max = _mm_max_ps(_mm256_castps256_ps128(x),
+                          _mm256_extractf128_ps(x, 1));
+  max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+  max = _mm_max_ss(max, _mm_shuffle_ps(max, max, 1));
+  return _mm_cvtss_f32(max);
+}
+
+/* Same as speedyLogSSE2(). */
+SPEEDY_TARGET_AVX2
+static __m256 speedyLogAVX2(__m256 x) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  x = _mm256_max_ps(x, _mm256_set1_ps(kLogMinNormal));
+  __m256i exponent = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+  x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+  x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+  exponent = _mm256_sub_epi32(exponent, _mm256_set1_epi32(0x7f));
+  __m256 e = _mm256_add_ps(_mm256_cvtepi32_ps(exponent), one);
+  __m256 small = _mm256_cmp_ps(x, _mm256_set1_ps(kLogSqrtHalf), _CMP_LT_OQ);
+  e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+  x = _mm256_add_ps(_mm256_sub_ps(x, one), _mm256_and_ps(x, small));
+
+  __m256 z = _mm256_mul_ps(x, x);
+  __m256 y = _mm256_set1_ps(kLogP0);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP1));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP2));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP3));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP4));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP5));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP6));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP7));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(kLogP8));
+  y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+  y = _mm256_fmadd_ps(e, _mm256_set1_ps(kLogQ1), y);
+  y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+  x = _mm256_add_ps(x, y);
+  return _mm256_fmadd_ps(e, _mm256_set1_ps(kLogQ2), x);
+}
+
+SPEEDY_TARGET_AVX2
+static float speedyEnergyAVX2(const float* input, int length, float* max) {
+  int i;
+  __m256 energy8 = _mm256_setzero_ps();
+  __m256 max8 = _mm256_setzero_ps();
+  for (i = 0; i + 8 <= length; i += 8) {
+    __m256 x = _mm256_loadu_ps(input + i);
+    energy8 = _mm256_fmadd_ps(x, x, energy8);
+    max8 = _mm256_max_ps(max8, x);
+  }
+  float max_value;
+  float energy = speedyHorizontalSumAVX2(energy8) +
+      speedyEnergyScalar(input + i, length - i, &max_value);
+  if (max) {
+    float max_vector = speedyHorizontalMaxAVX2(max8);
+    *max = max_vector > max_value ? max_vector : max_value;
+  }
+  return energy;
+}
+
+SPEEDY_TARGET_AVX2
+static void speedyScaleAVX2(const float* input, float* output, int length,
+                            float gain) {
+  int i;
+  __m256 gain8 = _mm256_set1_ps(gain);
+  for (i = 0; i + 8 <= length; i += 8) {
+    _mm256_storeu_ps(output + i,
+                     _mm256_mul_ps(_mm256_loadu_ps(input + i), gain8));
+  }
+  speedyScaleScalar(input + i, output + i, length - i, gain);
+}
+
+SPEEDY_TARGET_AVX2
+static float speedyLogDifferenceAVX2(const float* spectrogram,
+                                     const float* last_spectrogram,
+                                     const float* normalized,
+                                     const float* normalized_last,
+                                     int length, float threshold) {
+  int i;
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 threshold8 = _mm256_set1_ps(threshold);
+  __m256 difference8 = _mm256_setzero_ps();
+  for (i = 0; i + 8 <= length; i += 8) {
+    __m256 use = _mm256_and_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(spectrogram + i), threshold8,
+                      _CMP_GT_OQ),
+        _mm256_cmp_ps(_mm256_loadu_ps(last_spectrogram + i), threshold8,
+                      _CMP_GT_OQ));
+    __m256 ratio = _mm256_div_ps(_mm256_loadu_ps(normalized + i),
+                                 _mm256_loadu_ps(normalized_last + i));
+    ratio = _mm256_blendv_ps(one, ratio, use);
+    difference8 = _mm256_add_ps(difference8,
+                                _mm256_and_ps(speedyLogAVX2(ratio), abs_mask));
+  }
+  return speedyHorizontalSumAVX2(difference8) +
+      speedyLogDifferenceScalar(spectrogram + i, last_spectrogram + i,
+                                normalized + i, normalized_last + i,
+                                length - i, threshold);
+}
+
+static const speedyKernels avx2_kernels = {
+  "avx2", kSpeedyKernelsAVX2,
+  speedyEnergyAVX2, speedyScaleAVX2, speedyLogDifferenceAVX2
+};
+#endif  /* SPEEDY_HAVE_AVX2 */
+
+/*****************************************************************************
+ * NEON kernels (64-bit ARM, where NEON is always present), 4 bins at a time.
+ *****************************************************************************/
+
+#ifdef SPEEDY_HAVE_NEON
+/* Same as speedyLogSSE2(). */
+static float32x4_t speedyLogNEON(float32x4_t x) {
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  x = vmaxq_f32(x, vdupq_n_f32(kLogMinNormal));
+  int32x4_t exponent = vshrq_n_s32(vreinterpretq_s32_f32(x), 23);
+  uint32x4_t mantissa = vandq_u32(vreinterpretq_u32_f32(x),
+                                  vdupq_n_u32(~0x7f800000u));
+  x = vreinterpretq_f32_u32(vorrq_u32(mantissa,
+                                      vreinterpretq_u32_f32(vdupq_n_f32(0.5f))));
+  exponent = vsubq_s32(exponent, vdupq_n_s32(0x7f));
+  float32x4_t e = vaddq_f32(vcvtq_f32_s32(exponent), one);
+  uint32x4_t small = vcltq_f32(x, vdupq_n_f32(kLogSqrtHalf));
+  e = vsubq_f32(e, vbslq_f32(small, one, vdupq_n_f32(0.0f)));
+  x = vaddq_f32(vsubq_f32(x, one), vbslq_f32(small, x, vdupq_n_f32(0.0f)));
+
+  float32x4_t z = vmulq_f32(x, x);
+  float32x4_t y = vdupq_n_f32(kLogP0);
+  y = vfmaq_f32(vdupq_n_f32(kLogP1), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP2), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP3), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP4), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP5), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP6), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP7), y, x);
+  y = vfmaq_f32(vdupq_n_f32(kLogP8), y, x);
+  y = vmulq_f32(vmulq_f32(y, x), z);
+  y = vfmaq_f32(y, e, vdupq_n_f32(kLogQ1));
+  y = vfmsq_f32(y, z, vdupq_n_f32(0.5f));
+  x = vaddq_f32(x, y);
+  return vfmaq_f32(x, e, vdupq_n_f32(kLogQ2));
+}
+
+static float speedyEnergyNEON(const float* input, int length, float* max) {
+  int i;
+  float32x4_t energy4 = vdupq_n_f32(0.0f);
+  float32x4_t max4 = vdupq_n_f32(0.0f);
+  for (i = 0; i + 4 <= length; i += 4) {
+    float32x4_t x = vld1q_f32(input + i);
+    energy4 = vfmaq_f32(energy4, x, x);
+    max4 = vmaxq_f32(max4, x);
+  }
+  float max_value;
+  float energy = vaddvq_f32(energy4) +
+      speedyEnergyScalar(input + i, length - i, &max_value);
+  if (max) {
+    float max_vector = vmaxvq_f32(max4);
+    *max = max_vector > max_value ? max_vector : max_value;
+  }
+  return energy;
+}
+
+static void speedyScaleNEON(const float* input, float* output, int length,
+                            float gain) {
+  int i;
+  for (i = 0; i + 4 <= length; i += 4) {
+    vst1q_f32(output + i, vmulq_n_f32(vld1q_f32(input + i), gain));
+  }
+  speedyScaleScalar(input + i, output + i, length - i, gain);
+}
+
+static float speedyLogDifferenceNEON(const float* spectrogram,
+                                     const float* last_spectrogram,
+                                     const float* normalized,
+                                     const float* normalized_last,
+                                     int length, float threshold) {
+  int i;
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  float32x4_t threshold4 = vdupq_n_f32(threshold);
+  float32x4_t difference4 = vdupq_n_f32(0.0f);
+  for (i = 0; i + 4 <= length; i += 4) {
+    uint32x4_t use = vandq_u32(
+        vcgtq_f32(vld1q_f32(spectrogram + i), threshold4),
+        vcgtq_f32(vld1q_f32(last_spectrogram + i), threshold4));
+    float32x4_t ratio = vdivq_f32(vld1q_f32(normalized + i),
+                                  vld1q_f32(normalized_last + i));
+    ratio = vbslq_f32(use, ratio, one);
+    difference4 = vaddq_f32(difference4, vabsq_f32(speedyLogNEON(ratio)));
+  }
+  return vaddvq_f32(difference4) +
+      speedyLogDifferenceScalar(spectrogram + i, last_spectrogram + i,
+                                normalized + i, normalized_last + i,
+                                length - i, threshold);
+}
+
+static const speedyKernels neon_kernels = {
+  "neon", kSpeedyKernelsNEON,
+  speedyEnergyNEON, speedyScaleNEON, speedyLogDifferenceNEON
+};
+#endif  /* SPEEDY_HAVE_NEON */
+
+/*****************************************************************************
+ * Runtime selection.  The CPU is checked once; after that the selected table
+ * is only read.
+ *****************************************************************************/
+
+/* Return the kernels for the given kSpeedyKernels* value, or NULL if they are
+ * not compiled in or not supported by this CPU.
+ */
+static const speedyKernels* speedyFindKernels(int kernels) {
+  switch (kernels) {
+    case kSpeedyKernelsScalar:
+      return &scalar_kernels;
+#ifdef SPEEDY_HAVE_SSE2
+    case kSpeedyKernelsSSE2:
+      return &sse2_kernels;
+#endif
+#ifdef SPEEDY_HAVE_AVX2
+    case kSpeedyKernelsAVX2:
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return &avx2_kernels;
+      }
+      return NULL;
+#endif
+#ifdef SPEEDY_HAVE_NEON
+    case kSpeedyKernelsNEON:
+      return &neon_kernels;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+static const speedyKernels* speedyBestKernels(void) {
+  static const int preferred[] = {kSpeedyKernelsAVX2, kSpeedyKernelsNEON,
+                                  kSpeedyKernelsSSE2};
+  size_t i;
+  for (i = 0; i < sizeof(preferred)/sizeof(preferred[0]); i++) {
+    const speedyKernels* kernels = speedyFindKernels(preferred[i]);
+    if (kernels) {
+      return kernels;
+    }
+  }
+  return &scalar_kernels;
+}
+
+static const speedyKernels* selected_kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void speedyInitKernels(void) {
+  selected_kernels = speedyBestKernels();
+}
+
+const speedyKernels* speedyGetKernels(void) {
+  pthread_once(&kernels_once, speedyInitKernels);
+  return selected_kernels;
+}
+
+int speedySelectKernels(int kernels) {
+  pthread_once(&kernels_once, speedyInitKernels);
+  if (kernels == kSpeedyKernelsAuto) {
+    selected_kernels = speedyBestKernels();
+  } else {
+    const speedyKernels* found = speedyFindKernels(kernels);
+    if (found) {
+      selected_kernels = found;
+    }
+  }
+  return selected_kernels->kernels;
+}
+
+const char* speedyKernelsName(void) {
+  return speedyGetKernels()->name;
+}
@@ -0,0 +1,56 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - inner loops of the spectral calculations.
+
+   This header is internal to the Speedy library.  The loops over spectrogram
+   bins have a scalar (reference) version and SIMD versions, and the fastest
+   one the CPU supports is picked at runtime.  See speedySelectKernels() in
+   speedy.h.
+*/
+
+#ifndef SPEEDY_SPEEDY_KERNELS_H_
+#define SPEEDY_SPEEDY_KERNELS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct speedyKernelsStruct {
+  const char* name;
+  int kernels;                  /* One of the kSpeedyKernels* values */
+  /* Return the sum of squares of input[0..length-1].  If max is not NULL also
+   * return the largest value (or 0 if all are negative.)
+   */
+  float (*energy)(const float* input, int length, float* max);
+  /* output[i] = input[i]*gain */
+  void (*scale)(const float* input, float* output, int length, float gain);
+  /* Sum |log(normalized[i]/normalized_last[i])| over the bins where both
+   * spectrogram[i] and last_spectrogram[i] are above threshold.
+   */
+  float (*log_difference)(const float* spectrogram,
+                          const float* last_spectrogram,
+                          const float* normalized,
+                          const float* normalized_last,
+                          int length, float threshold);
+} speedyKernels;
+
+/* The kernels selected for this process. */
+const speedyKernels* speedyGetKernels(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPEEDY_SPEEDY_KERNELS_H_ */
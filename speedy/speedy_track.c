@@ -0,0 +1,289 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - reading and writing tension tracks.  See speedy_track.h
+   for the file format.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+#include "speedy_track.h"
+#include "speedy.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char kTrackMagic[8] = "SPDYTRK";
+#define kTrackHeaderSize 32     /* bytes */
+
+struct speedyTrackWriterStruct {
+  FILE* fp;
+  int sample_rate;
+  int frame_step;
+  int feature_count;
+  int64_t frame_count;          /* Frames written to the file */
+  int64_t pending_time;         /* Frame in record, or -1 if none */
+  float* record;                /* 1 + feature_count values */
+};
+
+struct speedyTrackStruct {
+  int sample_rate;
+  int frame_step;
+  int feature_count;
+  int64_t frame_count;
+  float* values;                /* frame_count records */
+};
+
+/* The file is little-endian, whatever the byte order of this machine. */
+static void speedyPutUint32(unsigned char* bytes, uint32_t value) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    bytes[i] = (value >> (8*i)) & 0xff;
+  }
+}
+
+static uint32_t speedyGetUint32(const unsigned char* bytes) {
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void speedyPutFloat(unsigned char* bytes, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  speedyPutUint32(bytes, bits);
+}
+
+static float speedyGetFloat(const unsigned char* bytes) {
+  uint32_t bits = speedyGetUint32(bytes);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static int speedyWriteTrackHeader(FILE* fp, int sample_rate, int frame_step,
+                                  int feature_count, int64_t frame_count) {
+  unsigned char header[kTrackHeaderSize];
+  memcpy(header, kTrackMagic, sizeof(kTrackMagic));
+  speedyPutUint32(header + 8, kSpeedyTrackVersion);
+  speedyPutUint32(header + 12, sample_rate);
+  speedyPutUint32(header + 16, frame_step);
+  speedyPutUint32(header + 20, feature_count);
+  speedyPutUint32(header + 24, (uint32_t)frame_count);
+  speedyPutUint32(header + 28, (uint32_t)((uint64_t)frame_count >> 32));
+  return fseek(fp, 0, SEEK_SET) == 0 &&
+         fwrite(header, sizeof(header), 1, fp) == 1;
+}
+
+speedyTrackWriter speedyCreateTrackWriter(const char* file_name,
+                                          int sample_rate, int frame_step,
+                                          int feature_count) {
+  assert(file_name);
+  assert(feature_count == 0 || feature_count == kFeatureValueCount);
+  speedyTrackWriter writer = (speedyTrackWriter)calloc(
+      1, sizeof(struct speedyTrackWriterStruct));
+  if (!writer) {
+    return NULL;
+  }
+  writer->record = (float*)calloc(1 + feature_count, sizeof(float));
+  writer->fp = fopen(file_name, "wb");
+  if (!writer->record || !writer->fp) {
+    if (writer->fp) {
+      fclose(writer->fp);
+    }
+    free(writer->record);
+    free(writer);
+    return NULL;
+  }
+  writer->sample_rate = sample_rate;
+  writer->frame_step = frame_step;
+  writer->feature_count = feature_count;
+  writer->pending_time = -1;
+  /* The frame count is filled in when the writer is closed. */
+  if (!speedyWriteTrackHeader(writer->fp, sample_rate, frame_step,
+                              feature_count, 0)) {
+    fclose(writer->fp);
+    free(writer->record);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+/* Write the frame in the record (if any) to the file. */
+static int speedyFlushTrackRecord(speedyTrackWriter writer) {
+  if (writer->pending_time < 0) {
+    return 1;
+  }
+  assert(writer->pending_time == writer->frame_count);
+  unsigned char bytes[4*(1 + kFeatureValueCount)];
+  int i, value_count = 1 + writer->feature_count;
+  for (i = 0; i < value_count; i++) {
+    speedyPutFloat(bytes + 4*i, writer->record[i]);
+  }
+  writer->pending_time = -1;
+  if (fwrite(bytes, 4*value_count, 1, writer->fp) != 1) {
+    return 0;
+  }
+  writer->frame_count++;
+  return 1;
+}
+
+int speedyTrackWriteTension(speedyTrackWriter writer, int64_t at_time,
+                            float tension) {
+  assert(writer);
+  if (!speedyFlushTrackRecord(writer)) {
+    return 0;
+  }
+  assert(at_time == writer->frame_count);   /* Frames must be in order */
+  memset(writer->record, 0, sizeof(float)*(1 + writer->feature_count));
+  writer->record[0] = tension;
+  writer->pending_time = at_time;
+  return 1;
+}
+
+int speedyTrackWriteFeatures(speedyTrackWriter writer, int64_t at_time,
+                             const float* features) {
+  assert(writer);
+  assert(features);
+  assert(at_time == writer->pending_time);  /* After its tension */
+  if (writer->feature_count) {
+    memcpy(writer->record + 1, features,
+           sizeof(float)*writer->feature_count);
+  }
+  return 1;
+}
+
+int speedyCloseTrackWriter(speedyTrackWriter writer) {
+  assert(writer);
+  int ok = speedyFlushTrackRecord(writer);
+  ok = ok && speedyWriteTrackHeader(writer->fp, writer->sample_rate,
+                                    writer->frame_step, writer->feature_count,
+                                    writer->frame_count);
+  ok = (fclose(writer->fp) == 0) && ok;
+  free(writer->record);
+  free(writer);
+  return ok;
+}
+
+/* Read the header and values of a track file into track.  Return 0 if it
+ * isn't a (complete) track or we are out of memory.
+ */
+static int speedyReadTrackFile(FILE* fp, speedyTrack track) {
+  unsigned char header[kTrackHeaderSize];
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header, kTrackMagic, sizeof(kTrackMagic)) ||
+      speedyGetUint32(header + 8) != kSpeedyTrackVersion) {
+    return 0;
+  }
+  track->sample_rate = speedyGetUint32(header + 12);
+  track->frame_step = speedyGetUint32(header + 16);
+  track->feature_count = speedyGetUint32(header + 20);
+  track->frame_count = (int64_t)((uint64_t)speedyGetUint32(header + 24) |
+                                 (uint64_t)speedyGetUint32(header + 28) << 32);
+  if (track->feature_count != 0 &&
+      track->feature_count != kFeatureValueCount) {
+    return 0;
+  }
+  /* Check the frame count against what is left of the file before trusting
+   * it, so a corrupt header can't overflow value_count or make us allocate
+   * far more than the file holds.
+   */
+  long start = ftell(fp);
+  if (start < 0 || fseek(fp, 0, SEEK_END) != 0) {
+    return 0;
+  }
+  long end = ftell(fp);
+  if (end < start || fseek(fp, start, SEEK_SET) != 0) {
+    return 0;
+  }
+  uint64_t values_in_file = (uint64_t)(end - start)/4;
+  if (track->frame_count < 0 ||
+      (uint64_t)track->frame_count >
+          values_in_file/(1 + track->feature_count) ||
+      (uint64_t)track->frame_count*(1 + track->feature_count) >
+          SIZE_MAX/4 - 1) {
+    return 0;
+  }
+  size_t value_count = (size_t)track->frame_count*(1 + track->feature_count);
+  track->values = (float*)malloc(sizeof(float)*value_count + 1);
+  unsigned char* bytes = (unsigned char*)malloc(4*value_count + 1);
+  int ok = track->values && bytes &&
+           fread(bytes, 4, value_count, fp) == value_count;
+  if (ok) {
+    size_t i;
+    for (i = 0; i < value_count; i++) {
+      track->values[i] = speedyGetFloat(bytes + 4*i);
+    }
+  }
+  free(bytes);
+  return ok;
+}
+
+speedyTrack speedyReadTrack(const char* file_name) {
+  assert(file_name);
+  FILE* fp = fopen(file_name, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  speedyTrack track = (speedyTrack)calloc(1, sizeof(struct speedyTrackStruct));
+  if (track && !speedyReadTrackFile(fp, track)) {
+    speedyDestroyTrack(track);
+    track = NULL;
+  }
+  fclose(fp);
+  return track;
+}
+
+void speedyDestroyTrack(speedyTrack track) {
+  assert(track);
+  free(track->values);
+  free(track);
+}
+
+int speedyTrackSampleRate(speedyTrack track) {
+  assert(track);
+  return track->sample_rate;
+}
+
+int speedyTrackFrameStep(speedyTrack track) {
+  assert(track);
+  return track->frame_step;
+}
+
+int speedyTrackFeatureCount(speedyTrack track) {
+  assert(track);
+  return track->feature_count;
+}
+
+int64_t speedyTrackFrameCount(speedyTrack track) {
+  assert(track);
+  return track->frame_count;
+}
+
+float speedyTrackTension(speedyTrack track, int64_t at_time) {
+  assert(track);
+  assert(at_time >= 0 && at_time < track->frame_count);
+  return track->values[(size_t)at_time*(1 + track->feature_count)];
+}
+
+const float* speedyTrackFeatures(speedyTrack track, int64_t at_time) {
+  assert(track);
+  assert(at_time >= 0 && at_time < track->frame_count);
+  if (!track->feature_count) {
+    return NULL;
+  }
+  return track->values + (size_t)at_time*(1 + track->feature_count) + 1;
+}
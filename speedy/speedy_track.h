@@ -0,0 +1,93 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Speedy library - tension tracks.
+
+   This file is licensed under the Apache 2.0 license.
+*/
+
+#ifndef SPEEDY_SPEEDY_TRACK_H_
+#define SPEEDY_SPEEDY_TRACK_H_
+
+/*
+ * The speedy analysis only depends on the audio (and the tension
+ * normalization), and speedyComputeSpeedFromTension() turns a tension into a
+ * speed for any global speed.  So the tensions can be computed once, saved in
+ * a track file, and then used to render the audio at many speeds without
+ * running the analysis again (see sonicSetNonlinearTensionTrack() in sonic.h.)
+ *
+ * A track file holds the tension (and optionally the kFeatureValueCount
+ * features) of consecutive frames, starting at frame time 0.  All the values
+ * are little-endian:
+ *   char     magic[8];        "SPDYTRK" and a 0
+ *   uint32   version;         kSpeedyTrackVersion
+ *   uint32   sample_rate;     Hz, of the analyzed audio
+ *   uint32   frame_step;      samples per frame (speedyInputFrameStep)
+ *   uint32   feature_count;   0, or kFeatureValueCount
+ *   uint64   frame_count;
+ * followed by frame_count records of 1+feature_count float32 values, the
+ * tension and then the features.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#include <cstdint>
+#else
+#include <stdint.h>
+#endif
+
+#define kSpeedyTrackVersion 1
+
+/* Write a track, for instance from the tension and features callbacks of
+ * sonic.  The frames must be written in order, starting at time 0.  For each
+ * frame write the tension, and then (if the track has features) the features.
+ * Create returns NULL if the file can't be opened or we are out of memory, and
+ * the other functions return 0 on a write error.  Close finishes the file and
+ * frees the writer.
+ */
+struct speedyTrackWriterStruct;  /* Defined internally in speedy_track.c */
+typedef struct speedyTrackWriterStruct* speedyTrackWriter;
+
+speedyTrackWriter speedyCreateTrackWriter(const char* file_name,
+                                          int sample_rate, int frame_step,
+                                          int feature_count);
+int speedyTrackWriteTension(speedyTrackWriter writer, int64_t at_time,
+                            float tension);
+int speedyTrackWriteFeatures(speedyTrackWriter writer, int64_t at_time,
+                             const float* features);
+int speedyCloseTrackWriter(speedyTrackWriter writer);
+
+/* A track read into memory.  speedyReadTrack returns NULL if the file can't
+ * be read or is not a track.
+ */
+struct speedyTrackStruct;  /* Defined internally in speedy_track.c */
+typedef struct speedyTrackStruct* speedyTrack;
+
+speedyTrack speedyReadTrack(const char* file_name);
+void speedyDestroyTrack(speedyTrack track);
+int speedyTrackSampleRate(speedyTrack track);
+int speedyTrackFrameStep(speedyTrack track);
+int speedyTrackFeatureCount(speedyTrack track);
+int64_t speedyTrackFrameCount(speedyTrack track);
+/* The tension and features of a frame, at_time < speedyTrackFrameCount().
+ * The features are NULL if the track has none.
+ */
+float speedyTrackTension(speedyTrack track, int64_t at_time);
+const float* speedyTrackFeatures(speedyTrack track, int64_t at_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPEEDY_SPEEDY_TRACK_H_ */
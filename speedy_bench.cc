@@ -0,0 +1,449 @@
+//  Copyright 2022 Google LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "third_party/speedy/sonic.h"
+#include "third_party/speedy/speedy/speedy.h"
+}
+
+/*
+ * Microbenchmarks for speedy and the sonic shim, run on a synthetic speech-like
+ * signal at 8, 16, 44.1 and 48 kHz.  Each result is printed on its own line as
+ * a JSON object, e.g.
+ *   {"benchmark": "speedySpectrogram/kiss", "sample_rate": 16000,
+ *    "channels": 1, "analysis_rate": 0, "kernels": "avx2", "frames": 1000,
+ *    "ns_per_frame": 1234.5, "realtime_factor": 8100.2, "allocations": 0}
+ * where a frame is one speedy frame step (10ms) of input, the spectrogram is
+ * timed with each FFT backend compiled in, the realtime factor is the seconds
+ * of audio processed per second, and the allocations are the malloc, calloc
+ * and realloc calls in the timed run (or -1 if not counted.)
+ * Each benchmark is run --repetitions times and the fastest run is reported.
+ * The results go to --output (stdout by default, where sonic also prints some
+ * messages of its own.)
+ *
+ *   make bench
+ *   ./speedy_bench --seconds 30 --filter sonic --output sonic.json
+ */
+
+double seconds = 10.0;          /* Of audio for each benchmark */
+int repetitions = 3;
+std::string filter;             /* Only run the benchmarks with this in name */
+FILE* results = stdout;
+
+/* Allocations are counted by linking with -Wl,--wrap=malloc (and calloc and
+ * realloc), as the bench target of the Makefile does.
+ */
+#ifdef SPEEDY_BENCH_COUNT_ALLOCATIONS
+std::atomic<long> allocation_count(0);
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  allocation_count++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  allocation_count++;
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+  allocation_count++;
+  return __real_realloc(pointer, size);
+}
+}
+
+/* The C++ library's operator new calls its own malloc, so count it here. */
+void* operator new(size_t size) {
+  void* pointer = malloc(size);
+  if (!pointer) throw std::bad_alloc();
+  return pointer;
+}
+
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+
+long allocations() { return allocation_count.load(); }
+#else
+long allocations() { return -1; }
+#endif
+
+/* A repeating pattern of 400ms of voiced sound (harmonics of a gliding pitch),
+ * 200ms of noise and 150ms of silence, with each channel a little quieter and
+ * later than the one before.  The samples are interleaved, in [-1, 1].
+ */
+void make_test_signal(int sample_rate, int channels,
+                      std::vector<float>* samples) {
+  const int length = (int)(seconds * sample_rate);
+  const double kTwoPi = 2.0 * M_PI;
+  samples->assign((size_t)length * channels, 0.0f);
+  uint32_t random_state = 12345;
+  double phase = 0.0;
+  for (int i = 0; i < length; i++) {
+    double t = (double)i / sample_rate;
+    double within = fmod(t, 0.75);
+    double value = 0.0;
+    if (within < 0.4) {
+      double pitch = 100.0 + 100.0 * within / 0.4;
+      phase += kTwoPi * pitch / sample_rate;
+      int harmonic;
+      for (harmonic = 1; harmonic * pitch < 0.45 * sample_rate &&
+                         harmonic <= 20; harmonic++) {
+        value += sin(harmonic * phase) / harmonic;
+      }
+      value *= 0.3 * sin(M_PI * within / 0.4);
+    } else if (within < 0.6) {
+      random_state = random_state * 1664525u + 1013904223u;
+      value = 0.2 * ((random_state >> 8) / 8388608.0 - 1.0);
+    }
+    int channel;
+    for (channel = 0; channel < channels; channel++) {
+      int delayed = i + channel * 7;
+      if (delayed < length) {
+        (*samples)[(size_t)delayed * channels + channel] =
+            (float)(value / (1.0 + 0.25 * channel));
+      }
+    }
+  }
+}
+
+/* Run setup(), time run(), and then call teardown(), repetitions times, and
+ * print the fastest run (unless the name doesn't match the filter.)  run()
+ * processes the given number of frames of frame_step samples.
+ */
+void run_benchmark(const char* name, int sample_rate, int channels,
+                   int analysis_rate, int64_t frames, int frame_step,
+                   const std::function<void()>& setup,
+                   const std::function<void()>& run,
+                   const std::function<void()>& teardown) {
+  if (!filter.empty() && !strstr(name, filter.c_str())) {
+    return;
+  }
+  double best_seconds = 0.0;
+  long best_allocations = -1;
+  int repetition;
+  for (repetition = 0; repetition < repetitions; repetition++) {
+    setup();
+    long allocations_before = allocations();
+    auto start = std::chrono::steady_clock::now();
+    run();
+    auto end = std::chrono::steady_clock::now();
+    long run_allocations = allocations() - allocations_before;
+    teardown();
+    double run_seconds = std::chrono::duration<double>(end - start).count();
+    if (repetition == 0 || run_seconds < best_seconds) {
+      best_seconds = run_seconds;
+      best_allocations = allocations_before < 0 ? -1 : run_allocations;
+    }
+  }
+  double audio_seconds = (double)frames * frame_step / sample_rate;
+  fprintf(results,
+          "{\"benchmark\": \"%s\", \"sample_rate\": %d, \"channels\": %d, "
+          "\"analysis_rate\": %d, \"kernels\": \"%s\", \"frames\": %lld, "
+          "\"ns_per_frame\": %.1f, \"realtime_factor\": %.1f, "
+          "\"allocations\": %ld}\n",
+          name, sample_rate, channels, analysis_rate, speedyKernelsName(),
+          (long long)frames, 1e9 * best_seconds / frames,
+          audio_seconds / best_seconds, best_allocations);
+  fflush(results);
+}
+
+/* The number of whole frames of speedy input in length samples. */
+int64_t frame_count(speedyStream stream, size_t length) {
+  size_t size = speedyInputFrameSize(stream);
+  size_t step = speedyInputFrameStep(stream);
+  return length < size ? 0 : (int64_t)((length - size) / step + 1);
+}
+
+void bench_spectrogram_with_fft(int sample_rate, int fft,
+                                const std::vector<float>& signal) {
+  speedyStream stream = NULL;
+  speedyStream probe = speedyCreateStream(sample_rate);
+  int64_t frames = frame_count(probe, signal.size());
+  int step = speedyInputFrameStep(probe);
+  speedyDestroyStream(probe);
+  std::string name = std::string("speedySpectrogram/") + speedyFFTName(fft);
+  run_benchmark(
+      name.c_str(), sample_rate, 1, 0, frames, step,
+      [&]() { stream = speedyCreateStreamWithFFT(sample_rate, 0, fft); },
+      [&]() {
+        int64_t t;
+        for (t = 0; t < frames; t++) {
+          speedySpectrogram(stream,
+                            const_cast<float*>(&signal[(size_t)t * step]));
+        }
+      },
+      [&]() { speedyDestroyStream(stream); });
+}
+
+/* With each FFT backend compiled in. */
+void bench_spectrogram(int sample_rate, const std::vector<float>& signal) {
+  for (int fft = kSpeedyFFTKiss; fft <= kSpeedyFFTPocketFFT; fft++) {
+    if (speedyFFTName(fft)) {
+      bench_spectrogram_with_fft(sample_rate, fft, signal);
+    }
+  }
+}
+
+/* The spectrogram of each frame, and its energy for the hysteresis. */
+void compute_spectrograms(int sample_rate, const std::vector<float>& signal,
+                          std::vector<std::vector<float>>* spectrograms,
+                          std::vector<float>* energies) {
+  speedyStream stream = speedyCreateStream(sample_rate);
+  int64_t frames = frame_count(stream, signal.size());
+  int step = speedyInputFrameStep(stream);
+  int size = speedySpectrogramSize(stream);
+  spectrograms->resize(frames);
+  energies->resize(frames);
+  int64_t t;
+  for (t = 0; t < frames; t++) {
+    float* spectrogram = speedySpectrogram(
+        stream, const_cast<float*>(&signal[(size_t)t * step]));
+    (*spectrograms)[t].assign(spectrogram, spectrogram + size);
+    double energy = 0.0;
+    int i;
+    for (i = 0; i < size; i++) {
+      energy += spectrogram[i] * spectrogram[i];
+    }
+    (*energies)[t] = (float)(energy / size);
+  }
+  speedyDestroyStream(stream);
+}
+
+void bench_spectral_difference(int sample_rate,
+                               const std::vector<float>& signal) {
+  std::vector<std::vector<float>> spectrograms;
+  std::vector<float> energies;
+  compute_spectrograms(sample_rate, signal, &spectrograms, &energies);
+  int64_t frames = spectrograms.size();
+  speedyStream stream = NULL;
+  run_benchmark(
+      "speedyComputeSpectralDifference", sample_rate, 1, 0, frames - 1,
+      sample_rate / 100, [&]() { stream = speedyCreateStream(sample_rate); },
+      [&]() {
+        /* As in the stream, the hysteresis is kTemporalHysteresisFuture
+         * frames ahead of the spectral difference.
+         */
+        int64_t t;
+        for (t = 0; t < frames + kTemporalHysteresisFuture; t++) {
+          if (t < frames) {
+            speedyAddToHysteresisBuffer(stream, energies[t], t);
+          }
+          int64_t at_time = t - kTemporalHysteresisFuture;
+          if (at_time >= 1) {
+            speedyComputeSpectralDifference(stream,
+                                            spectrograms[at_time].data(),
+                                            spectrograms[at_time - 1].data(),
+                                            at_time);
+          }
+        }
+      },
+      [&]() { speedyDestroyStream(stream); });
+}
+
+void bench_hysteresis(int sample_rate, const std::vector<float>& signal) {
+  std::vector<std::vector<float>> spectrograms;
+  std::vector<float> energies;
+  compute_spectrograms(sample_rate, signal, &spectrograms, &energies);
+  int64_t frames = energies.size();
+  speedyStream stream = NULL;
+  volatile float sink = 0.0f;
+  run_benchmark(
+      "speedyEvaluateHysteresis", sample_rate, 1, 0, frames,
+      sample_rate / 100, [&]() { stream = speedyCreateStream(sample_rate); },
+      [&]() {
+        int64_t t;
+        for (t = 0; t < frames + kTemporalHysteresisFuture; t++) {
+          if (t < frames) {
+            speedyAddToHysteresisBuffer(stream, energies[t], t);
+          }
+          int64_t at_time = t - kTemporalHysteresisFuture;
+          if (at_time >= 0) {
+            sink = sink + speedyEvaluateHysteresis(stream, at_time);
+          }
+        }
+      },
+      [&]() { speedyDestroyStream(stream); });
+}
+
+/* The whole analysis: speedyAddData() and speedyComputeTension(). */
+void bench_speedy_stream(int sample_rate, int analysis_rate,
+                         const std::vector<float>& signal) {
+  speedyStream stream = NULL;
+  speedyStream probe =
+      speedyCreateStreamWithAnalysisRate(sample_rate, analysis_rate);
+  int64_t frames = frame_count(probe, signal.size());
+  int step = speedyInputFrameStep(probe);
+  speedyDestroyStream(probe);
+  run_benchmark(
+      "speedyAddData+speedyComputeTension", sample_rate, 1, analysis_rate,
+      frames, step,
+      [&]() {
+        stream = speedyCreateStreamWithAnalysisRate(sample_rate,
+                                                    analysis_rate);
+      },
+      [&]() {
+        int64_t input_time, output_time = 0;
+        float tension;
+        for (input_time = 0; input_time < frames; input_time++) {
+          speedyAddData(stream, &signal[(size_t)input_time * step],
+                        input_time);
+          while (output_time <= input_time &&
+                 speedyComputeTension(stream, output_time, &tension)) {
+            output_time++;
+          }
+        }
+      },
+      [&]() { speedyDestroyStream(stream); });
+}
+
+/* sonicWriteShortToStream() end to end, at a nonlinear 3x, reading the output
+ * as it is made.
+ */
+void bench_sonic(int sample_rate, int channels, int analysis_rate,
+                 const std::vector<float>& samples) {
+  std::vector<short> input(samples.size());
+  size_t i;
+  for (i = 0; i < samples.size(); i++) {
+    input[i] = (short)lrintf(samples[i] * 32767.0f);
+  }
+  const int kChunkSize = 1024;      /* Samples per channel per write */
+  int length = (int)(input.size() / channels);
+  std::vector<short> output(kChunkSize * channels);
+  sonicStream stream = NULL;
+  int frame_step = sample_rate / 100;
+  run_benchmark(
+      "sonicWriteShortToStream", sample_rate, channels, analysis_rate,
+      length / frame_step, frame_step,
+      [&]() {
+        stream = sonicCreateStream(sample_rate, channels);
+        sonicSetSpeed(stream, 3.0f);
+        sonicEnableNonlinearSpeedup(stream, 1.0f, 0.0f);
+        if (analysis_rate) {
+          sonicSetNonlinearAnalysisRate(stream, analysis_rate);
+        }
+      },
+      [&]() {
+        int position;
+        for (position = 0; position < length; position += kChunkSize) {
+          int count = std::min(kChunkSize, length - position);
+          sonicWriteShortToStream(stream, &input[(size_t)position * channels],
+                                  count);
+          while (sonicReadShortFromStream(stream, output.data(), kChunkSize) >
+                 0) {
+          }
+        }
+        sonicFlushStream(stream);
+        while (sonicReadShortFromStream(stream, output.data(), kChunkSize) >
+               0) {
+        }
+      },
+      [&]() { sonicDestroyStream(stream); });
+}
+
+int main(int argc, char** argv) {
+  static const char* usage = "Usage: %s [--seconds 10] [--repetitions 3]\n"
+                "\t[--filter name] [--output results.json] [--scalar]\n";
+  int scalar = false;
+  while (1) {
+    static struct option long_options[] =
+      {
+        {"scalar",        no_argument, NULL, 'S'},  /* Scalar kernels */
+        {"seconds",       required_argument, NULL, 's'},
+        {"repetitions",   required_argument, NULL, 'r'},
+        {"filter",        required_argument, NULL, 'f'},
+        {"output",        required_argument, NULL, 'o'},
+        {"help",          no_argument, NULL, 'h'},
+        {0, 0, 0, 0}
+      };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "s:r:f:o:h", long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'S':
+        scalar = true;
+        break;
+    case 's':
+        seconds = strtod(optarg, NULL);
+        assert(seconds > 0.0);
+        break;
+    case 'r':
+        repetitions = atoi(optarg);
+        assert(repetitions > 0);
+        break;
+    case 'f':
+        filter = optarg;
+        break;
+    case 'o':
+        results = fopen(optarg, "w");
+        if (!results) {
+          fprintf(stderr, "Can't open %s\n", optarg);
+          exit(-1);
+        }
+        break;
+    default:
+        fprintf(stderr, usage, argv[0]);
+        exit(-1);
+    }
+  }
+  if (scalar) {
+    speedySelectKernels(kSpeedyKernelsScalar);
+  }
+
+  static const int kSampleRates[] = {8000, 16000, 44100, 48000};
+  static const int kChannelCounts[] = {1, 2, 6};
+  for (int sample_rate : kSampleRates) {
+    std::vector<float> mono;
+    make_test_signal(sample_rate, 1, &mono);
+    bench_spectrogram(sample_rate, mono);
+    bench_spectral_difference(sample_rate, mono);
+    bench_hysteresis(sample_rate, mono);
+    bench_speedy_stream(sample_rate, 0, mono);
+    if (sample_rate > kSpeedyDefaultAnalysisRate) {
+      bench_speedy_stream(sample_rate, kSpeedyDefaultAnalysisRate, mono);
+    }
+    for (int channels : kChannelCounts) {
+      std::vector<float> samples;
+      make_test_signal(sample_rate, channels, &samples);
+      bench_sonic(sample_rate, channels, 0, samples);
+      if (sample_rate > kSpeedyDefaultAnalysisRate) {
+        bench_sonic(sample_rate, channels, kSpeedyDefaultAnalysisRate,
+                    samples);
+      }
+    }
+  }
+  if (results != stdout) {
+    fclose(results);
+  }
+  return 0;
+}
@@ -13,19 +13,28 @@
 // limitations under the License.
 
 #include <assert.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <utility>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 extern "C" {
 #include "third_party/sonic/wave.h"
 #include "third_party/speedy/sonic.h"
 #include "third_party/speedy/speedy/speedy.h"
+#include "third_party/speedy/speedy/speedy_track.h"
 }
 
 double speed = 3.0;
@@ -33,6 +42,17 @@ double nonlinear = 1.0;
 double normalization_time = 0.0;   /* Seconds, 0 turns it off. */
 double desired_length = 0.0;
 int match_nonlinear = false;
+int single_pass = false;
+int analysis_rate = 0;             /* Hz, 0 analyzes at the input rate. */
+int num_threads = 1;               /* >1 compresses the file in chunks. */
+int lookahead = -1;                /* Frames, -1 is kTemporalHysteresisFuture */
+int lookahead_report = false;
+std::string write_track_name;      /* Save the tensions in this track file. */
+int track_features = false;        /* Save the features in it too. */
+speedyTrack read_track = NULL;     /* Render with these tensions. */
+int print_stats = false;           /* Print where the time went to stderr. */
+int fft_backend = kSpeedyFFTDefault;  /* One of the kSpeedyFFT* values */
+std::string fft_wisdom_name;       /* FFTW wisdom, read and saved again. */
 
 /*
  * A simple application that time-compresses one speech file.
@@ -58,68 +78,632 @@ int match_nonlinear = false;
    ../../blaze-bin/third_party/speedy/speedy_wave \
      --input test_data/tapestry.wav \
      --nonlinear 0.0 --speed 3 --match_nonlinear --output /tmp/tap_matched.wav
+   # Non-linear speedup of a long file, compressing chunks of it on 8 threads
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/lecture.wav --threads 8 \
+     --speed 3 --output /tmp/lecture_nonlinear.wav
+   # Analyze once, saving the tensions, then render another speed from them
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/tapestry.wav --write_track /tmp/tapestry.track \
+     --speed 2 --output /tmp/tap_2x.wav
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/tapestry.wav --read_track /tmp/tapestry.track \
+     --speed 3 --output /tmp/tap_3x.wav
+   # Where the time goes, per stage (with a library built with -DSPEEDY_STATS)
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/tapestry.wav --stats --speed 3 --output /tmp/tap_3x.wav
+   # With FFTW's measured plans, saving them for the next run
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/tapestry.wav --fft fftw_measure \
+     --fft_wisdom /tmp/speedy.wisdom --speed 3 --output /tmp/tap_3x.wav
+   # How much a 3 frame (30ms) lookahead changes the tension, for live use
+   ../../blaze-bin/third_party/speedy/speedy_wave \
+     --input test_data/tapestry.wav --lookahead 3 --lookahead_report
    # To see the computed tension and the resulting speedup, add these arguments
      --tension_file /tmp/tension.txt --speed_file /tmp/speed.txt
+   # or save them (and the features) as numpy arrays, with the frame times
+     --dump_format npy --tension_file /tmp/tension.npy \
+     --features_file /tmp/features.npy
 */
 
+/*
+ * The debug files (--tension_file etc.) get one record per frame.  With
+ * --dump_format text (the default) a record is a line of the values.  The f32
+ * and npy formats write float32 records (in this machine's byte order) of the
+ * frame time followed by the values; a float32 holds the frame times exactly
+ * for files up to 46 hours long.  An npy file is a 2D array with a row per
+ * record, and can be read with numpy.load().  Records are collected in a large
+ * stdio buffer, so the writes to the file are big.
+ */
+enum DumpFormat { kDumpText, kDumpFloat32, kDumpNpy };
+DumpFormat dump_format = kDumpText;
+
+const int kDumpBufferSize = 1 << 20;      /* bytes */
+const int kNpyHeaderSize = 128;           /* bytes, with room for any shape */
+
+struct DumpFile {
+  FILE* fp = NULL;
+  int width = 0;                          /* Values per record */
+  int64_t records = 0;
+  std::vector<char> buffer;               /* For stdio */
+  std::vector<float> record;              /* The next binary record */
+};
+
+void open_dump(DumpFile* dump, const char* file_name) {
+  dump->fp = fopen(file_name, "wb");
+  if (!dump->fp) {
+    std::cerr << "Can't open " << file_name << " for writing." << std::endl;
+    exit(-1);
+  }
+  dump->buffer.resize(kDumpBufferSize);
+  setvbuf(dump->fp, dump->buffer.data(), _IOFBF, dump->buffer.size());
+}
+
+/* Write (or rewrite, when closing) the header of an npy file. */
+void write_npy_header(DumpFile* dump) {
+  const uint16_t one = 1;
+  const bool little_endian = *reinterpret_cast<const uint8_t*>(&one) == 1;
+  char header[kNpyHeaderSize];
+  memset(header, ' ', sizeof(header));
+  memcpy(header, "\x93NUMPY\x01\x00", 8);
+  const uint16_t header_length = kNpyHeaderSize - 10;
+  header[8] = header_length & 0xff;
+  header[9] = header_length >> 8;
+  int length = snprintf(header + 10, header_length,
+                        "{'descr': '%s', 'fortran_order': False, "
+                        "'shape': (%lld, %d), }",
+                        little_endian ? "<f4" : ">f4",
+                        static_cast<long long>(dump->records), 1 + dump->width);
+  header[10 + length] = ' ';              /* Replace the snprintf 0 */
+  header[kNpyHeaderSize - 1] = '\n';
+  fseek(dump->fp, 0, SEEK_SET);
+  fwrite(header, sizeof(header), 1, dump->fp);
+}
+
+/* Write one record with the count values of the frame at time.  All the
+ * records in a file must have the same count.
+ */
+void write_dump(DumpFile* dump, int time, const float* values, int count) {
+  if (dump->records == 0) {
+    dump->width = count;
+    if (dump_format == kDumpNpy) {
+      write_npy_header(dump);
+    }
+  }
+  assert(count == dump->width);
+  dump->records++;
+  if (dump_format == kDumpText) {
+    if (count == 1) {
+      fprintf(dump->fp, "%g\n", values[0]);
+      return;
+    }
+    for (int i=0; i < count; i++) {
+      fprintf(dump->fp, "%g ", values[i]);
+    }
+    fprintf(dump->fp, "\n");
+    return;
+  }
+  dump->record.resize(1 + count);
+  dump->record[0] = static_cast<float>(time);
+  std::copy(values, values + count, dump->record.begin() + 1);
+  fwrite(dump->record.data(), sizeof(float), dump->record.size(), dump->fp);
+}
+
+/* Finish the file, filling in the shape of an npy array. */
+void close_dump(DumpFile* dump) {
+  if (!dump->fp) {
+    return;
+  }
+  if (dump_format == kDumpNpy) {
+    write_npy_header(dump);
+  }
+  if (fclose(dump->fp)) {
+    std::cerr << "Error writing a debug file." << std::endl;
+    exit(-1);
+  }
+  dump->fp = NULL;
+}
+
 
 /* Save the tension calculated by the libsonic2 (speedy) calculation.
  */
-FILE* tension_fp;
+DumpFile tension_dump;
+speedyTrackWriter track_writer;
 void tensionSaver(sonicStream myStream, int time, float tension) {
-  if (tension_fp) {
-    fprintf(tension_fp, "%g\n", tension);
+  if (tension_dump.fp) {
+    write_dump(&tension_dump, time, &tension, 1);
+  }
+  if (track_writer) {
+    speedyTrackWriteTension(track_writer, time, tension);
   }
 }
 
 /* Save the speedup request by the libsonic2 (speedy) calculation.  This number
  * is passed to libsonic, which will do its best to achieve this speedup.
  */
-FILE* speed_fp;
+DumpFile speed_dump;
 void speedSaver(sonicStream myStream, int time, float speed) {
-  if (speed_fp) {
-    fprintf(speed_fp, "%g\n", speed);
+  if (speed_dump.fp) {
+    write_dump(&speed_dump, time, &speed, 1);
   }
 }
 
 /* Save the features calculated by the libsonic2 (speedy) calculation.
  */
-FILE* features_fp;
+DumpFile features_dump;
 void featuresSaver(sonicStream myStream, int time, float *features) {
-  if (features_fp) {
-    for (int i=0; i < 15; i++) {
-      fprintf(features_fp, "%g ", features[i]);
-    }
-    fprintf(features_fp, "\n");
+  if (track_writer) {
+    speedyTrackWriteFeatures(track_writer, time, features);
+  }
+  if (features_dump.fp) {
+    write_dump(&features_dump, time, features, kFeatureValueCount);
   }
 }
 
 /* Save the spectrogram calculated by the libsonic2 (speedy) calculation.
  */
-FILE* spectrogram_fp;
+DumpFile spectrogram_dump;
 void spectrogramSaver(sonicStream myStream, int time, float *spectrogram) {
-  if (spectrogram_fp) {
-    int size = sonicSpectrogramSize(myStream);
-    for (int i=0; i < size; i++) {
-      fprintf(spectrogram_fp, "%g ", spectrogram[i]);
-    }
-    fprintf(spectrogram_fp, "\n");
+  if (spectrogram_dump.fp) {
+    write_dump(&spectrogram_dump, time, spectrogram,
+               sonicSpectrogramSize(myStream));
   }
 }
 
-FILE* normalized_spectrogram_fp;
+DumpFile normalized_spectrogram_dump;
 void normalizedSpectrogramSaver(sonicStream myStream, int time,
                                 float *spectrogram) {
-  if (normalized_spectrogram_fp) {
-    int size = sonicSpectrogramSize(myStream);
-    for (int i=0; i < size; i++) {
-      fprintf(normalized_spectrogram_fp, "%g ", spectrogram[i]);
+  if (normalized_spectrogram_dump.fp) {
+    write_dump(&normalized_spectrogram_dump, time, spectrogram,
+               sonicSpectrogramSize(myStream));
+  }
+}
+
+/* Render this stream from --read_track, if given, and start writing
+ * --write_track (when write_track is true.)  Call before writing any data.
+ */
+void use_tension_tracks(sonicStream mySonicStream, int sampleRate,
+                        bool write_track) {
+  if (read_track && !sonicSetNonlinearTensionTrack(mySonicStream,
+                                                   read_track)) {
+    std::cerr << "The tension track is not for " << sampleRate << "Hz audio." <<
+        std::endl;
+    exit(-1);
+  }
+  if (write_track && !write_track_name.empty()) {
+    track_writer = speedyCreateTrackWriter(
+        write_track_name.c_str(), sampleRate, getSonicBufferSize(mySonicStream),
+        track_features ? kFeatureValueCount : 0);
+    if (!track_writer) {
+      std::cerr << "Can't open " << write_track_name << " for the tension " <<
+          "track." << std::endl;
+      exit(-1);
+    }
+  }
+}
+
+/* Finish the --write_track file. */
+void finish_tension_track() {
+  if (track_writer) {
+    if (!speedyCloseTrackWriter(track_writer)) {
+      std::cerr << "Can't write " << write_track_name << "." << std::endl;
+      exit(-1);
+    }
+    track_writer = NULL;
+  }
+}
+
+/*
+ * The input file.  The samples of a 16-bit PCM wave file are used in place by
+ * mapping the file into memory, so the input can be written to sonic in big
+ * spans without copying it, and finding its length only reads the header.
+ * Other files, or if mapping fails, are read into memory with
+ * readFromWaveFile().  Sonic is given (and asked for) kBlockFrames at a time.
+ */
+const int kBlockFrames = 1 << 16;
+
+struct WaveInput {
+  const int16_t* samples = NULL;     /* Interleaved */
+  int frameCount = 0;
+  int sampleRate = 0;
+  int numChannels = 0;
+  void* map = NULL;                  /* The mapped file, if any */
+  size_t mapLength = 0;
+  std::vector<int16_t> copy;         /* Or the samples read into memory */
+};
+
+static uint32_t get_le32(const uint8_t* bytes) {
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint16_t get_le16(const uint8_t* bytes) {
+  return (uint16_t)(bytes[0] | bytes[1] << 8);
+}
+
+/* Find the format and the samples of a 16-bit PCM wave file in the mapped
+ * file.  Return false if it is anything else.
+ */
+bool parse_mapped_wave(WaveInput* wave) {
+  const uint8_t* file = static_cast<const uint8_t*>(wave->map);
+  size_t length = wave->mapLength;
+  if (length < 12 || memcmp(file, "RIFF", 4) || memcmp(file + 8, "WAVE", 4)) {
+    return false;
+  }
+  bool haveFormat = false;
+  size_t position = 12;
+  while (position + 8 <= length) {
+    const uint8_t* chunk = file + position;
+    size_t chunkSize = get_le32(chunk + 4);
+    position += 8;
+    if (!memcmp(chunk, "fmt ", 4)) {
+      if (chunkSize < 16 || position + 16 > length ||
+          get_le16(chunk + 8) != 1 ||          /* PCM */
+          get_le16(chunk + 22) != 16) {        /* bits per sample */
+        return false;
+      }
+      wave->numChannels = get_le16(chunk + 10);
+      wave->sampleRate = get_le32(chunk + 12);
+      haveFormat = wave->numChannels > 0 && wave->sampleRate > 0;
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!haveFormat || position % 2) {
+        return false;
+      }
+      /* Streamed files may not have the final data size. */
+      chunkSize = std::min(chunkSize, length - position);
+      size_t frameCount = chunkSize/(2*wave->numChannels);
+      if (frameCount > (size_t)INT32_MAX) {
+        return false;
+      }
+      wave->samples = reinterpret_cast<const int16_t*>(file + position);
+      wave->frameCount = frameCount;
+      return true;
+    }
+    position += chunkSize + (chunkSize & 1);  /* Chunks are word aligned */
+  }
+  return false;
+}
+
+/* Map a 16-bit PCM wave file.  Return false if we can't. */
+bool map_wave_file(const std::string& input_file_name, WaveInput* wave) {
+  const uint16_t one = 1;
+  if (*reinterpret_cast<const uint8_t*>(&one) != 1) {
+    return false;                            /* The samples are little-endian */
+  }
+  int fd = open(input_file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) || status.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  wave->mapLength = status.st_size;
+  wave->map = mmap(NULL, wave->mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (wave->map == MAP_FAILED) {
+    wave->map = NULL;
+    return false;
+  }
+  if (!parse_mapped_wave(wave)) {
+    munmap(wave->map, wave->mapLength);
+    wave->map = NULL;
+    return false;
+  }
+  madvise(wave->map, wave->mapLength, MADV_SEQUENTIAL);
+  return true;
+}
+
+/* Read the whole (interleaved) input file into memory. */
+void read_whole_wave(const std::string& input_file_name, WaveInput* wave) {
+  waveFile waveInputFp = openInputWaveFile(input_file_name.c_str(),
+                                           &wave->sampleRate,
+                                           &wave->numChannels);
+  if (!waveInputFp) {
+    std::cerr << "Can't open " << input_file_name << " for speedy input." <<
+        std::endl;
+    exit(-1);
+  }
+  std::vector<int16_t>& input = wave->copy;
+  int totalFrames = 0, framesRead;
+  do {
+    input.resize((size_t)(totalFrames + kBlockFrames)*wave->numChannels);
+    framesRead = readFromWaveFile(waveInputFp,
+                                  input.data() + (size_t)totalFrames*
+                                                 wave->numChannels,
+                                  kBlockFrames);
+    totalFrames += framesRead;
+  } while (framesRead > 0);
+  input.resize((size_t)totalFrames*wave->numChannels);
+  closeWaveFile(waveInputFp);
+  wave->samples = input.data();
+  wave->frameCount = totalFrames;
+}
+
+/* Map or read the input file (and exit if we can't.) */
+void open_wave_input(const std::string& input_file_name, WaveInput* wave) {
+  if (!map_wave_file(input_file_name, wave)) {
+    read_whole_wave(input_file_name, wave);
+  }
+}
+
+void close_wave_input(WaveInput* wave) {
+  if (wave->map) {
+    munmap(wave->map, wave->mapLength);
+    wave->map = NULL;
+  }
+  wave->copy.clear();
+  wave->samples = NULL;
+}
+
+/* Apply --lookahead to a new stream. */
+void set_lookahead(sonicStream mySonicStream) {
+  if (lookahead >= 0 &&
+      !sonicSetNonlinearHysteresis(mySonicStream, kTemporalHysteresisFuture,
+                                   kTemporalHysteresisPast, lookahead)) {
+    std::cerr << "Can't look ahead " << lookahead << " frames." << std::endl;
+    exit(-1);
+  }
+}
+
+void set_fft(sonicStream mySonicStream) {
+  if (fft_backend != kSpeedyFFTDefault &&
+      !sonicSetNonlinearFFT(mySonicStream, fft_backend)) {
+    std::cerr << "Can't use the " << speedyFFTName(fft_backend) << " FFT." <<
+        std::endl;
+    exit(-1);
+  }
+}
+
+/* For --fft_wisdom, keep the FFTW plans (with --fft fftw_measure) for the
+ * next run.
+ */
+void save_fft_wisdom() {
+  if (fft_wisdom_name.length() > 0 &&
+      !speedyExportFFTWisdom(fft_wisdom_name.c_str())) {
+    std::cerr << "Can't save the FFT wisdom in " << fft_wisdom_name << "." <<
+        std::endl;
+  }
+}
+
+/*
+ * Parallel (chunked) compression, for --threads.
+ *
+ * The input is split into one chunk per thread, at quiet frames near the
+ * equally spaced split points, and each chunk is compressed by its own sonic
+ * stream.  So that the speedy analysis of each chunk starts out (nearly) where
+ * it would be in one pass over the whole file, each stream first analyzes some
+ * preroll audio before the chunk, and some audio after the chunk so the
+ * hysteresis can see kTemporalHysteresisFuture frames ahead.  Only the chunk
+ * itself is output (see sonicSetNonlinearOutputRange), and the outputs are
+ * concatenated.
+ *
+ * The only state speedy carries from frame to frame is in first order filters
+ * (the energy and spectral difference averages, with a 1 second time constant,
+ * and the tension normalization with normalization_time), the hysteresis
+ * buffer and the previous spectrogram.  The last two are filled by the
+ * preroll.  The preroll is kChunkPrerollTimeConstants times the longest time
+ * constant, so at the start of a chunk the filter states differ from their
+ * one-pass values by less than exp(-8) (0.03%) of their difference at the
+ * start of the preroll.  The tensions then differ by the same fraction, and
+ * the output by at most a SOLA pitch period at each chunk boundary (which is
+ * at a quiet frame.)
+ */
+const double kChunkPrerollTimeConstants = 8.0;
+const double kChunkSplitSearchTime = 2.0;  /* seconds, each way */
+
+/*
+ * Return the first speedy frame of each chunk.  Speedy flags quiet frames
+ * (s_low_energy_frame) only as part of the full analysis, so here we look
+ * for the quietest frame (by the energy of it and its neighbors, so the
+ * split is inside a pause) within kChunkSplitSearchTime of each of the
+ * equally spaced split points.
+ */
+std::vector<int> find_chunk_starts(const int16_t* input, int numChannels,
+                                   int frameCount, int frameStep,
+                                   double framesPerSecond, int chunkCount) {
+  std::vector<double> energy(frameCount, 0.0);
+  for (int f = 0; f < frameCount; f++) {
+    for (int i = f*frameStep; i < (f+1)*frameStep; i++) {
+      double sum = 0.0;
+      for (int c = 0; c < numChannels; c++) {
+        sum += input[(size_t)i*numChannels + c];
+      }
+      sum /= numChannels;
+      energy[f] += sum*sum;
     }
-    fprintf(normalized_spectrogram_fp, "\n");
   }
+  std::vector<int> starts(1, 0);
+  int searchFrames = (int)(kChunkSplitSearchTime*framesPerSecond);
+  searchFrames = std::min(searchFrames, frameCount/chunkCount/4);
+  for (int k = 1; k < chunkCount; k++) {
+    int nominal = (int)((int64_t)frameCount*k/chunkCount);
+    int best = nominal;
+    double bestEnergy = -1;
+    for (int f = std::max(nominal - searchFrames, starts.back() + 1);
+         f <= std::min(nominal + searchFrames, frameCount - 2); f++) {
+      double e = energy[f-1] + energy[f] + energy[f+1];
+      if (bestEnergy < 0 || e < bestEnergy) {
+        best = f;
+        bestEnergy = e;
+      }
+    }
+    if (best > starts.back()) {
+      starts.push_back(best);
+    }
+  }
+  return starts;
+}
+
+/* For --stats, print the stream's totals (see sonicGetNonlinearStats().) */
+void report_stats(sonicStream mySonicStream) {
+  if (!print_stats) {
+    return;
+  }
+  speedyStats analysis;
+  sonicNonlinearStats shim;
+  int timed = sonicGetNonlinearSpeedyStats(mySonicStream, &analysis);
+  sonicGetNonlinearStats(mySonicStream, &shim);
+  fprintf(stderr, "Analyzed %lld frames (%lld silent), computed %lld tensions, "
+          "skipped %lld low energy frames.\n",
+          (long long)analysis.frames_analyzed,
+          (long long)analysis.silent_frames,
+          (long long)analysis.tensions_computed,
+          (long long)analysis.skipped_frames);
+  if (timed) {
+    fprintf(stderr, "Milliseconds: resample %.1f, preemphasis %.1f, FFT %.1f, "
+            "local energy %.1f, hysteresis %.1f, spectral difference %.1f, "
+            "SOLA %.1f.\n", analysis.resample_ns/1e6,
+            analysis.preemphasis_ns/1e6, analysis.fft_ns/1e6,
+            analysis.local_energy_ns/1e6, analysis.hysteresis_ns/1e6,
+            analysis.spectral_difference_ns/1e6, shim.solaNanoseconds/1e6);
+  } else {
+    fprintf(stderr, "(Build with -DSPEEDY_STATS for the times.)\n");
+  }
+  fprintf(stderr, "Sent %lld buffers to SOLA, held at most %d of %d, "
+          "allocated %lld bytes.\n", (long long)shim.buffersToSola,
+          shim.maxHeldBuffers, shim.bufferCount,
+          (long long)shim.bytesAllocated);
 }
 
+/* Compress input samples [chunkStart, chunkEnd) into output, analyzing
+ * [analysisStart, analysisEnd) so the analysis is warmed up.
+ */
+void compress_chunk(const int16_t* input, int sampleRate, int numChannels,
+                    int analysisStart, int chunkStart, int chunkEnd,
+                    int analysisEnd, double speed, double nonlinear,
+                    double normalization_time, std::vector<int16_t>* output) {
+  sonicStream mySonicStream = sonicCreateStream(sampleRate, numChannels);
+  if (analysis_rate > 0 &&
+      !sonicSetNonlinearAnalysisRate(mySonicStream, analysis_rate)) {
+    std::cerr << "Can't analyze at " << analysis_rate << "Hz." << std::endl;
+    exit(-1);
+  }
+  set_lookahead(mySonicStream);
+  set_fft(mySonicStream);
+  sonicSetSpeed(mySonicStream, speed);
+  sonicEnableNonlinearSpeedup(mySonicStream, nonlinear > 0.0,
+                              normalization_time);
+  sonicSetNonlinearOutputRange(mySonicStream, chunkStart - analysisStart,
+                               chunkEnd < analysisEnd ?
+                               chunkEnd - analysisStart : -1);
+  int16_t* outputBuffer = new int16_t[numChannels*kBlockFrames];
+  int samplesRead;
+  for (int i = analysisStart; i < analysisEnd; i += kBlockFrames) {
+    int count = std::min(kBlockFrames, analysisEnd - i);
+    if (sonicWriteShortToStream(mySonicStream,
+                                const_cast<int16_t*>(
+                                    input + (size_t)i*numChannels),
+                                count) <= 0) {
+      std::cerr << "Tried writing " << count << "samples to " <<
+          "sonicWrite and failed." << std::endl;
+      exit(-1);
+    }
+    while ((samplesRead = sonicReadShortFromStream(mySonicStream, outputBuffer,
+                                                   kBlockFrames)) > 0) {
+      output->insert(output->end(), outputBuffer,
+                     outputBuffer + samplesRead*numChannels);
+    }
+  }
+  sonicFlushStream(mySonicStream);
+  while ((samplesRead = sonicReadShortFromStream(mySonicStream, outputBuffer,
+                                                 kBlockFrames)) > 0) {
+    output->insert(output->end(), outputBuffer,
+                   outputBuffer + samplesRead*numChannels);
+  }
+  delete[] outputBuffer;
+  sonicDestroyStream(mySonicStream);
+}
+
+/* Like compress_sound, but compress chunks of the file on num_threads threads
+ * (see above.)  The debug files (tension, features...) and the tension
+ * track are not written.
+ */
+double compress_sound_in_chunks(const std::string& input_file_name,
+                                double speed, double nonlinear,
+                                double normalization_time,
+                                const std::string &output_file_name) {
+  WaveInput wave;
+  open_wave_input(input_file_name, &wave);
+  const int sampleRate = wave.sampleRate, numChannels = wave.numChannels;
+  const int totalFrames = wave.frameCount;
+  printf("Read %d channel data at a sample rate of %d.\n",
+         numChannels, sampleRate);
+
+  sonicStream probe = sonicCreateStream(sampleRate, numChannels);
+  const int frameStep = getSonicBufferSize(probe);
+  sonicDestroyStream(probe);
+  const int speedyFrames = totalFrames/frameStep;
+  const double framesPerSecond = (double)sampleRate/frameStep;
+  const int prerollFrames = (int)ceil(kChunkPrerollTimeConstants*
+                                      framesPerSecond*
+                                      std::max(1.0, normalization_time));
+  const int postrollFrames = 2*kTemporalHysteresisFuture;
+  int chunkCount = std::max(1, std::min(num_threads,
+                                        speedyFrames/(2*prerollFrames)));
+  std::vector<int> starts = find_chunk_starts(wave.samples, numChannels,
+                                              speedyFrames, frameStep,
+                                              framesPerSecond, chunkCount);
+  chunkCount = starts.size();
+  printf("Compressing %d chunks on %d threads.\n", chunkCount, num_threads);
+  if (tension_dump.fp || speed_dump.fp || features_dump.fp ||
+      spectrogram_dump.fp || normalized_spectrogram_dump.fp ||
+      !write_track_name.empty()) {
+    printf("The tension, speed, features, spectrogram and track files are "
+           "not written with --threads.\n");
+  }
+
+  std::vector<std::vector<int16_t>> outputs(chunkCount);
+  std::atomic<int> nextChunk(0);
+  auto worker = [&]() {
+    int k;
+    while ((k = nextChunk++) < chunkCount) {
+      int chunkStart = starts[k]*frameStep;
+      int chunkEnd = k+1 < chunkCount ? starts[k+1]*frameStep : totalFrames;
+      int analysisStart = std::max(0, chunkStart - prerollFrames*frameStep);
+      int analysisEnd = std::min(totalFrames,
+                                 chunkEnd + postrollFrames*frameStep);
+      compress_chunk(wave.samples, sampleRate, numChannels, analysisStart,
+                     chunkStart, chunkEnd, analysisEnd, speed, nonlinear,
+                     normalization_time, &outputs[k]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 0; t < std::min(num_threads, chunkCount); t++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  close_wave_input(&wave);
 
+  int totalFramesProducedBySpeedy = 0;
+  waveFile waveOutputFp = NULL;
+  if (!output_file_name.empty()) {
+    waveOutputFp = openOutputWaveFile(output_file_name.c_str(),
+                                      sampleRate, numChannels);
+    if (!waveOutputFp) {
+      std::cerr << "Can't open " << output_file_name << " for speedy output." <<
+          std::endl;
+      exit(-1);
+    }
+  }
+  for (auto& output : outputs) {
+    int frames = output.size()/numChannels;
+    totalFramesProducedBySpeedy += frames;
+    if (waveOutputFp) {
+      writeToWaveFile(waveOutputFp, output.data(), frames);
+    }
+  }
+  if (waveOutputFp) {
+    closeWaveFile(waveOutputFp);
+  }
+  printf("Compress_sound read %d frames, and output %d frames with "
+         "nonlinear=%g.\n",
+         totalFrames, totalFramesProducedBySpeedy, nonlinear);
+  return static_cast<double>(totalFrames) / totalFramesProducedBySpeedy;
+}
 
 /*
  * Compress a sound and return the actual compression length.
@@ -148,24 +732,30 @@ void normalizedSpectrogramSaver(sonicStream myStream, int time,
 double compress_sound(const std::string& input_file_name, double speed,
                       double nonlinear, double normalization_time,
                       const std::string &output_file_name) {
-  int sampleRate, numChannels, totalFramesReadFromWave = 0;
+  if (num_threads > 1 && nonlinear > 0.0 && !read_track) {
+    return compress_sound_in_chunks(input_file_name, speed, nonlinear,
+                                    normalization_time, output_file_name);
+  }
+  int totalFramesReadFromWave = 0;
   int totalFramesProducedBySpeedy = 0;
-  const int maxSamples = 1000;
 
   waveFile waveOutputFp = NULL;
-  waveFile waveInputFp = openInputWaveFile(input_file_name.c_str(),
-                                           &sampleRate, &numChannels);
-  if (!waveInputFp) {
-    std::cerr << "Can't open " << input_file_name << " for speedy input." <<
-        std::endl;
-    exit(-1);
-  }
+  WaveInput wave;
+  open_wave_input(input_file_name, &wave);
+  const int sampleRate = wave.sampleRate, numChannels = wave.numChannels;
   printf("Read %d channel data at a sample rate of %d.\n",
          numChannels, sampleRate);
-  int16_t* inputBuffer = new int16_t[numChannels*maxSamples];
-  int16_t* outputBuffer = new int16_t[numChannels*maxSamples];
+  int16_t* outputBuffer = new int16_t[numChannels*kBlockFrames];
 
   sonicStream mySonicStream = sonicCreateStream(sampleRate, numChannels);
+  if (analysis_rate > 0 &&
+      !sonicSetNonlinearAnalysisRate(mySonicStream, analysis_rate)) {
+    std::cerr << "Can't analyze " << input_file_name << " at " <<
+        analysis_rate << "Hz." << std::endl;
+    exit(-1);
+  }
+  set_lookahead(mySonicStream);
+  set_fft(mySonicStream);
   sonicSetSpeed(mySonicStream, speed);
   /* TODO(malcolmslaney) - Hook up argument for tension normalization */
   sonicEnableNonlinearSpeedup(mySonicStream, nonlinear > 0.0,
@@ -179,6 +769,8 @@ double compress_sound(const std::string& input_file_name, double speed,
     sonicNormalizedSpectrogramCallback(mySonicStream,
                                        normalizedSpectrogramSaver);
   }
+  use_tension_tracks(mySonicStream, sampleRate,
+                     nonlinear > 0.0 && !output_file_name.empty());
 
   if (!output_file_name.empty()) {
     waveOutputFp = openOutputWaveFile(output_file_name.c_str(),
@@ -189,44 +781,46 @@ double compress_sound(const std::string& input_file_name, double speed,
       exit(-1);
     }
   }
-  int soundFramesFromWave;
-  while (1) {
-    /* numSamples and maxSamples are the number of **multi-channel** samples */
-    soundFramesFromWave = readFromWaveFile(waveInputFp, inputBuffer,
-                                           maxSamples);
-    if (soundFramesFromWave == 0) break;
-    totalFramesReadFromWave += soundFramesFromWave;
-    int samples_written = sonicWriteShortToStream(mySonicStream, inputBuffer,
-                                                  soundFramesFromWave);
+  int soundFramesFromSpeedy;
+  while (totalFramesReadFromWave < wave.frameCount) {
+    /* Frame counts are the number of **multi-channel** samples */
+    int count = std::min(kBlockFrames,
+                         wave.frameCount - totalFramesReadFromWave);
+    int samples_written = sonicWriteShortToStream(
+        mySonicStream,
+        const_cast<int16_t*>(wave.samples) +
+        (size_t)totalFramesReadFromWave*numChannels, count);
     if (samples_written <= 0) {
-      std::cerr << "Tried writing " << soundFramesFromWave << "samples to " <<
+      std::cerr << "Tried writing " << count << "samples to " <<
           "sonicWrite and failed." << std::endl;
       exit(-1);
     }
-    /* Check to see if there is anything ready to be read (i.e. processed.) */
-    int soundSamplesFromSpeedy = sonicReadShortFromStream(mySonicStream,
-                                                          outputBuffer,
-                                                          maxSamples);
-    totalFramesProducedBySpeedy += soundSamplesFromSpeedy;
-    if (waveOutputFp) {
-      writeToWaveFile(waveOutputFp, outputBuffer, soundSamplesFromSpeedy);
+    totalFramesReadFromWave += count;
+    /* Get everything that is ready to be read (i.e. processed.) */
+    while ((soundFramesFromSpeedy = sonicReadShortFromStream(
+                mySonicStream, outputBuffer, kBlockFrames)) > 0) {
+      totalFramesProducedBySpeedy += soundFramesFromSpeedy;
+      if (waveOutputFp) {
+        writeToWaveFile(waveOutputFp, outputBuffer, soundFramesFromSpeedy);
+      }
     }
   }
-  closeWaveFile(waveInputFp);
+  close_wave_input(&wave);
 
   sonicFlushStream(mySonicStream);
-  do {
-    soundFramesFromWave = sonicReadShortFromStream(mySonicStream, outputBuffer,
-                                                maxSamples);
-    totalFramesProducedBySpeedy += soundFramesFromWave;
+  while ((soundFramesFromSpeedy = sonicReadShortFromStream(
+              mySonicStream, outputBuffer, kBlockFrames)) > 0) {
+    totalFramesProducedBySpeedy += soundFramesFromSpeedy;
     if (waveOutputFp) {
-      writeToWaveFile(waveOutputFp, outputBuffer, soundFramesFromWave);
+      writeToWaveFile(waveOutputFp, outputBuffer, soundFramesFromSpeedy);
     }
-  } while (soundFramesFromWave > 0);
+  }
   if (waveOutputFp) {
     closeWaveFile(waveOutputFp);
   }
   delete[] outputBuffer;
+  report_stats(mySonicStream);
+  finish_tension_track();
   /* Return the actual speedup */
   printf("Compress_sound read %d frames, and output %d frames with "
          "nonlinear=%g.\n",
@@ -235,13 +829,226 @@ double compress_sound(const std::string& input_file_name, double speed,
                              totalFramesProducedBySpeedy;
 }
 
+/*
+ * Compress a sound to a total length of desired_length seconds in one pass
+ * (--length with --single_pass), instead of measuring the speedup of a first
+ * pass and correcting the speed for a second one.
+ *
+ * This is a closed loop: every kLengthControlInterval of input the global
+ * speed is set so the rest of the input would fill the rest of the desired
+ * length.  The non-linear speedup doesn't achieve exactly the requested global
+ * speed, so the speed is divided by the gain (achieved over requested
+ * speedup) measured from the frames written and read so far.  The input
+ * frames the analysis still holds back (see sonicGetNonlinearLatency) are not
+ * counted yet.
+ *
+ * Returns the actual achieved speedup, like compress_sound.
+ */
+const double kLengthControlInterval = 0.5;  /* seconds of input */
+
+double compress_sound_to_length(const std::string& input_file_name,
+                                double desired_length, double nonlinear,
+                                double normalization_time,
+                                const std::string &output_file_name) {
+  const int maxSamples = 1000;     /* Small, so the speed is updated often */
+  WaveInput wave;
+  open_wave_input(input_file_name, &wave);
+  const int sampleRate = wave.sampleRate, numChannels = wave.numChannels;
+  const int totalFrames = wave.frameCount;
+  const int desiredFrames = (int)(desired_length*sampleRate);
+  double globalSpeed = static_cast<double>(totalFrames) / desiredFrames;
+  printf("Read %d frames, and trying to speed up with a factor of %g.\n",
+         totalFrames, globalSpeed);
+
+  sonicStream mySonicStream = sonicCreateStream(sampleRate, numChannels);
+  if (analysis_rate > 0 &&
+      !sonicSetNonlinearAnalysisRate(mySonicStream, analysis_rate)) {
+    std::cerr << "Can't analyze " << input_file_name << " at " <<
+        analysis_rate << "Hz." << std::endl;
+    exit(-1);
+  }
+  set_lookahead(mySonicStream);
+  set_fft(mySonicStream);
+  sonicSetSpeed(mySonicStream, globalSpeed);
+  sonicEnableNonlinearSpeedup(mySonicStream, nonlinear > 0.0,
+                              normalization_time);
+  if (nonlinear > 0.0) {
+    sonicTensionCallback(mySonicStream, tensionSaver);
+    sonicSpeedCallback(mySonicStream, speedSaver);
+    sonicFeaturesCallback(mySonicStream, featuresSaver);
+    sonicSpectrogramCallback(mySonicStream, spectrogramSaver);
+    sonicNormalizedSpectrogramCallback(mySonicStream,
+                                       normalizedSpectrogramSaver);
+  }
+  use_tension_tracks(mySonicStream, sampleRate, nonlinear > 0.0);
+  waveFile waveOutputFp = openOutputWaveFile(output_file_name.c_str(),
+                                             sampleRate, numChannels);
+  if (!waveOutputFp) {
+    std::cerr << "Can't open " << output_file_name << " for speedy output." <<
+        std::endl;
+    exit(-1);
+  }
+
+  int16_t* outputBuffer = new int16_t[numChannels*maxSamples];
+  int framesWritten = 0, framesProduced = 0, samplesRead;
+  int nextControl = (int)(kLengthControlInterval*sampleRate);
+  double gain = 1.0;
+  while (framesWritten < totalFrames) {
+    int count = std::min(maxSamples, totalFrames - framesWritten);
+    if (sonicWriteShortToStream(mySonicStream,
+                                const_cast<int16_t*>(wave.samples) +
+                                (size_t)framesWritten*numChannels,
+                                count) <= 0) {
+      std::cerr << "Tried writing " << count << "samples to " <<
+          "sonicWrite and failed." << std::endl;
+      exit(-1);
+    }
+    framesWritten += count;
+    while ((samplesRead = sonicReadShortFromStream(mySonicStream, outputBuffer,
+                                                   maxSamples)) > 0) {
+      framesProduced += samplesRead;
+      writeToWaveFile(waveOutputFp, outputBuffer, samplesRead);
+    }
+    int heldBackFrames = sonicGetNonlinearLatency(mySonicStream)*
+                         getSonicBufferSize(mySonicStream);
+    int framesConsumed = framesWritten - heldBackFrames;
+    if (framesWritten >= nextControl && framesConsumed > 0 &&
+        framesProduced > 0) {
+      nextControl += (int)(kLengthControlInterval*sampleRate);
+      gain = static_cast<double>(framesConsumed) / framesProduced /
+             globalSpeed;
+      int remainingOutput = desiredFrames - framesProduced;
+      double neededSpeed = remainingOutput > 0 ?
+          static_cast<double>(totalFrames - framesConsumed) / remainingOutput :
+          4.0*totalFrames/desiredFrames;
+      /* Limit the speed to a sensible range around the initial guess. */
+      globalSpeed = std::max(0.25*totalFrames/desiredFrames,
+                             std::min(4.0*totalFrames/desiredFrames,
+                                      neededSpeed/gain));
+      sonicSetSpeed(mySonicStream, globalSpeed);
+    }
+  }
+  close_wave_input(&wave);
+  sonicFlushStream(mySonicStream);
+  while ((samplesRead = sonicReadShortFromStream(mySonicStream, outputBuffer,
+                                                 maxSamples)) > 0) {
+    framesProduced += samplesRead;
+    writeToWaveFile(waveOutputFp, outputBuffer, samplesRead);
+  }
+  closeWaveFile(waveOutputFp);
+  delete[] outputBuffer;
+  report_stats(mySonicStream);
+  sonicDestroyStream(mySonicStream);
+  finish_tension_track();
+  printf("Compressed %d frames to %d frames (%g seconds, %g wanted) with "
+         "nonlinear=%g.\n", totalFrames, framesProduced,
+         static_cast<double>(framesProduced)/sampleRate, desired_length,
+         nonlinear);
+  return static_cast<double>(totalFrames) / framesProduced;
+}
+
+void close_dumps() {
+  close_dump(&tension_dump);
+  close_dump(&speed_dump);
+  close_dump(&features_dump);
+  close_dump(&spectrogram_dump);
+  close_dump(&normalized_spectrogram_dump);
+}
+
+/*
+ * For --lookahead_report: analyze the input with the full lookahead and with
+ * --lookahead frames, and print how much the tensions (and the speeds, at
+ * --speed) of the shorter lookahead differ from the full ones.  The input is
+ * averaged to mono, like the sonic shim does.
+ */
+void report_lookahead_error(const std::string& input_file_name) {
+  WaveInput wave;
+  open_wave_input(input_file_name, &wave);
+  const int numChannels = wave.numChannels;
+  speedyStream streams[2];
+  for (int k = 0; k < 2; k++) {
+    streams[k] = speedyCreateStreamWithFFT(wave.sampleRate, analysis_rate,
+                                           fft_backend);
+    if (!streams[k]) {
+      std::cerr << "Can't create the speedy streams." << std::endl;
+      exit(-1);
+    }
+    if (normalization_time > 0.0) {
+      speedyUpdateTensionNormalization(streams[k], normalization_time);
+    }
+  }
+  const int shortLookahead = lookahead >= 0 ? lookahead :
+                                              kTemporalHysteresisFuture;
+  if (!speedySetHysteresis(streams[1], kTemporalHysteresisFuture,
+                           kTemporalHysteresisPast, shortLookahead)) {
+    std::cerr << "Can't look ahead " << shortLookahead << " frames." <<
+        std::endl;
+    exit(-1);
+  }
+  const int frameStep = speedyInputFrameStep(streams[0]);
+  const int frameSize = speedyInputFrameSize(streams[0]);
+  std::vector<int16_t> frame(frameSize);
+  std::vector<float> tensions[2];
+  for (int64_t t = 0; t*frameStep + frameSize <= wave.frameCount; t++) {
+    const int16_t* input = wave.samples + (size_t)t*frameStep*numChannels;
+    for (int i = 0; i < frameSize; i++) {
+      int sum = 0;
+      for (int c = 0; c < numChannels; c++) {
+        sum += input[i*numChannels + c];
+      }
+      frame[i] = sum/numChannels;
+    }
+    for (int k = 0; k < 2; k++) {
+      float tension;
+      speedyAddDataShort(streams[k], frame.data(), t);
+      while (speedyComputeTension(streams[k], tensions[k].size(), &tension)) {
+        tensions[k].push_back(tension);
+      }
+    }
+  }
+  close_wave_input(&wave);
+  speedyDestroyStream(streams[0]);
+  speedyDestroyStream(streams[1]);
+
+  const size_t frameCount = std::min(tensions[0].size(), tensions[1].size());
+  double squaredError = 0.0, maxError = 0.0, speedError = 0.0;
+  size_t largeErrors = 0;
+  for (size_t t = 0; t < frameCount; t++) {
+    double error = std::fabs(tensions[1][t] - tensions[0][t]);
+    squaredError += error*error;
+    maxError = std::max(maxError, error);
+    largeErrors += error > 0.1;
+    speedError += std::fabs(speedyComputeSpeedFromTension(tensions[1][t],
+                                                          speed) -
+                            speedyComputeSpeedFromTension(tensions[0][t],
+                                                          speed));
+  }
+  const double frameTime = 1000.0*frameStep/wave.sampleRate;   /* ms */
+  printf("Compared %zu frames, looking ahead %d frames (%gms) instead of %d "
+         "(%gms).\n", frameCount, shortLookahead, shortLookahead*frameTime,
+         kTemporalHysteresisFuture, kTemporalHysteresisFuture*frameTime);
+  if (frameCount > 0) {
+    printf("Tension error: RMS %g, max %g, %g%% of frames over 0.1.\n",
+           std::sqrt(squaredError/frameCount), maxError,
+           100.0*largeErrors/frameCount);
+    printf("Mean speed error at %gX: %g.\n", speed, speedError/frameCount);
+  }
+}
+
 int main(int argc, char** argv) {
   std::string input_file_name;
   std::string output_file_name;
   static const char* usage = "Usage: %s [--speed 3.0]\n"
                 "\t[--nonlinear 1.0] [--match_nonlinear]\n"
-                "\t[--normalization_time 0.0]\n"
+                "\t[--normalization_time 0.0] [--analysis_rate 16000]\n"
+                "\t[--threads 1] [--length seconds [--single_pass]]\n"
+                "\t[--lookahead frames [--lookahead_report]] [--stats]\n"
+                "\t[--fft kiss|fftw|fftw_measure|pocketfft]"
+                " [--fft_wisdom filename]\n"
                 "\t[--tension_file filename] [--speed_file filename]\n"
+                "\t[--dump_format text|f32|npy]\n"
+                "\t[--write_track filename [--track_features]]"
+                " [--read_track filename]\n"
                 "\t--input sound.wav --output fastsound.wav\n"
                 "\t [set nonlinear to 0.0 to get a linear speedup.]\n";
 
@@ -254,6 +1061,10 @@ int main(int argc, char** argv) {
       {
         /* These options set a flag. */
         {"match_nonlinear", no_argument, &match_nonlinear, 1},
+        {"single_pass",   no_argument, &single_pass, 1},   /* For --length */
+        {"track_features", no_argument, &track_features, 1},
+        {"lookahead_report", no_argument, &lookahead_report, 1},
+        {"stats",         no_argument, &print_stats, 1},
         {"linear",        no_argument, NULL, 'l'},    /* Default is nonlinear */
         /* The remaining options have a value and don’t set a flag.
            We distinguish them by their values (last field). */
@@ -262,12 +1073,20 @@ int main(int argc, char** argv) {
         {"speed",         optional_argument, NULL, 's'},
         {"nonlinear",     optional_argument, NULL, 'n'},    /* How nonlinear? */
         {"normalization_time", optional_argument, NULL, 'T'},  /* seconds */
+        {"analysis_rate", required_argument, NULL, 'a'},       /* Hz */
+        {"fft",           required_argument, NULL, 'F'},
+        {"fft_wisdom",    required_argument, NULL, 'W'},
+        {"threads",       required_argument, NULL, 'j'},
+        {"lookahead",     required_argument, NULL, 'L'},      /* frames */
+        {"write_track",   required_argument, NULL, 'w'},
+        {"read_track",    required_argument, NULL, 'r'},
         {"length",        required_argument, NULL, 'e'},    /* total seconds */
         {"tension_file",  optional_argument, NULL, 't'},
         {"speed_file",    optional_argument, NULL, 'p'},
         {"features_file", optional_argument, NULL, 'f'},
         {"spectrogram_file", optional_argument, NULL, 'S'},
         {"normalized_spectrogram_file", optional_argument, NULL, 'N'},
+        {"dump_format",   required_argument, NULL, 'D'},
         {0, 0, 0, 0}
       };
     /* getopt_long stores the option index here. */
@@ -344,54 +1163,142 @@ int main(int argc, char** argv) {
         assert(normalization_time >= 0.0);
         break;
 
+    case 'a':
+        assert(optarg || argv[optind]);
+        if (optarg) {
+          analysis_rate = atoi(optarg);
+        } else {
+          analysis_rate = atoi(argv[optind]);
+        }
+        assert(analysis_rate >= 0);
+        break;
+
+    case 'F':
+        assert(optarg || argv[optind]);
+        {
+          const char* name = optarg ? optarg : argv[optind];
+          int fft;
+          for (fft = kSpeedyFFTKiss; fft <= kSpeedyFFTPocketFFT; fft++) {
+            if (speedyFFTName(fft) && !strcmp(name, speedyFFTName(fft))) {
+              break;
+            }
+          }
+          if (fft > kSpeedyFFTPocketFFT) {
+            fprintf(stderr, "%s: The %s FFT is not compiled in.\n", argv[0],
+                    name);
+            exit(1);
+          }
+          fft_backend = fft;
+        }
+        break;
+
+    case 'W':
+        assert(optarg || argv[optind]);
+        fft_wisdom_name = optarg ? optarg : argv[optind];
+        break;
+
+    case 'j':
+        assert(optarg || argv[optind]);
+        if (optarg) {
+          num_threads = atoi(optarg);
+        } else {
+          num_threads = atoi(argv[optind]);
+        }
+        assert(num_threads >= 1);
+        break;
+
+    case 'L':
+        assert(optarg || argv[optind]);
+        if (optarg) {
+          lookahead = atoi(optarg);
+        } else {
+          lookahead = atoi(argv[optind]);
+        }
+        assert(lookahead >= 0);
+        break;
+
+    case 'w':
+        assert(optarg || argv[optind]);
+        if (optarg) {
+          write_track_name = optarg;
+        } else {
+          write_track_name = argv[optind];
+        }
+        break;
+
+    case 'r':
+        assert(optarg || argv[optind]);
+        if (optarg) {
+          read_track = speedyReadTrack(optarg);
+        } else {
+          read_track = speedyReadTrack(argv[optind]);
+        }
+        if (!read_track) {
+          fprintf(stderr, "%s: Can't read the tension track.\n", argv[0]);
+          exit(1);
+        }
+        break;
+
     case 't':
         assert(optarg || argv[optind]);
         if (optarg) {
-          tension_fp = fopen(optarg, "w");
+          open_dump(&tension_dump, optarg);
         } else {
-          tension_fp = fopen(argv[optind], "w");
+          open_dump(&tension_dump, argv[optind]);
         }
-        assert(tension_fp);
         break;
 
     case 'p':
         assert(optarg || argv[optind]);
         if (optarg) {
-          speed_fp = fopen(optarg, "w");
+          open_dump(&speed_dump, optarg);
         } else {
-          speed_fp = fopen(argv[optind], "w");
+          open_dump(&speed_dump, argv[optind]);
         }
-        assert(speed_fp);
         break;
 
     case 'f':
         assert(optarg || argv[optind]);
         if (optarg) {
-          features_fp = fopen(optarg, "w");
+          open_dump(&features_dump, optarg);
         } else {
-          features_fp = fopen(argv[optind], "w");
+          open_dump(&features_dump, argv[optind]);
         }
-        assert(features_fp);
         break;
 
     case 'S':
         assert(optarg || argv[optind]);
         if (optarg) {
-          spectrogram_fp = fopen(optarg, "w");
+          open_dump(&spectrogram_dump, optarg);
         } else {
-          spectrogram_fp = fopen(argv[optind], "w");
+          open_dump(&spectrogram_dump, argv[optind]);
         }
-        assert(spectrogram_fp);
         break;
 
     case 'N':
         assert(optarg || argv[optind]);
         if (optarg) {
-          normalized_spectrogram_fp = fopen(optarg, "w");
+          open_dump(&normalized_spectrogram_dump, optarg);
         } else {
-          normalized_spectrogram_fp = fopen(argv[optind], "w");
+          open_dump(&normalized_spectrogram_dump, argv[optind]);
+        }
+        break;
+
+    case 'D':
+        assert(optarg || argv[optind]);
+        {
+          const char* format = optarg ? optarg : argv[optind];
+          if (!strcmp(format, "text")) {
+            dump_format = kDumpText;
+          } else if (!strcmp(format, "f32")) {
+            dump_format = kDumpFloat32;
+          } else if (!strcmp(format, "npy")) {
+            dump_format = kDumpNpy;
+          } else {
+            fprintf(stderr, "%s: Unknown dump format %s.\n", argv[0], format);
+            exit(1);
+          }
         }
-        assert(normalized_spectrogram_fp);
         break;
 
     default:
@@ -400,6 +1307,17 @@ int main(int argc, char** argv) {
         exit(1);
     }
   }
+  /* Missing wisdom (e.g. on the first run) just means planning from
+   * scratch.
+   */
+  if (fft_wisdom_name.length() > 0) {
+    speedyImportFFTWisdom(fft_wisdom_name.c_str());
+  }
+  if (lookahead_report && input_file_name.length() > 0) {
+    report_lookahead_error(input_file_name);
+    save_fft_wisdom();
+    return 0;
+  }
   if (output_file_name.length() <= 0) {
     printf("%s: Must specify an output file name.\n", argv[0]);
     exit(1);
@@ -411,26 +1329,24 @@ int main(int argc, char** argv) {
 
   if (match_nonlinear) {
     speed = compress_sound(input_file_name, speed, 1.0, normalization_time, "");
+  } else if (desired_length > 0 && single_pass) {
+    std::cout << "Reading sound from " << input_file_name <<
+        " and speeding it up " <<
+        (nonlinear > 0.0 ? "non-linearly" : "linearly") << " to " <<
+        desired_length << " seconds into " << output_file_name << "." <<
+        std::endl;
+    compress_sound_to_length(input_file_name, desired_length, nonlinear,
+                             normalization_time, output_file_name);
+    close_dumps();
+    save_fft_wisdom();
+    return 0;
   } else if (desired_length > 0) {
-    int sampleRate, numChannels;
-    waveFile waveInputFp = openInputWaveFile(input_file_name.c_str(),
-                                             &sampleRate, &numChannels);
-    if (!waveInputFp) {
-      std::cerr << "Can't open " << input_file_name << " for speedy input." <<
-          std::endl;
-      exit(-1);
-    }
-
-    int totalFramesReadFromWave = 0, framesRead;
-    const int maxSamples = 1000;
-    int16_t* inputBuffer = new int16_t[numChannels*maxSamples];
-    do {
-      /* numSamples and maxSamples are the # of **multi-channel** samples */
-      framesRead = readFromWaveFile(waveInputFp, inputBuffer,
-                                    maxSamples);
-      totalFramesReadFromWave += framesRead;
-    } while (framesRead > 0);
-    delete[] inputBuffer;
+    /* For a mapped file, this only reads the header. */
+    WaveInput wave;
+    open_wave_input(input_file_name, &wave);
+    const int sampleRate = wave.sampleRate;
+    const int totalFramesReadFromWave = wave.frameCount;
+    close_wave_input(&wave);
     auto input_length = totalFramesReadFromWave /
                         static_cast<float>(sampleRate);
     auto desired_speed = input_length / desired_length;
@@ -452,4 +1368,6 @@ int main(int argc, char** argv) {
 
   compress_sound(input_file_name, speed, nonlinear, normalization_time,
                  output_file_name);
+  close_dumps();
+  save_fft_wisdom();
 }